@@ -1444,12 +1444,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- partition: like distribute, and split the rows of the weights among the nodes so that each thread reads local memory\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggerganov/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "partition") { params.numa = GGML_NUMA_STRATEGY_PARTITION; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
@@ -1916,6 +1918,40 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--kv-dynamic"},
+        string_format("let slots draw KV cells on demand from the whole context instead of a fixed n_ctx / n_parallel share;\n"
+                      "requests wait when the cache is full and generating slots may be swapped to host memory (default: %s)", params.kv_dynamic ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_dynamic = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_DYNAMIC"));
+    add_opt(common_arg(
+        {"--kv-spill-ram"}, "N",
+        string_format("host memory in MiB for the KV cache of cached prompts that are evicted from the context;\n"
+                      "a request that continues such a prompt restores it instead of recomputing it (default: %d, 0 = disabled)", params.kv_spill_ram),
+        [](common_params & params, int value) {
+            params.kv_spill_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_RAM"));
+    add_opt(common_arg(
+        {"--kv-spill-path"}, "PATH",
+        "directory to move the evicted prompts to when --kv-spill-ram is full (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_spill_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_spill_path.empty() && params.kv_spill_path[params.kv_spill_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_spill_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_PATH"));
+    add_opt(common_arg(
+        {"--kv-spill-disk"}, "N",
+        string_format("disk space in MiB for the evicted prompts in --kv-spill-path (default: %d, 0 = unlimited)", params.kv_spill_disk),
+        [](common_params & params, int value) {
+            params.kv_spill_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_DISK"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
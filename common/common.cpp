@@ -1077,6 +1077,15 @@ void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adap
     }
 }
 
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora) {
+    llama_clear_adapter_lora_seq(ctx, seq_id);
+    for (auto & la : lora) {
+        if (la.scale != 0.0f) {
+            llama_set_adapter_lora_seq(ctx, seq_id, la.ptr, la.scale);
+        }
+    }
+}
+
 struct llama_model_params common_model_params_to_llama(common_params & params) {
     auto mparams = llama_model_default_params();
 
@@ -1723,6 +1732,45 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+    const struct llama_vocab * vocab,
+    const std::vector<std::string> & texts,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    const int32_t n_texts = texts.size();
+
+    std::vector<std::vector<llama_token>> result(n_texts);
+
+    std::vector<const char *>  ptrs(n_texts);
+    std::vector<int32_t>       lens(n_texts);
+    std::vector<llama_token *> bufs(n_texts);
+    std::vector<int32_t>       n_tokens_max(n_texts);
+    std::vector<int32_t>       n_tokens(n_texts);
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        // upper limit for the number of tokens
+        result[i].resize(texts[i].length() + 2 * add_special);
+
+        ptrs[i]         = texts[i].data();
+        lens[i]         = texts[i].length();
+        bufs[i]         = result[i].data();
+        n_tokens_max[i] = result[i].size();
+    }
+
+    llama_tokenize_batch(vocab, ptrs.data(), lens.data(), n_texts, bufs.data(), n_tokens_max.data(), n_tokens.data(), add_special, parse_special, n_threads);
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        if (n_tokens[i] < 0) {
+            result[i] = common_tokenize(vocab, texts[i], add_special, parse_special);
+        } else {
+            result[i].resize(n_tokens[i]);
+        }
+    }
+
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
@@ -330,6 +330,9 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    bool    kv_dynamic     = false;        // slots draw KV cells on demand from the shared cache instead of n_ctx / n_parallel
+    int32_t kv_spill_ram   = 0;            // host memory for the KV cache of evicted prompts, in MiB
+    int32_t kv_spill_disk  = 0;            // disk space for the KV cache of evicted prompts, in MiB (0 = unlimited)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -351,6 +354,7 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string kv_spill_path; // directory for the KV cache of evicted prompts
 
     float slot_prompt_similarity = 0.5f;
 
@@ -532,6 +536,9 @@ std::pair<std::string, std::string> common_get_hf_file(
 // clear LoRA adapters from context, then apply new list of adapters
 void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adapter_lora_info> & lora);
 
+// clear the LoRA adapters of a sequence, then apply new list of adapters to it
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora);
+
 //
 // Batch utils
 //
@@ -573,6 +580,14 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes multiple strings in parallel
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+    const struct llama_vocab * vocab,
+    const std::vector<std::string> & texts,
+                        bool   add_special,
+                        bool   parse_special = false,
+                     int32_t   n_threads     = -1);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string common_token_to_piece(
@@ -0,0 +1,350 @@
+#include "fft.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+//
+// complex FFT (Stockham autosort, decimation in frequency)
+//
+// each stage of radix R maps x to y with
+//
+//   y[q + s*(R*p + k)] = w^(p*k) * sum_j x[q + s*(p + j*m)] * exp(sg*2*pi*i*j*k/R)
+//
+// for p in [0, m), q in [0, s), so that the output is in natural order without a bit-reversal pass
+// the loop over q is contiguous and is vectorized by the compiler in the later stages, where s is large
+//
+
+// b_k = sum_j a_j * exp(sg*2*pi*i*j*k/R), in place
+template <int R>
+static inline void fft_butterfly(float * ar, float * ai, float sg);
+
+template <>
+inline void fft_butterfly<2>(float * ar, float * ai, float /*sg*/) {
+    const float r0 = ar[0] + ar[1];
+    const float i0 = ai[0] + ai[1];
+    const float r1 = ar[0] - ar[1];
+    const float i1 = ai[0] - ai[1];
+
+    ar[0] = r0; ai[0] = i0;
+    ar[1] = r1; ai[1] = i1;
+}
+
+template <>
+inline void fft_butterfly<3>(float * ar, float * ai, float sg) {
+    const float c = -0.5f;
+    const float s = sg*0.86602540378443864676f; // sin(2*pi/3)
+
+    const float tr = ar[1] + ar[2];
+    const float ti = ai[1] + ai[2];
+    const float dr = ar[1] - ar[2];
+    const float di = ai[1] - ai[2];
+
+    const float mr = ar[0] + c*tr;
+    const float mi = ai[0] + c*ti;
+
+    ar[0] += tr;
+    ai[0] += ti;
+
+    // m +/- i*s*d
+    ar[1] = mr - s*di; ai[1] = mi + s*dr;
+    ar[2] = mr + s*di; ai[2] = mi - s*dr;
+}
+
+template <>
+inline void fft_butterfly<4>(float * ar, float * ai, float sg) {
+    const float t0r = ar[0] + ar[2];
+    const float t0i = ai[0] + ai[2];
+    const float t1r = ar[0] - ar[2];
+    const float t1i = ai[0] - ai[2];
+    const float t2r = ar[1] + ar[3];
+    const float t2i = ai[1] + ai[3];
+
+    // i*sg*(a1 - a3)
+    const float t3r = -sg*(ai[1] - ai[3]);
+    const float t3i =  sg*(ar[1] - ar[3]);
+
+    ar[0] = t0r + t2r; ai[0] = t0i + t2i;
+    ar[1] = t1r + t3r; ai[1] = t1i + t3i;
+    ar[2] = t0r - t2r; ai[2] = t0i - t2i;
+    ar[3] = t1r - t3r; ai[3] = t1i - t3i;
+}
+
+template <>
+inline void fft_butterfly<5>(float * ar, float * ai, float sg) {
+    const float c1 =  0.30901699437494742410f; // cos(2*pi/5)
+    const float c2 = -0.80901699437494742410f; // cos(4*pi/5)
+    const float s1 = sg*0.95105651629515357212f; // sin(2*pi/5)
+    const float s2 = sg*0.58778525229247312917f; // sin(4*pi/5)
+
+    const float t1r = ar[1] + ar[4];
+    const float t1i = ai[1] + ai[4];
+    const float t2r = ar[2] + ar[3];
+    const float t2i = ai[2] + ai[3];
+    const float d1r = ar[1] - ar[4];
+    const float d1i = ai[1] - ai[4];
+    const float d2r = ar[2] - ar[3];
+    const float d2i = ai[2] - ai[3];
+
+    const float m1r = ar[0] + c1*t1r + c2*t2r;
+    const float m1i = ai[0] + c1*t1i + c2*t2i;
+    const float m2r = ar[0] + c2*t1r + c1*t2r;
+    const float m2i = ai[0] + c2*t1i + c1*t2i;
+
+    const float n1r = s1*d1r + s2*d2r;
+    const float n1i = s1*d1i + s2*d2i;
+    const float n2r = s2*d1r - s1*d2r;
+    const float n2i = s2*d1i - s1*d2i;
+
+    ar[0] += t1r + t2r;
+    ai[0] += t1i + t2i;
+
+    // m +/- i*n
+    ar[1] = m1r - n1i; ai[1] = m1i + n1r;
+    ar[4] = m1r + n1i; ai[4] = m1i - n1r;
+    ar[2] = m2r - n2i; ai[2] = m2i + n2r;
+    ar[3] = m2r + n2i; ai[3] = m2i - n2r;
+}
+
+template <int R>
+static void fft_stage(
+        int m, int s, float sg, const float * tw_re, const float * tw_im,
+        const float * xr, const float * xi, float * yr, float * yi) {
+    for (int p = 0; p < m; ++p) {
+        float wr[R];
+        float wi[R];
+        for (int k = 1; k < R; ++k) {
+            wr[k] = tw_re[p*(R - 1) + k - 1];
+            wi[k] = tw_im[p*(R - 1) + k - 1];
+        }
+
+        for (int q = 0; q < s; ++q) {
+            float ar[R];
+            float ai[R];
+            for (int j = 0; j < R; ++j) {
+                ar[j] = xr[q + s*(p + j*m)];
+                ai[j] = xi[q + s*(p + j*m)];
+            }
+
+            fft_butterfly<R>(ar, ai, sg);
+
+            yr[q + s*(R*p)] = ar[0];
+            yi[q + s*(R*p)] = ai[0];
+            for (int k = 1; k < R; ++k) {
+                yr[q + s*(R*p + k)] = ar[k]*wr[k] - ai[k]*wi[k];
+                yi[q + s*(R*p + k)] = ar[k]*wi[k] + ai[k]*wr[k];
+            }
+        }
+    }
+}
+
+// any other radix, with a plain DFT as the butterfly
+static void fft_stage_generic(
+        int r, int m, int s, float sg, const float * tw_re, const float * tw_im, const float * om_re, const float * om_im,
+        const float * xr, const float * xi, float * yr, float * yi) {
+    for (int p = 0; p < m; ++p) {
+        for (int q = 0; q < s; ++q) {
+            for (int k = 0; k < r; ++k) {
+                float br = 0.0f;
+                float bi = 0.0f;
+                for (int j = 0; j < r; ++j) {
+                    const int   jk = (j*k) % r;
+                    const float cr = om_re[jk];
+                    const float ci = sg < 0 ? om_im[jk] : -om_im[jk];
+                    const float xr_j = xr[q + s*(p + j*m)];
+                    const float xi_j = xi[q + s*(p + j*m)];
+
+                    br += xr_j*cr - xi_j*ci;
+                    bi += xr_j*ci + xi_j*cr;
+                }
+
+                if (k > 0) {
+                    const float wr = tw_re[p*(r - 1) + k - 1];
+                    const float wi = tw_im[p*(r - 1) + k - 1];
+
+                    const float tr = br*wr - bi*wi;
+                    bi = br*wi + bi*wr;
+                    br = tr;
+                }
+
+                yr[q + s*(r*p + k)] = br;
+                yi[q + s*(r*p + k)] = bi;
+            }
+        }
+    }
+}
+
+common_fft::common_fft(int n) : n(n), h(n/2) {
+    if (n < 2 || n % 2 != 0) {
+        throw std::invalid_argument("FFT size must be even");
+    }
+
+    // split h into radixes, largest sub-transforms first
+    std::vector<int> radixes;
+    {
+        int rem = h;
+        while (rem % 4 == 0) {
+            radixes.push_back(4);
+            rem /= 4;
+        }
+        for (int r : { 2, 3, 5 }) {
+            while (rem % r == 0) {
+                radixes.push_back(r);
+                rem /= r;
+            }
+        }
+        for (int r = 7; rem > 1; r += 2) {
+            while (rem % r == 0) {
+                radixes.push_back(r);
+                rem /= r;
+            }
+        }
+    }
+
+    int s = 1;
+    int l = h;
+    for (int r : radixes) {
+        stage st;
+        st.radix = r;
+        st.m     = l / r;
+        st.s     = s;
+
+        st.tw_re    .resize(st.m*(r - 1));
+        st.tw_im    .resize(st.m*(r - 1));
+        st.tw_im_inv.resize(st.m*(r - 1));
+        for (int p = 0; p < st.m; ++p) {
+            for (int k = 1; k < r; ++k) {
+                const double a = -2.0*M_PI*(double)(p*k)/(double) l;
+                st.tw_re    [p*(r - 1) + k - 1] =  cos(a);
+                st.tw_im    [p*(r - 1) + k - 1] =  sin(a);
+                st.tw_im_inv[p*(r - 1) + k - 1] = -sin(a);
+            }
+        }
+
+        if (r > 5) {
+            st.om_re.resize(r);
+            st.om_im.resize(r);
+            for (int j = 0; j < r; ++j) {
+                const double a = -2.0*M_PI*(double) j/(double) r;
+                st.om_re[j] = cos(a);
+                st.om_im[j] = sin(a);
+            }
+        }
+
+        stages.push_back(std::move(st));
+
+        s *= r;
+        l /= r;
+    }
+
+    rt_re.resize(h + 1);
+    rt_im.resize(h + 1);
+    for (int k = 0; k <= h; ++k) {
+        const double a = -2.0*M_PI*(double) k/(double) n;
+        rt_re[k] = cos(a);
+        rt_im[k] = sin(a);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        buf_re[i].resize(h);
+        buf_im[i].resize(h);
+    }
+}
+
+int common_fft::transform(bool inverse) {
+    const float sg = inverse ? 1.0f : -1.0f;
+
+    int cur = 0;
+    for (const auto & st : stages) {
+        const float * tw_im = inverse ? st.tw_im_inv.data() : st.tw_im.data();
+
+        const float * xr = buf_re[cur].data();
+        const float * xi = buf_im[cur].data();
+        float       * yr = buf_re[1 - cur].data();
+        float       * yi = buf_im[1 - cur].data();
+
+        switch (st.radix) {
+            case 2: fft_stage<2>(st.m, st.s, sg, st.tw_re.data(), tw_im, xr, xi, yr, yi); break;
+            case 3: fft_stage<3>(st.m, st.s, sg, st.tw_re.data(), tw_im, xr, xi, yr, yi); break;
+            case 4: fft_stage<4>(st.m, st.s, sg, st.tw_re.data(), tw_im, xr, xi, yr, yi); break;
+            case 5: fft_stage<5>(st.m, st.s, sg, st.tw_re.data(), tw_im, xr, xi, yr, yi); break;
+            default:
+                fft_stage_generic(st.radix, st.m, st.s, sg, st.tw_re.data(), tw_im, st.om_re.data(), st.om_im.data(), xr, xi, yr, yi);
+                break;
+        }
+
+        cur = 1 - cur;
+    }
+
+    return cur;
+}
+
+//
+// real FFT of length n from a complex FFT of length h = n/2 over z[j] = x[2j] + i*x[2j+1]
+//
+// with E and O the transforms of the even and odd samples, and t = exp(-2*pi*i*k/n):
+//
+//   Z[k] = E[k] + i*O[k],  X[k] = E[k] + t*O[k],  X[k + h] = E[k] - t*O[k]
+//
+
+void common_fft::forward(const float * x, float * X) {
+    for (int j = 0; j < h; ++j) {
+        buf_re[0][j] = x[2*j + 0];
+        buf_im[0][j] = x[2*j + 1];
+    }
+
+    const int cur = transform(false);
+
+    const float * zr = buf_re[cur].data();
+    const float * zi = buf_im[cur].data();
+
+    for (int k = 0; k <= h; ++k) {
+        const int k0 = k % h;
+        const int k1 = (h - k) % h;
+
+        // E = (Z[k] + conj(Z[h - k]))/2, O = (Z[k] - conj(Z[h - k]))/(2i)
+        const float er = 0.5f*(zr[k0] + zr[k1]);
+        const float ei = 0.5f*(zi[k0] - zi[k1]);
+        const float or_ = 0.5f*(zi[k0] + zi[k1]);
+        const float oi = -0.5f*(zr[k0] - zr[k1]);
+
+        X[2*k + 0] = er + rt_re[k]*or_ - rt_im[k]*oi;
+        X[2*k + 1] = ei + rt_re[k]*oi  + rt_im[k]*or_;
+    }
+}
+
+void common_fft::inverse(const float * X, float * x) {
+    for (int k = 0; k < h; ++k) {
+        // a = X[k], b = conj(X[h - k]), the imaginary parts of X[0] and X[h] are dropped
+        const float ar = X[2*k + 0];
+        const float ai = k == 0 ? 0.0f :  X[2*k + 1];
+        const float br = X[2*(h - k) + 0];
+        const float bi = k == 0 ? 0.0f : -X[2*(h - k) + 1];
+
+        // E = a + b, O = (a - b)*conj(t)
+        const float er = ar + br;
+        const float ei = ai + bi;
+        const float dr = ar - br;
+        const float di = ai - bi;
+        const float or_ = dr*rt_re[k] + di*rt_im[k];
+        const float oi  = di*rt_re[k] - dr*rt_im[k];
+
+        // Z = E + i*O
+        buf_re[0][k] = er - oi;
+        buf_im[0][k] = ei + or_;
+    }
+
+    const int cur = transform(true);
+
+    const float * zr = buf_re[cur].data();
+    const float * zi = buf_im[cur].data();
+
+    const float scale = 1.0f/n;
+    for (int j = 0; j < h; ++j) {
+        x[2*j + 0] = zr[j]*scale;
+        x[2*j + 1] = zi[j]*scale;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+// FFT of real sequences of even length, computed with a mixed-radix (2, 3, 4, 5 and generic) complex FFT of half
+// the length. the twiddle factors are computed once per object, and the object keeps its work buffers - use one
+// object per thread
+//
+// the complex values are interleaved (re, im)
+//
+struct common_fft {
+    common_fft(int n);
+
+    int size() const { return n; }
+
+    // x[n] -> X[n/2 + 1], not normalized like numpy.fft.rfft
+    void forward(const float * x, float * X);
+
+    // X[n/2 + 1] -> x[n], normalized by 1/n like numpy.fft.irfft
+    // the imaginary parts of X[0] and X[n/2] are ignored
+    void inverse(const float * X, float * x);
+
+private:
+    struct stage {
+        int radix;
+        int m;    // length of the sub-transforms after this stage
+        int s;    // stride of the sub-transforms before this stage
+
+        // w^(p*k) for p in [0, m) and k in [1, radix), w = exp(-2*pi*i/(radix*m)), and the conjugates
+        std::vector<float> tw_re;
+        std::vector<float> tw_im;
+        std::vector<float> tw_im_inv;
+
+        // exp(-2*pi*i*j/radix) for j in [0, radix), only for the radixes without a specialized butterfly
+        std::vector<float> om_re;
+        std::vector<float> om_im;
+    };
+
+    int n;
+    int h; // n/2, the length of the complex FFT
+
+    std::vector<stage> stages;
+
+    // exp(-2*pi*i*k/n) for k in [0, h]
+    std::vector<float> rt_re;
+    std::vector<float> rt_im;
+
+    // work buffers for the complex FFT, split into real and imaginary parts
+    std::vector<float> buf_re[2];
+    std::vector<float> buf_im[2];
+
+    // complex FFT of buf_re[0], buf_im[0], not normalized - returns the index of the buffers with the result
+    int transform(bool inverse);
+};
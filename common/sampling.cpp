@@ -110,7 +110,8 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
+    // when the chain is applied first, the candidates are pre-selected by the chain in its own buffer
+    void set_logits(struct llama_context * ctx, int idx, bool chain_first) {
         const auto * logits = llama_get_logits_ith(ctx, idx);
 
         const llama_model * model = llama_get_model(ctx);
@@ -118,6 +119,11 @@ struct common_sampler {
 
         const int n_vocab = llama_vocab_n_tokens(vocab);
 
+        if (chain_first) {
+            cur_p = llama_sampler_chain_candidates(chain, logits, n_vocab);
+            return;
+        }
+
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -271,7 +277,7 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(ctx, idx, !grammar_first);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -306,7 +312,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(ctx, idx, false);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
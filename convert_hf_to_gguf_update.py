@@ -320,6 +320,10 @@ tests = [
     "333333333",
     "Cửa Việt", # llama-bpe fails on this
     " discards",
+    "line\u2028separator\u2029paragraph",
+    "a\u2028 \u2029\n\u2028b",
+    "\u00a0no-break\u3000ideographic\u2009thin space",
+    "naïve café ٣٤٥ ²³ Ⅻ_word",
     CHK_TXT,
 ]
 
@@ -17,11 +17,13 @@
 #endif
 
 #include "ggml-rpc.h"
+#include "common.h"
 #ifdef _WIN32
 #  include <windows.h>
 #else
 #  include <unistd.h>
 #endif
+#include <cstdlib>
 #include <string>
 #include <stdio.h>
 
@@ -29,6 +31,7 @@ struct rpc_server_params {
     std::string host        = "127.0.0.1";
     int         port        = 50052;
     size_t      backend_mem = 0;
+    bool        use_cache   = false;
 };
 
 static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
@@ -38,6 +41,7 @@ static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
     fprintf(stderr, "  -H HOST, --host HOST  host to bind to (default: %s)\n", params.host.c_str());
     fprintf(stderr, "  -p PORT, --port PORT  port to bind to (default: %d)\n", params.port);
     fprintf(stderr, "  -m MEM, --mem MEM     backend memory size (in MB)\n");
+    fprintf(stderr, "  -c,     --cache       enable the local cache of the weights, not bounded in size (default: %s)\n", params.use_cache ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
@@ -63,6 +67,8 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
                 return false;
             }
             params.backend_mem = std::stoul(argv[i]) * 1024 * 1024;
+        } else if (arg == "-c" || arg == "--cache") {
+            params.use_cache = true;
         } else if (arg == "-h" || arg == "--help") {
             print_usage(argc, argv, params);
             exit(0);
@@ -164,8 +170,19 @@ int main(int argc, char * argv[]) {
     } else {
         get_backend_memory(&free_mem, &total_mem);
     }
+    std::string cache_dir;
+    if (params.use_cache) {
+        // the cache is not bounded and files are never evicted, remove the directory to free the space
+        cache_dir = fs_get_cache_directory() + "rpc" + DIRECTORY_SEPARATOR;
+        if (!fs_create_directory_with_parents(cache_dir)) {
+            fprintf(stderr, "Failed to create cache directory: %s\n", cache_dir.c_str());
+            return 1;
+        }
+        printf("Using cache directory: %s\n", cache_dir.c_str());
+    }
+
     printf("Starting RPC server on %s, backend memory: %zu MB\n", endpoint.c_str(), free_mem / (1024 * 1024));
-    ggml_backend_rpc_start_server(backend, endpoint.c_str(), free_mem, total_mem);
+    ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir.empty() ? nullptr : cache_dir.c_str(), free_mem, total_mem);
     ggml_backend_free(backend);
     return 0;
 }
@@ -24,6 +24,8 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <functional>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -68,6 +70,7 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_KV_IO,
 };
 
 enum oaicompat_type {
@@ -1175,6 +1178,22 @@ struct server_slot {
 
     llama_tokens cache_tokens;
 
+    // the KV cells of the slot below this position may also belong to the slots it shares a prompt prefix with,
+    // so they must not be shifted - the cells at and above it belong to this slot only
+    int32_t n_shared = 0;
+
+    // KV cells of a preempted slot, kept in host memory until there is room to resume it (--kv-dynamic)
+    bool kv_swapped = false;
+    std::vector<uint8_t> kv_swap;
+
+    // a /slots restore is reading the file of the slot in the background
+    bool kv_loading = false;
+
+    // the store of evicted prompts was searched for the new prompt (--kv-spill-ram, --kv-spill-path), and the
+    // stored prompt that the new prompt waits for while it is read back from disk
+    bool    kv_fetched  = false;
+    int64_t kv_fetch_id = -1;
+
     std::vector<completion_token_output> generated_token_probs;
 
     bool has_next_token = true;
@@ -1224,9 +1243,9 @@ struct server_slot {
         return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
     }
 
+    // the slots can use different LoRA adapters, they are applied per sequence
     bool can_batch_with(server_slot & other_slot) {
-        return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+        return is_non_causal() == other_slot.is_non_causal();
     }
 
     bool has_budget(const common_params & global_params) {
@@ -1268,6 +1287,17 @@ struct server_slot {
             t_last_used = ggml_time_us();
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
             state = SLOT_STATE_IDLE;
+
+            if (kv_swapped) {
+                // the swapped cells are dropped, so there is nothing cached for the next request
+                cache_tokens.clear();
+                kv_swap = {};
+                kv_swapped = false;
+            }
+
+            // the adapters stay in the stack of the context while a sequence uses them
+            llama_clear_adapter_lora_seq(ctx, id);
+
             callback_on_release(id);
         }
     }
@@ -1340,6 +1370,7 @@ struct server_slot {
             {"n_ctx",         n_ctx},
             {"speculative",   can_speculate()},
             {"is_processing", is_processing()},
+            {"kv_swapped",    kv_swapped},
             {"non_causal",    is_non_causal()},
             {"params",        params.to_json()},
             {"prompt",        common_detokenize(ctx, prompt_tokens)},
@@ -1378,10 +1409,14 @@ struct server_metrics {
     }
 
     void on_prompt_eval(const server_slot & slot) {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
-        t_prompt_processing             += slot.t_prompt_processing;
-        t_prompt_processing_total       += slot.t_prompt_processing;
+        on_prompt_eval(slot.n_prompt_tokens_processed, slot.t_prompt_processing);
+    }
+
+    void on_prompt_eval(int32_t n_tokens, double t_ms) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_ms;
+        t_prompt_processing_total       += t_ms;
     }
 
     void on_prediction(const server_slot & slot) {
@@ -1684,6 +1719,259 @@ struct server_response {
     }
 };
 
+// runs the iterations of a loop on a set of persistent worker threads together with the calling thread
+struct server_worker_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable condition_start;
+    std::condition_variable condition_done;
+
+    std::function<void(int)> func;
+
+    std::atomic<int> i_next = 0;
+
+    int n_iter    = 0;
+    int n_busy    = 0;     // number of workers that have not finished the current loop
+    int64_t epoch = 0;     // incremented for each loop
+    bool running  = true;
+
+    void start(int n_workers) {
+        for (int i = 0; i < n_workers; i++) {
+            workers.emplace_back([this]() {
+                int64_t epoch_last = 0;
+
+                while (true) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        condition_start.wait(lock, [&]{
+                            return !running || epoch != epoch_last;
+                        });
+
+                        if (!running) {
+                            return;
+                        }
+
+                        epoch_last = epoch;
+                    }
+
+                    work();
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        if (--n_busy == 0) {
+                            condition_done.notify_one();
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    ~server_worker_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition_start.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    void work() {
+        for (int i = i_next++; i < n_iter; i = i_next++) {
+            func(i);
+        }
+    }
+
+    // calls f(i) for i in [0, n) and returns when all calls are done
+    void run(int n, const std::function<void(int)> & f) {
+        if (n <= 1 || workers.empty()) {
+            for (int i = 0; i < n; i++) {
+                f(i);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            func   = f;
+            n_iter = n;
+            i_next = 0;
+            n_busy = workers.size();
+            epoch++;
+        }
+        condition_start.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [&]{
+            return n_busy == 0;
+        });
+    }
+};
+
+// runs the file I/O of the server on a background thread, so that it does not stall the slots
+// each job returns a completion, which is run on the main loop by complete()
+struct server_io_worker {
+    using completion = std::function<void()>;
+    using job        = std::function<completion()>;
+
+    std::thread worker;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    std::deque<job>        jobs;
+    std::deque<completion> done;
+
+    std::function<void()> on_done; // wakes up the main loop
+
+    bool running = false;
+
+    void start(std::function<void()> callback) {
+        on_done = std::move(callback);
+        running = true;
+
+        worker = std::thread([this]() {
+            while (true) {
+                job j;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&]{
+                        return !running || !jobs.empty();
+                    });
+
+                    // the queue is drained before exiting, so that no slot save or prompt spill is lost
+                    if (jobs.empty()) {
+                        return;
+                    }
+
+                    j = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                completion c = j();
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    done.push_back(std::move(c));
+                }
+                on_done();
+            }
+        });
+    }
+
+    // the queued jobs are finished before the thread is joined, their completions are not run
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_one();
+
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    ~server_io_worker() {
+        stop();
+    }
+
+    void push(job j) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.push_back(std::move(j));
+        }
+        condition.notify_one();
+    }
+
+    void complete() {
+        std::deque<completion> ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.swap(done);
+        }
+
+        for (auto & c : ready) {
+            c();
+        }
+    }
+};
+
+// the sequence state files use the layout of llama_state_seq_save_file(), so the slot files and the spilled
+// prompts can be read with either API
+static size_t kv_state_file_write(const std::string & path, const llama_tokens & tokens, const std::vector<uint8_t> & data) {
+    FILE * f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        return 0;
+    }
+
+    const uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) tokens.size() };
+
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+    ok = ok && (tokens.empty() || fwrite(tokens.data(), sizeof(llama_token) * tokens.size(), 1, f) == 1);
+    ok = ok && (data.empty()   || fwrite(data.data(), data.size(), 1, f) == 1);
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok) {
+        std::remove(path.c_str());
+        return 0;
+    }
+
+    return sizeof(header) + sizeof(llama_token) * tokens.size() + data.size();
+}
+
+static size_t kv_state_file_read(const std::string & path, size_t n_token_capacity, llama_tokens & tokens, std::vector<uint8_t> & data) {
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        return 0;
+    }
+
+    uint32_t header[3];
+
+    bool ok = fread(header, sizeof(header), 1, f) == 1;
+    ok = ok && header[0] == LLAMA_STATE_SEQ_MAGIC && header[1] == LLAMA_STATE_SEQ_VERSION && header[2] <= n_token_capacity;
+
+    long size = 0;
+    if (ok) {
+        tokens.resize(header[2]);
+        ok = tokens.empty() || fread(tokens.data(), sizeof(llama_token) * tokens.size(), 1, f) == 1;
+
+        const long pos = ftell(f);
+        ok = ok && pos >= 0 && fseek(f, 0, SEEK_END) == 0;
+        size = ftell(f);
+        ok = ok && size >= pos && fseek(f, pos, SEEK_SET) == 0;
+
+        if (ok) {
+            data.resize(size - pos);
+            ok = data.empty() || fread(data.data(), data.size(), 1, f) == 1;
+        }
+    }
+    fclose(f);
+
+    return ok ? size : 0;
+}
+
+// cached prompt that was evicted from the KV cache, kept in host memory or in a file (--kv-spill-ram, --kv-spill-path)
+struct server_kv_entry {
+    int64_t id = 0;
+
+    llama_tokens tokens;
+    std::vector<common_adapter_lora_info> lora;
+
+    std::shared_ptr<std::vector<uint8_t>> data; // sequence state in host memory, null if it is only on disk
+    std::string path;                           // file with the sequence state, empty if it is not written yet
+    size_t n_bytes = 0;
+
+    bool writing = false;
+    bool reading = false;
+};
+
 struct server_context {
     common_params params_base;
 
@@ -1712,6 +2000,10 @@ struct server_context {
     std::vector<server_slot> slots;
     json default_generation_settings_for_props;
 
+    // the embedding and rerank tasks of a non-causal model are encoded without a slot, see update_embeddings()
+    bool embd_packed = false;
+    std::vector<server_task> queue_embd;
+
     server_queue    queue_tasks;
     server_response queue_results;
 
@@ -1720,9 +2012,31 @@ struct server_context {
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // samples the slots of a batch in parallel
+    server_worker_pool sampling_pool;
+
     common_chat_templates chat_templates;
 
+    // prompts evicted from the KV cache, least recently used first
+    std::list<server_kv_entry> kv_store;
+    int64_t kv_store_id = 0;
+    std::string kv_store_prefix; // file name prefix of the spilled prompts
+
+    // the slot files that a /slots save or restore is writing or reading, other requests on them are deferred
+    std::unordered_set<std::string> slot_files_busy;
+
+    // keep last - the jobs refer to the other members
+    server_io_worker io_worker;
+
     ~server_context() {
+        io_worker.stop();
+
+        for (const auto & entry : kv_store) {
+            if (!entry.path.empty()) {
+                std::remove(entry.path.c_str());
+            }
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             common_sampler_free(slot.smpl);
@@ -1755,6 +2069,9 @@ struct server_context {
             return false;
         }
 
+        // the LoRA adapters of the slots are applied to their sequences, see update_slots()
+        llama_clear_adapter_lora(ctx);
+
         vocab = llama_model_get_vocab(model);
 
         n_ctx = llama_n_ctx(ctx);
@@ -1840,7 +2157,19 @@ struct server_context {
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+        if (kv_store_enabled() && llama_model_is_recurrent(model)) {
+            SRV_WRN("%s", "spilling evicted prompts is not supported for recurrent models\n");
+            params_base.kv_spill_ram = 0;
+            params_base.kv_spill_path.clear();
+        }
+
+        if (params_base.kv_dynamic && llama_model_is_recurrent(model)) {
+            SRV_WRN("%s", "dynamic KV budget is not supported for recurrent models, using a fixed share of the context per slot\n");
+            params_base.kv_dynamic = false;
+        }
+
+        // with a dynamic KV budget, each slot can use the whole context and the cells are handed out on demand
+        const int32_t n_ctx_slot = params_base.kv_dynamic ? n_ctx : n_ctx / params_base.n_parallel;
 
         SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
 
@@ -1883,150 +2212,758 @@ struct server_context {
 
         default_generation_settings_for_props = slots[0].to_json();
 
+        embd_packed = (params_base.embedding || params_base.reranking) && llama_model_is_non_causal(model);
+        if (embd_packed) {
+            SRV_INF("%s", "non-causal model: the prompts of the embedding and rerank requests are packed without using the slots\n");
+        }
+
+        // the slot files and the spilled prompts are read and written in the background
+        if (kv_store_enabled() || !params_base.slot_save_path.empty()) {
+            if (kv_store_enabled()) {
+                SRV_INF("spilling evicted prompts to %d MiB of host memory%s%s\n", params_base.kv_spill_ram,
+                        params_base.kv_spill_path.empty() ? "" : " and to ", params_base.kv_spill_path.c_str());
+            }
+
+            kv_store_prefix = string_format("kv-spill-%" PRId64 "-", (int64_t) std::chrono::system_clock::now().time_since_epoch().count());
+
+            io_worker.start([this]() {
+                server_task task(SERVER_TASK_TYPE_KV_IO);
+                task.id = queue_tasks.get_new_id();
+                queue_tasks.post(task);
+            });
+        }
+
+        // the compute threads are idle while the slots are sampled
+        {
+            const int n_workers = std::min(params_base.n_parallel, params_base.cpuparams.n_threads) - 1;
+            if (n_workers > 0) {
+                SRV_INF("sampling the slots with %d threads\n", n_workers + 1);
+                sampling_pool.start(n_workers);
+            }
+        }
+
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
         // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
             const int32_t n_batch = llama_n_batch(ctx);
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
-        }
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        }
+
+        metrics.init();
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+            int lcs_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing() || slot.kv_loading) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains cached tokens
+                if (slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing() || slot.kv_loading) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        slot.reset();
+        slot.id_task       = task.id;
+        slot.index         = task.index;
+        slot.task_type     = task.type;
+        slot.params        = std::move(task.params);
+        slot.prompt_tokens = std::move(task.prompt_tokens);
+
+        if (!are_lora_equal(task.params.lora, slot.lora)) {
+            // if lora is changed, we cannot reuse cached tokens
+            slot.cache_tokens.clear();
+            slot.lora = task.params.lora;
+        }
+
+        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
+            // Might be better to reject the request with a 400 ?
+            slot.params.n_predict = slot.n_predict;
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
+        }
+
+        if (slot.params.ignore_eos && has_eos_token) {
+            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
+        }
+
+        {
+            // free the previous sampler after creating the new one, so that a compiled grammar with the same
+            // source can be reused by consecutive requests
+            common_sampler * smpl_prev = slot.smpl;
+
+            slot.smpl = common_sampler_init(model, slot.params.sampling);
+
+            if (smpl_prev != nullptr) {
+                common_sampler_free(smpl_prev);
+            }
+
+            if (slot.smpl == nullptr) {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        if (slot.ctx_dft) {
+            llama_batch_free(slot.batch_spec);
+
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        }
+
+        slot.kv_fetched  = false;
+        slot.kv_fetch_id = -1;
+
+        slot.state = SLOT_STATE_STARTED;
+
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
+    }
+
+    void kv_cache_clear() {
+        SRV_DBG("%s", "clearing KV cache\n");
+
+        // clear the entire KV cache
+        llama_kv_cache_clear(ctx);
+        clean_kv_cache = false;
+    }
+
+    // find the slot whose cached tokens share the longest prefix with the prompt and, if it is longer than
+    // the one already cached by this slot, attach the slot to the KV cells of that prefix instead of
+    // recomputing it. the cells are shared by adding the seq_id of the slot to them - they are never
+    // modified in place, so each slot writes the tokens after the shared prefix to new cells, and neither
+    // slot shifts its cells below n_shared
+    void share_prefix(server_slot & slot, const llama_tokens & prompt_tokens) {
+        if (llama_model_is_recurrent(model)) {
+            return;
+        }
+
+        server_slot * src = nullptr;
+        int n_share = slot.n_past;
+
+        for (server_slot & other : slots) {
+            if (other.id == slot.id || other.cache_tokens.empty() || other.kv_swapped || !are_lora_equal(other.lora, slot.lora)) {
+                continue;
+            }
+
+            // the last cached tokens of the other slot might not be evaluated yet, and a slot that started its
+            // prompt in the same update has none of them in the KV cache - llama_kv_cache_seq_pos_max() returns 0
+            // for an empty sequence, so a single evaluated cell cannot be told apart from none and is not shared
+            const llama_pos pos_max = llama_kv_cache_seq_pos_max(ctx, other.id);
+            if (pos_max <= 0) {
+                continue;
+            }
+
+            const int n_evaluated = pos_max + 1;
+            const int n_common    = std::min((int) common_lcp(other.cache_tokens, prompt_tokens), n_evaluated);
+
+            if (n_common > n_share) {
+                n_share = n_common;
+                src     = &other;
+            }
+        }
+
+        if (src == nullptr) {
+            return;
+        }
+
+        SLT_INF(slot, "sharing %d prompt tokens with slot %d (previously cached: %d)\n", n_share, src->id, slot.n_past);
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, src->id, slot.id, -1, n_share);
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_share);
+        slot.n_past   = n_share;
+        slot.n_shared = n_share;
+        src->n_shared = std::max(src->n_shared, n_share);
+    }
+
+    //
+    // dynamic KV budget (--kv-dynamic)
+    //
+    // all slots draw cells from the whole KV cache. a new prompt is started only when the cells it needs are
+    // not reserved by the slots that are already running, and generating slots are swapped to host memory
+    // when the cache runs out of cells for the next token
+    //
+
+    int32_t kv_cells_free() const {
+        return n_ctx - llama_get_kv_cache_used_cells(ctx);
+    }
+
+    // cells held by the sequence of the slot - note that llama_kv_cache_seq_pos_max() returns 0 for an empty sequence
+    int32_t kv_cells_used(const server_slot & slot) const {
+        const llama_pos pos_max = llama_kv_cache_seq_pos_max(ctx, slot.id);
+
+        return pos_max > 0 || !slot.cache_tokens.empty() ? pos_max + 1 : 0;
+    }
+
+    // cells that a running slot needs before it can make progress
+    static int32_t kv_cells_pending(const server_slot & slot) {
+        if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+            return slot.n_prompt_tokens - slot.n_past + 1;
+        }
+
+        return 1 + (slot.can_speculate() ? slot.params.speculative.n_max : 0);
+    }
+
+    // drop the cached prompts of the slots that are idle or still waiting to start, least recently used first,
+    // until n_free cells are available
+    bool kv_evict_idle(int32_t n_free, const server_slot * keep = nullptr) {
+        while (kv_cells_free() < n_free) {
+            server_slot * lru = nullptr;
+
+            for (server_slot & slot : slots) {
+                if (&slot == keep || (slot.state != SLOT_STATE_IDLE && slot.state != SLOT_STATE_STARTED)) {
+                    continue;
+                }
+
+                if (kv_cells_used(slot) == 0) {
+                    continue;
+                }
+
+                if (lru == nullptr || slot.t_last_used < lru->t_last_used) {
+                    lru = &slot;
+                }
+            }
+
+            if (lru == nullptr) {
+                return false;
+            }
+
+            SLT_INF(*lru, "evicting cached prompt, n_cache_tokens = %d\n", (int) lru->cache_tokens.size());
+
+            kv_store_put(*lru);
+
+            llama_kv_cache_seq_rm(ctx, lru->id, -1, -1);
+            lru->cache_tokens.clear();
+            lru->n_shared = 0;
+        }
+
+        return true;
+    }
+
+    bool kv_swap_out(server_slot & slot) {
+        const size_t size = llama_state_seq_get_size(ctx, slot.id);
+
+        slot.kv_swap.resize(size);
+        if (llama_state_seq_get_data(ctx, slot.kv_swap.data(), size, slot.id) != size) {
+            SLT_ERR(slot, "%s", "failed to copy the KV cache to host memory\n");
+            slot.kv_swap = {};
+            return false;
+        }
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        slot.kv_swapped = true;
+        slot.n_shared   = 0; // the cells are restored as new ones
+
+        SLT_INF(slot, "preempted, swapped %d KV cells to host memory (%.3f MiB)\n", slot.n_past, size / (1024.0 * 1024.0));
+
+        return true;
+    }
+
+    bool kv_swap_in(server_slot & slot) {
+        if (llama_state_seq_set_data(ctx, slot.kv_swap.data(), slot.kv_swap.size(), slot.id) == 0) {
+            // the cells are restored as one contiguous block - compact the cache and try again
+            SLT_DBG(slot, "%s", "no contiguous block of free KV cells, defragmenting the KV cache\n");
+
+            llama_kv_cache_defrag(ctx);
+            llama_kv_cache_update(ctx);
+
+            if (llama_state_seq_set_data(ctx, slot.kv_swap.data(), slot.kv_swap.size(), slot.id) == 0) {
+                SLT_DBG(slot, "%s", "could not restore the KV cache yet\n");
+                return false;
+            }
+        }
+
+        slot.kv_swap = {};
+        slot.kv_swapped = false;
+
+        SLT_INF(slot, "resumed, restored %d KV cells from host memory\n", slot.n_past);
+
+        return true;
+    }
+
+    // a new prompt is admitted if it fits next to what the running slots still need
+    bool kv_admit(server_slot & slot, int32_t n_batched) {
+        int32_t n_reserved = n_batched; // tokens in the current batch do not occupy cells yet
+        int32_t n_running  = 0;
+
+        for (const server_slot & other : slots) {
+            if (other.id == slot.id || !other.is_processing() || other.state == SLOT_STATE_STARTED) {
+                continue;
+            }
+
+            if (other.kv_swapped) {
+                // preempted slots are resumed before new prompts are started
+                return false;
+            }
+
+            n_running++;
+
+            if (other.state == SLOT_STATE_PROCESSING_PROMPT) {
+                n_reserved += kv_cells_pending(other);
+            } else if (other.can_speculate()) {
+                n_reserved += other.params.speculative.n_max;
+            }
+        }
+
+        if (n_running == 0) {
+            // the prompt has the whole cache for itself
+            return true;
+        }
+
+        // the cells of the slot that do not match the new prompt are released before it is processed
+        const int32_t n_common   = slot.params.cache_prompt ? common_lcp(slot.cache_tokens, slot.prompt_tokens) : 0;
+        const int32_t n_released = std::max(0, kv_cells_used(slot) - n_common);
+        const int32_t n_prompt   = std::min<int32_t>(slot.prompt_tokens.size() - n_common + 1, n_ctx);
+
+        const int32_t n_required = n_reserved + n_prompt - n_released;
+
+        if (kv_cells_free() < n_required && !kv_evict_idle(n_required, &slot)) {
+            SLT_DBG(slot, "waiting for free KV cells, n_required = %d, n_free = %d\n", n_required, kv_cells_free());
+            return false;
+        }
+
+        return true;
+    }
+
+    // make sure that every running slot has the cells it needs for the next step
+    void kv_update_budget() {
+        int32_t n_needed = 0;
+
+        std::vector<server_slot *> swapped;
+
+        for (server_slot & slot : slots) {
+            if (slot.state != SLOT_STATE_PROCESSING_PROMPT && slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+
+            if (slot.kv_swapped) {
+                swapped.push_back(&slot);
+            } else {
+                n_needed += kv_cells_pending(slot);
+            }
+        }
+
+        // resume the preempted slots in the order in which their requests were started
+        std::sort(swapped.begin(), swapped.end(), [](const server_slot * a, const server_slot * b) {
+            return a->t_start_process_prompt < b->t_start_process_prompt;
+        });
+
+        for (server_slot * slot : swapped) {
+            const int32_t n_required = n_needed + slot->n_past + kv_cells_pending(*slot);
+
+            if ((kv_cells_free() >= n_required || kv_evict_idle(n_required)) && kv_swap_in(*slot)) {
+                n_needed += kv_cells_pending(*slot);
+                continue;
+            }
+
+            if (n_needed > 0) {
+                // wait for the running slots to release their cells
+                break;
+            }
+
+            // no running slot can release cells for it - keeping the request would block new prompts forever
+            send_error(*slot, "failed to restore the KV cache of the preempted request", ERROR_TYPE_SERVER);
+            slot->release();
+        }
+
+        if (kv_cells_free() >= n_needed || kv_evict_idle(n_needed)) {
+            return;
+        }
+
+        // preempt the most recently started requests until the others fit
+        while (kv_cells_free() < n_needed) {
+            server_slot * victim = nullptr;
+
+            for (server_slot & slot : slots) {
+                if (slot.state != SLOT_STATE_GENERATING || slot.kv_swapped) {
+                    continue;
+                }
+
+                if (victim == nullptr || slot.t_start_process_prompt > victim->t_start_process_prompt) {
+                    victim = &slot;
+                }
+            }
+
+            if (victim == nullptr || !kv_swap_out(*victim)) {
+                break;
+            }
+
+            n_needed -= kv_cells_pending(*victim);
+        }
+    }
+
+    //
+    // store of evicted prompts (--kv-spill-ram, --kv-spill-path)
+    //
+    // before the cached prompt of an idle slot is dropped or overwritten, its sequence state is copied to host
+    // memory. when the host memory budget is exceeded, the least recently used prompts are moved to files by the
+    // I/O worker. a new prompt that continues a stored prompt restores it instead of recomputing it
+    //
+
+    static constexpr int32_t KV_STORE_MIN_TOKENS = 32; // shorter prompts are cheaper to recompute
+
+    bool kv_store_enabled() const {
+        return params_base.kv_spill_ram > 0 || !params_base.kv_spill_path.empty();
+    }
+
+    std::list<server_kv_entry>::iterator kv_store_find(int64_t id) {
+        return std::find_if(kv_store.begin(), kv_store.end(), [id](const server_kv_entry & entry) {
+            return entry.id == id;
+        });
+    }
+
+    std::list<server_kv_entry>::iterator kv_store_erase(std::list<server_kv_entry>::iterator it) {
+        if (!it->path.empty()) {
+            std::remove(it->path.c_str());
+        }
+
+        return kv_store.erase(it);
+    }
+
+    // copy the cached prompt of the slot to the store
+    void kv_store_put(const server_slot & slot) {
+        if (!kv_store_enabled()) {
+            return;
+        }
+
+        // the last cached token might not be evaluated yet
+        const int32_t n_evaluated = std::min<int32_t>(slot.cache_tokens.size(), llama_kv_cache_seq_pos_max(ctx, slot.id) + 1);
+        if (n_evaluated < KV_STORE_MIN_TOKENS) {
+            return;
+        }
+
+        const llama_tokens tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + n_evaluated);
+
+        for (auto it = kv_store.begin(); it != kv_store.end(); ) {
+            if (!are_lora_equal(it->lora, slot.lora)) {
+                ++it;
+                continue;
+            }
+
+            const size_t n_common = common_lcp(it->tokens, tokens);
+
+            if (n_common == tokens.size()) {
+                // already stored, possibly as the prefix of a longer prompt
+                kv_store.splice(kv_store.end(), kv_store, it);
+                return;
+            }
+
+            if (n_common == it->tokens.size() && !it->reading) {
+                // the stored prompt is a prefix of the new one
+                it = kv_store_erase(it);
+                continue;
+            }
+
+            ++it;
+        }
+
+        const size_t size = llama_state_seq_get_size(ctx, slot.id);
+
+        auto data = std::make_shared<std::vector<uint8_t>>(size);
+        if (llama_state_seq_get_data(ctx, data->data(), size, slot.id) != size) {
+            SLT_ERR(slot, "%s", "failed to copy the cached prompt to host memory\n");
+            return;
+        }
+
+        server_kv_entry entry;
+        entry.id      = kv_store_id++;
+        entry.tokens  = tokens;
+        entry.lora    = slot.lora;
+        entry.data    = std::move(data);
+        entry.n_bytes = size;
+
+        kv_store.push_back(std::move(entry));
+
+        SLT_INF(slot, "spilled %d cached tokens to host memory (%.3f MiB)\n", n_evaluated, size / (1024.0 * 1024.0));
+
+        kv_store_balance();
+    }
+
+    // keep the stored prompts within the host memory and disk budgets, least recently used first
+    void kv_store_balance() {
+        const size_t ram_max  = (size_t) params_base.kv_spill_ram  * 1024 * 1024;
+        const size_t disk_max = (size_t) params_base.kv_spill_disk * 1024 * 1024;
+
+        size_t n_ram  = 0;
+        size_t n_disk = 0;
+
+        for (const auto & entry : kv_store) {
+            if (entry.data && !entry.writing) {
+                n_ram += entry.n_bytes;
+            }
+            if (!entry.path.empty()) {
+                n_disk += entry.n_bytes;
+            }
+        }
+
+        for (auto it = kv_store.begin(); it != kv_store.end() && n_ram > ram_max; ) {
+            if (!it->data || it->writing || it->reading) {
+                ++it;
+                continue;
+            }
+
+            n_ram -= it->n_bytes;
+
+            if (!it->path.empty()) {
+                // the file is still there
+                it->data.reset();
+            } else if (!params_base.kv_spill_path.empty()) {
+                kv_store_write(*it);
+            } else {
+                it = kv_store_erase(it);
+                continue;
+            }
+
+            ++it;
+        }
+
+        for (auto it = kv_store.begin(); it != kv_store.end() && disk_max > 0 && n_disk > disk_max; ) {
+            if (it->path.empty() || it->data || it->reading) {
+                ++it;
+                continue;
+            }
+
+            n_disk -= it->n_bytes;
+
+            it = kv_store_erase(it);
+        }
+    }
+
+    // move the prompt from host memory to a file
+    void kv_store_write(server_kv_entry & entry) {
+        entry.writing = true;
+
+        const int64_t     id   = entry.id;
+        const std::string path = params_base.kv_spill_path + kv_store_prefix + std::to_string(id) + ".bin";
+
+        io_worker.push([this, id, path, tokens = entry.tokens, data = entry.data]() -> server_io_worker::completion {
+            const size_t n_written = kv_state_file_write(path, tokens, *data);
+
+            return [this, id, path, n_written]() {
+                auto it = kv_store_find(id);
+                if (it == kv_store.end()) {
+                    // the prompt was restored or dropped in the meantime
+                    std::remove(path.c_str());
+                    return;
+                }
+
+                it->writing = false;
+
+                if (n_written == 0) {
+                    SRV_ERR("failed to write the cached prompt to '%s'\n", path.c_str());
+                    kv_store_erase(it);
+                    return;
+                }
+
+                SRV_DBG("moved %d cached tokens to '%s'\n", (int) it->tokens.size(), path.c_str());
 
-        metrics.init();
+                it->path = path;
+                it->data.reset();
+
+                kv_store_balance();
+            };
+        });
     }
 
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
-            }
-        }
+    // read the prompt back from its file into host memory
+    void kv_store_read(server_kv_entry & entry) {
+        entry.reading = true;
 
-        return nullptr;
-    }
+        const int64_t     id   = entry.id;
+        const std::string path = entry.path;
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
+        io_worker.push([this, id, path]() -> server_io_worker::completion {
+            auto data = std::make_shared<std::vector<uint8_t>>();
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
+            llama_tokens tokens;
+            const bool ok = kv_state_file_read(path, n_ctx, tokens, *data) > 0;
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
+            return [this, id, path, ok, data]() {
+                auto it = kv_store_find(id);
+                if (it == kv_store.end()) {
+                    return;
                 }
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
+                it->reading = false;
+
+                if (!ok) {
+                    SRV_ERR("failed to read the cached prompt from '%s'\n", path.c_str());
+                    kv_store_erase(it);
+                    return;
                 }
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+                it->data = data;
+                kv_store.splice(kv_store.end(), kv_store, it);
+            };
+        });
+    }
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+    // restore the stored prompt that shares the longest prefix with the new prompt of the slot, if it shares more
+    // than what the slot has cached - returns false while the prompt is still being read from disk, in which case
+    // it is called again for the same prompt until the read is done
+    bool kv_store_fetch(server_slot & slot) {
+        if (!kv_store_enabled() || !slot.params.cache_prompt) {
+            return true;
+        }
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
-                }
-            }
+        const llama_tokens & prompt_tokens = slot.prompt_tokens;
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+        const int32_t n_local = common_lcp(slot.cache_tokens, prompt_tokens);
+
+        // the cached prompt of the slot is mostly overwritten by the new prompt, keep it for a later request
+        const bool put_local = 2*n_local < (int32_t) slot.cache_tokens.size();
+
+        auto    best   = kv_store.end();
+        int32_t n_best = std::max(n_local, KV_STORE_MIN_TOKENS - 1);
+
+        if (slot.kv_fetch_id >= 0) {
+            // the prompt selected before is being read back, the store is searched again only if it was dropped
+            best = kv_store_find(slot.kv_fetch_id);
+            if (best != kv_store.end()) {
+                n_best = common_lcp(best->tokens, prompt_tokens);
             }
+            slot.kv_fetch_id = -1;
         }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        const bool search = best == kv_store.end();
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
+        for (auto it = kv_store.begin(); search && it != kv_store.end(); ++it) {
+            if (!are_lora_equal(it->lora, slot.lora)) {
+                continue;
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            const int32_t n_common = common_lcp(it->tokens, prompt_tokens);
+            if (n_common > n_best) {
+                n_best = n_common;
+                best   = it;
             }
         }
 
-        return ret;
-    }
+        if (best == kv_store.end()) {
+            if (put_local) {
+                kv_store_put(slot);
+            }
+            return true;
+        }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot.reset();
-        slot.id_task       = task.id;
-        slot.index         = task.index;
-        slot.task_type     = task.type;
-        slot.params        = std::move(task.params);
-        slot.prompt_tokens = std::move(task.prompt_tokens);
+        if (best->reading) {
+            slot.kv_fetch_id = best->id;
+            return false;
+        }
 
-        if (!are_lora_equal(task.params.lora, slot.lora)) {
-            // if lora is changed, we cannot reuse cached tokens
-            slot.cache_tokens.clear();
-            slot.lora = task.params.lora;
+        if (!best->data) {
+            SLT_INF(slot, "reading %d cached tokens from '%s'\n", (int) best->tokens.size(), best->path.c_str());
+            kv_store_read(*best);
+            slot.kv_fetch_id = best->id;
+            return false;
         }
 
-        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+        // storing the prompt of the slot can move the entry out of host memory
+        const int64_t      id     = best->id;
+        const llama_tokens tokens = best->tokens;
+        const auto         data   = best->data;
 
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
-            // Might be better to reject the request with a 400 ?
-            slot.params.n_predict = slot.n_predict;
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
+        if (put_local) {
+            kv_store_put(slot);
         }
 
-        if (slot.params.ignore_eos && has_eos_token) {
-            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        slot.cache_tokens.clear();
+        slot.n_shared = 0;
+
+        if (params_base.kv_dynamic && kv_cells_free() < (int32_t) tokens.size() && !kv_evict_idle(tokens.size(), &slot)) {
+            SLT_DBG(slot, "%s", "no room to restore the cached prompt\n");
+            return true;
         }
 
-        {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
-            }
+        const int64_t t_start = ggml_time_us();
 
-            slot.smpl = common_sampler_init(model, slot.params.sampling);
-            if (slot.smpl == nullptr) {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
+        if (llama_state_seq_set_data(ctx, data->data(), data->size(), slot.id) == 0) {
+            SLT_WRN(slot, "%s", "failed to restore the cached prompt\n");
+            llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+            return true;
         }
 
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
+        slot.cache_tokens = tokens;
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        auto it = kv_store_find(id);
+        if (it != kv_store.end()) {
+            kv_store_erase(it);
         }
 
-        slot.state = SLOT_STATE_STARTED;
-
-        SLT_INF(slot, "%s", "processing task\n");
+        SLT_INF(slot, "restored %d cached tokens in %.3f ms, n_common = %d\n", (int) tokens.size(), (ggml_time_us() - t_start) / 1000.0, n_best);
 
         return true;
     }
 
-    void kv_cache_clear() {
-        SRV_DBG("%s", "clearing KV cache\n");
-
-        // clear the entire KV cache
-        llama_kv_cache_clear(ctx);
-        clean_kv_cache = false;
-    }
-
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = result.text_to_send;
@@ -2318,18 +3255,22 @@ struct server_context {
     }
 
     void send_embedding(const server_slot & slot, const llama_batch & batch) {
+        send_embedding(slot.id_task, slot.index, slot.n_prompt_tokens, slot.params.oaicompat, slot.id, batch);
+    }
+
+    void send_embedding(const int id_task, const int index, const int32_t n_tokens, const oaicompat_type oaicompat, const llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_embd>();
-        res->id        = slot.id_task;
-        res->index     = slot.index;
-        res->n_tokens  = slot.n_prompt_tokens;
-        res->oaicompat = slot.params.oaicompat;
+        res->id        = id_task;
+        res->index     = index;
+        res->n_tokens  = n_tokens;
+        res->oaicompat = oaicompat;
 
         const int n_embd = llama_model_n_embd(model);
 
         std::vector<float> embd_res(n_embd, 0.0f);
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
@@ -2339,7 +3280,7 @@ struct server_context {
             }
 
             if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", id_task, batch.token[i], batch.seq_id[i][0]);
 
                 res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
                 continue;
@@ -2347,7 +3288,7 @@ struct server_context {
 
             // normalize only when there is pooling
             // TODO: configurable
-            if (llama_pooling_type(slot.ctx) != LLAMA_POOLING_TYPE_NONE) {
+            if (llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE) {
                 common_embd_normalize(embd, embd_res.data(), n_embd, 2);
                 res->embedding.push_back(embd_res);
             } else {
@@ -2355,19 +3296,23 @@ struct server_context {
             }
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        SRV_DBG("sending embeddings, id_task = %d\n", id_task);
 
         queue_results.send(std::move(res));
     }
 
     void send_rerank(const server_slot & slot, const llama_batch & batch) {
+        send_rerank(slot.id_task, slot.index, slot.n_prompt_tokens, slot.id, batch);
+    }
+
+    void send_rerank(const int id_task, const int index, const int32_t n_tokens, const llama_seq_id seq_id, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_rerank>();
-        res->id    = slot.id_task;
-        res->index = slot.index;
-        res->n_tokens = slot.n_prompt_tokens;
+        res->id    = id_task;
+        res->index = index;
+        res->n_tokens = n_tokens;
 
         for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != seq_id) {
                 continue;
             }
 
@@ -2377,7 +3322,7 @@ struct server_context {
             }
 
             if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+                SRV_ERR("failed to get embeddings, id_task = %d, token = %d, seq_id = %d\n", id_task, batch.token[i], batch.seq_id[i][0]);
 
                 res->score = -1e6;
                 continue;
@@ -2386,7 +3331,7 @@ struct server_context {
             res->score = embd[0];
         }
 
-        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+        SRV_DBG("sending rerank result, id_task = %d, res.score = %f\n", id_task, res->score);
 
         queue_results.send(std::move(res));
     }
@@ -2501,6 +3446,11 @@ struct server_context {
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
                 {
+                    if (embd_packed && (task.type == SERVER_TASK_TYPE_EMBEDDING || task.type == SERVER_TASK_TYPE_RERANK)) {
+                        queue_embd.push_back(std::move(task));
+                        break;
+                    }
+
                     const int id_slot = task.id_selected_slot;
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
@@ -2511,7 +3461,7 @@ struct server_context {
                         queue_tasks.defer(task);
                         break;
                     }
-                    if (slot->is_processing()) {
+                    if (slot->is_processing() || slot->kv_loading) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(task);
@@ -2532,6 +3482,10 @@ struct server_context {
                             break;
                         }
                     }
+
+                    queue_embd.erase(std::remove_if(queue_embd.begin(), queue_embd.end(), [&](const server_task & t) {
+                        return t.id == task.id_target;
+                    }), queue_embd.end());
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -2594,33 +3548,54 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
+                    if (slot->is_processing() || slot->kv_loading || slot_files_busy.count(task.slot_action.filepath)) {
+                        // if requested slot or file is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(task);
                         break;
                     }
 
-                    const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
+                    // the state is copied here, the file is written by the I/O worker while the slots keep running
+                    llama_tokens tokens = slot->cache_tokens;
+
+                    const size_t size = llama_state_seq_get_size(ctx, slot->id);
 
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), token_count);
+                    auto data = std::make_shared<std::vector<uint8_t>>(size);
+                    if (llama_state_seq_get_data(ctx, data->data(), size, slot->id) != size) {
+                        send_error(task, "Unable to copy the slot state", ERROR_TYPE_SERVER);
+                        break;
+                    }
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_save_ms = (t_end - t_start) / 1000.0;
+                    slot_files_busy.insert(task.slot_action.filepath);
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = true;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nwrite;
-                    res->t_ms     = t_save_ms;
-                    queue_results.send(std::move(res));
+                    io_worker.push([this, task, tokens = std::move(tokens), data, t_start]() -> server_io_worker::completion {
+                        const size_t nwrite = kv_state_file_write(task.slot_action.filepath, tokens, *data);
+
+                        const int64_t t_end = ggml_time_us();
+                        const double t_save_ms = (t_end - t_start) / 1000.0;
+
+                        return [this, task, n_tokens = tokens.size(), nwrite, t_save_ms]() {
+                            slot_files_busy.erase(task.slot_action.filepath);
+                            queue_tasks.pop_deferred_task();
+
+                            if (nwrite == 0) {
+                                send_error(task, "Unable to write the slot file", ERROR_TYPE_SERVER);
+                                return;
+                            }
+
+                            auto res = std::make_unique<server_task_result_slot_save_load>();
+                            res->id       = task.id;
+                            res->id_slot  = task.slot_action.slot_id;
+                            res->filename = task.slot_action.filename;
+                            res->is_save  = true;
+                            res->n_tokens = n_tokens;
+                            res->n_bytes  = nwrite;
+                            res->t_ms     = t_save_ms;
+                            queue_results.send(std::move(res));
+                        };
+                    });
                 } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
                 {
@@ -2630,8 +3605,8 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
-                        // if requested slot is unavailable, we defer this task for processing later
+                    if (slot->is_processing() || slot->kv_loading || slot_files_busy.count(task.slot_action.filepath)) {
+                        // if requested slot or file is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(task);
                         break;
@@ -2639,31 +3614,53 @@ struct server_context {
 
                     const int64_t t_start = ggml_time_us();
 
-                    std::string filename = task.slot_action.filename;
-                    std::string filepath = task.slot_action.filepath;
+                    // the slot is not used until the file is read by the I/O worker
+                    slot->kv_loading = true;
+                    slot_files_busy.insert(task.slot_action.filepath);
 
-                    slot->cache_tokens.resize(slot->n_ctx);
-                    size_t token_count = 0;
-                    size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
-                    if (nread == 0) {
-                        slot->cache_tokens.resize(0);
-                        send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
-                        break;
-                    }
-                    slot->cache_tokens.resize(token_count);
+                    io_worker.push([this, task, n_ctx_slot = slot->n_ctx, t_start]() -> server_io_worker::completion {
+                        auto data = std::make_shared<std::vector<uint8_t>>();
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_restore_ms = (t_end - t_start) / 1000.0;
+                        llama_tokens tokens;
+                        const size_t nread = kv_state_file_read(task.slot_action.filepath, n_ctx_slot, tokens, *data);
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = false;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nread;
-                    res->t_ms     = t_restore_ms;
-                    queue_results.send(std::move(res));
+                        return [this, task, tokens = std::move(tokens), data, nread, t_start]() {
+                            server_slot * slot = get_slot_by_id(task.slot_action.slot_id);
+
+                            slot->kv_loading = false;
+                            slot_files_busy.erase(task.slot_action.filepath);
+                            queue_tasks.pop_deferred_task();
+
+                            llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+                            slot->cache_tokens.clear();
+                            slot->n_shared = 0;
+
+                            if (params_base.kv_dynamic && kv_cells_free() < (int32_t) tokens.size()) {
+                                kv_evict_idle(tokens.size(), slot);
+                            }
+
+                            if (nread == 0 || llama_state_seq_set_data(ctx, data->data(), data->size(), slot->id) == 0) {
+                                llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+                                send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
+                                return;
+                            }
+
+                            slot->cache_tokens = tokens;
+
+                            const int64_t t_end = ggml_time_us();
+                            const double t_restore_ms = (t_end - t_start) / 1000.0;
+
+                            auto res = std::make_unique<server_task_result_slot_save_load>();
+                            res->id       = task.id;
+                            res->id_slot  = slot->id;
+                            res->filename = task.slot_action.filename;
+                            res->is_save  = false;
+                            res->n_tokens = tokens.size();
+                            res->n_bytes  = nread;
+                            res->t_ms     = t_restore_ms;
+                            queue_results.send(std::move(res));
+                        };
+                    });
                 } break;
             case SERVER_TASK_TYPE_SLOT_ERASE:
                 {
@@ -2673,7 +3670,7 @@ struct server_context {
                         send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
-                    if (slot->is_processing()) {
+                    if (slot->is_processing() || slot->kv_loading) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(task);
@@ -2684,6 +3681,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->n_shared = 0;
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2698,10 +3696,121 @@ struct server_context {
                     res->id = task.id;
                     queue_results.send(std::move(res));
                 } break;
+            case SERVER_TASK_TYPE_KV_IO:
+                {
+                    io_worker.complete();
+                } break;
+        }
+    }
+
+    // the prompts of a non-causal model attend only to themselves, so there is no need for a slot or the KV cache:
+    // the pending prompts are packed in a single batch, longest first, and llama_encode() packs them in the ubatches.
+    // the result of each task is sent as soon as the batch is done, without waiting for the other requests
+    void update_embeddings() {
+        const int32_t n_batch  = llama_n_batch(ctx);
+        const int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        std::stable_sort(queue_embd.begin(), queue_embd.end(), [](const server_task & a, const server_task & b) {
+            return a.prompt_tokens.size() > b.prompt_tokens.size();
+        });
+
+        std::vector<server_task> tasks;
+        std::vector<server_task> tasks_next;
+
+        int32_t n_tokens = 0;
+
+        for (auto & task : queue_embd) {
+            const int32_t n_prompt_tokens = task.prompt_tokens.size();
+
+            if (n_prompt_tokens == 0) {
+                send_error(task, "Input content cannot be empty", ERROR_TYPE_INVALID_REQUEST);
+                continue;
+            }
+
+            // a prompt can't be split across ubatches
+            if (n_prompt_tokens > n_ubatch) {
+                send_error(task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+                continue;
+            }
+
+            if (n_prompt_tokens > n_ctx) {
+                send_error(task, "input is larger than the max context size. skipping", ERROR_TYPE_SERVER);
+                continue;
+            }
+
+            if (n_tokens + n_prompt_tokens > n_batch) {
+                tasks_next.push_back(std::move(task));
+                continue;
+            }
+
+            n_tokens += n_prompt_tokens;
+            tasks.push_back(std::move(task));
+        }
+
+        queue_embd = std::move(tasks_next);
+
+        if (tasks.empty()) {
+            return;
+        }
+
+        common_batch_clear(batch);
+
+        for (size_t k = 0; k < tasks.size(); ++k) {
+            const auto & prompt_tokens = tasks[k].prompt_tokens;
+
+            // without pooling, we want to output the embeddings for all the tokens
+            const bool need_embd = tasks[k].type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE;
+
+            for (size_t i = 0; i < prompt_tokens.size(); ++i) {
+                common_batch_add(batch, prompt_tokens[i], i, { (llama_seq_id) k }, need_embd || i + 1 == prompt_tokens.size());
+            }
+
+            common_set_adapter_lora_seq(ctx, k, tasks[k].params.lora);
+        }
+
+        SRV_DBG("encoding %zu prompts, n_tokens = %d\n", tasks.size(), batch.n_tokens);
+
+        llama_set_embeddings(ctx, true);
+
+        const int64_t t_start = ggml_time_us();
+
+        const int ret = llama_encode(ctx, batch);
+
+        if (ret != 0) {
+            for (const auto & task : tasks) {
+                send_error(task, string_format("failed to encode the prompts, ret = %d", ret), ERROR_TYPE_SERVER);
+            }
+        } else {
+            for (size_t k = 0; k < tasks.size(); ++k) {
+                const auto & task = tasks[k];
+                const int32_t n_prompt_tokens = task.prompt_tokens.size();
+
+                if (task.type == SERVER_TASK_TYPE_EMBEDDING) {
+                    send_embedding(task.id, task.index, n_prompt_tokens, task.params.oaicompat, k, batch);
+                } else {
+                    send_rerank(task.id, task.index, n_prompt_tokens, k, batch);
+                }
+            }
+
+            metrics.on_prompt_eval(n_tokens, (ggml_time_us() - t_start) / 1e3);
+        }
+
+        for (size_t k = 0; k < tasks.size(); ++k) {
+            llama_clear_adapter_lora_seq(ctx, k);
+        }
+
+        if (!queue_embd.empty()) {
+            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+            task.id = queue_tasks.get_new_id();
+            queue_tasks.post(task);
         }
     }
 
     void update_slots() {
+        if (!queue_embd.empty()) {
+            update_embeddings();
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2734,7 +3843,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            if (slot.is_processing() && !slot.kv_swapped && slot.n_past + 1 >= slot.n_ctx) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -2746,7 +3855,13 @@ struct server_context {
                 // Shift context
                 const int n_keep    = slot.params.n_keep + add_bos_token;
                 const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                      int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+
+                // the cells shared with other slots would be moved for them as well, so they are discarded
+                // instead of shifted and the slot keeps only its own cells after them
+                if (n_keep + n_discard < slot.n_shared) {
+                    n_discard = std::min(slot.n_shared, slot.n_past) - n_keep;
+                }
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
@@ -2761,12 +3876,17 @@ struct server_context {
                     slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
                 }
 
-                slot.n_past -= n_discard;
+                slot.n_past  -= n_discard;
+                slot.n_shared = std::min(slot.n_shared, n_keep);
 
                 slot.truncated = true;
             }
         }
 
+        if (params_base.kv_dynamic) {
+            kv_update_budget();
+        }
+
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
@@ -2775,7 +3895,7 @@ struct server_context {
 
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
-            if (slot.state != SLOT_STATE_GENERATING) {
+            if (slot.state != SLOT_STATE_GENERATING || slot.kv_swapped) {
                 continue;
             }
 
@@ -2807,6 +3927,19 @@ struct server_context {
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
+                // a new prompt that continues an evicted prompt waits until the evicted prompt is read back
+                if (slot.state == SLOT_STATE_STARTED && !slot.kv_fetched) {
+                    if (!kv_store_fetch(slot)) {
+                        continue;
+                    }
+                    slot.kv_fetched = true;
+                }
+
+                // a new prompt waits until there are enough free cells in the KV cache
+                if (slot.state == SLOT_STATE_STARTED && params_base.kv_dynamic && !kv_admit(slot, batch.n_tokens)) {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2912,6 +4045,9 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                // attach to the KV cells of another slot that shares a longer prefix with the prompt
+                                share_prefix(slot, prompt_tokens);
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -2930,7 +4066,8 @@ struct server_context {
                                             n_match++;
                                         }
 
-                                        if (n_match >= (size_t) params_base.n_cache_reuse) {
+                                        // a chunk is moved with all the cells after it, which must belong to this slot only
+                                        if (n_match >= (size_t) params_base.n_cache_reuse && head_c >= (size_t) slot.n_shared) {
                                             SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
                                             //for (size_t i = head_p; i < head_p + n_match; i++) {
                                             //    SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
@@ -2984,6 +4121,7 @@ struct server_context {
                         // there is no common part left
                         slot.n_past = 0;
                     }
+                    slot.n_shared = std::min(slot.n_shared, slot.n_past);
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
 
@@ -3046,8 +4184,13 @@ struct server_context {
         if (slot_batched) {
             // make sure we're in the right embedding mode
             llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
+        }
+
+        // apply the lora of each slot to its sequence, so that slots with different adapters share the batch
+        for (auto & slot : slots) {
+            if (slot.is_processing()) {
+                common_set_adapter_lora_seq(ctx, slot.id, slot.lora);
+            }
         }
 
         // process the created batch of tokens
@@ -3087,6 +4230,8 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            std::vector<server_slot *> slots_sampling;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3114,14 +4259,41 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
+                slots_sampling.push_back(&slot);
+            }
+
+            // the samplers of the slots are independent, so they can run in parallel
+            // wait for the outputs first, so that the workers only read from the context
+            llama_synchronize(ctx);
+
+            std::vector<completion_token_output> results(slots_sampling.size());
+
+            sampling_pool.run(slots_sampling.size(), [&](int k) {
+                server_slot & slot = *slots_sampling[k];
+
                 const int tok_idx = slot.i_batch - i;
 
                 llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
 
-                slot.i_batch = -1;
-
                 common_sampler_accept(slot.smpl, id, true);
 
+                completion_token_output & result = results[k];
+                result.tok          = id;
+                result.text_to_send = common_token_to_piece(ctx, result.tok, params_base.special);
+                result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+
+                if (slot.params.sampling.n_probs > 0) {
+                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
+                }
+            });
+
+            for (size_t k = 0; k < slots_sampling.size(); k++) {
+                server_slot & slot = *slots_sampling[k];
+
+                completion_token_output & result = results[k];
+
+                slot.i_batch = -1;
+
                 slot.n_decoded += 1;
 
                 const int64_t t_current = ggml_time_us();
@@ -3134,15 +4306,6 @@ struct server_context {
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
-                completion_token_output result;
-                result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, params_base.special);
-                result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
-
-                if (slot.params.sampling.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
-                }
-
                 if (!process_token(result, slot)) {
                     // release slot because of stop condition
                     slot.release();
@@ -3155,7 +4318,7 @@ struct server_context {
 
             // do speculative decoding
             for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
+                if (!slot.is_processing() || !slot.can_speculate() || slot.kv_swapped) {
                     continue;
                 }
 
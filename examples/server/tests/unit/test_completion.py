@@ -294,6 +294,71 @@ def test_completion_parallel_slots(n_slots: int, n_requests: int):
         # assert match_regex(re_content, res.body["content"])
 
 
+def test_completion_parallel_shared_prefix():
+    global server
+    server.n_slots = 2
+    server.temperature = 0.0
+    server.start()
+
+    PREFIX = "Once upon a time there was a little girl who lived in a village near the forest. One day"
+    SUFFIXES = [" she went", " he ran"]
+
+    # both prompts are started in the same update, before any slot has evaluated the common prefix
+    res = server.make_request("POST", "/completion", data={
+        "prompt": [PREFIX + suffix for suffix in SUFFIXES],
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert len(res.body) == len(SUFFIXES)
+
+    for suffix, res_batch in zip(SUFFIXES, res.body):
+        res_single = server.make_request("POST", "/completion", data={
+            "prompt": PREFIX + suffix,
+            "n_predict": 8,
+            "cache_prompt": False,
+        })
+        assert res_single.status_code == 200
+        assert res_batch["content"] == res_single.body["content"]
+
+
+def test_completion_parallel_sampling():
+    global server
+    server.n_slots = 4
+    server.n_threads = 4 # the slots are sampled on the main thread and 3 workers
+    server.start()
+
+    PROMPTS = [
+        "Write a very long book.",
+        "Write another a poem.",
+        "What is LLM?",
+        "The sky is blue and I love it.",
+    ]
+    def make_data(i: int, prompt: str):
+        return {
+            "prompt": prompt,
+            "seed": 42 + i,
+            "temperature": 0.8,
+            "n_probs": 3,
+            "n_predict": 16,
+            "cache_prompt": False,
+        }
+
+    # each sampler must only see the logits and the RNG of its own slot
+    tasks = [(server.make_request, ("POST", "/completion", make_data(i, prompt))) for i, prompt in enumerate(PROMPTS)]
+    results = parallel_function_calls(tasks)
+
+    for i, prompt in enumerate(PROMPTS):
+        res_single = server.make_request("POST", "/completion", data=make_data(i, prompt))
+        assert res_single.status_code == 200
+        res = results[i]
+        assert res.status_code == 200
+        assert res.body["content"] == res_single.body["content"]
+        assert len(res.body["completion_probabilities"]) == len(res_single.body["completion_probabilities"])
+        for tok, tok_single in zip(res.body["completion_probabilities"], res_single.body["completion_probabilities"]):
+            assert tok["id"] == tok_single["id"]
+            assert [p["id"] for p in tok["top_logprobs"]] == [p["id"] for p in tok_single["top_logprobs"]]
+
+
 @pytest.mark.parametrize(
     "prompt,n_predict,response_fields",
     [
@@ -65,3 +65,60 @@ def test_ctx_shift_disabled_long_prompt():
     assert res.status_code != 200
     assert "error" in res.body
     assert "exceeds the available context size" in res.body["error"]["message"]
+
+
+def test_ctx_shift_shared_prefix():
+    # slot 1 shares the prompt cached by slot 0, then slot 0 shifts its context over the shared cells
+    # the cells must keep their positions for slot 1, so it continues as before the shift
+    global server
+    server.disable_ctx_shift = False
+    server.n_predict = -1
+    server.temperature = 0.0
+    server.start()
+
+    prompt = "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends and her big red ball."
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 4,
+    })
+    assert res.status_code == 200
+
+    data_shared = {
+        "prompt": prompt + " One day",
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 8,
+        "n_probs": 4,
+    }
+    res = server.make_request("POST", "/completion", data=data_shared)
+    assert res.status_code == 200
+
+    # the reference: the prompt of slot 1 is cached, only its last token is evaluated again
+    expected = server.make_request("POST", "/completion", data=data_shared)
+    assert expected.status_code == 200
+
+    # the shift starts in the shared prefix: 1 token kept (BOS), the next 8 discarded
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 120,
+        "n_keep": 0,
+        "n_discard": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 120
+    assert res.body["truncated"] is True
+
+    res = server.make_request("POST", "/completion", data=data_shared)
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == expected.body["timings"]["prompt_n"]
+    assert res.body["content"] == expected.body["content"]
+    for tok, tok_expected in zip(res.body["completion_probabilities"], expected.body["completion_probabilities"]):
+        assert tok["id"] == tok_expected["id"]
+        for p, p_expected in zip(tok["top_logprobs"], tok_expected["top_logprobs"]):
+            assert p["id"] == p_expected["id"]
+            assert abs(p["logprob"] - p_expected["logprob"]) < 1e-3
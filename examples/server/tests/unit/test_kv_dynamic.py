@@ -0,0 +1,105 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+SENTENCES = [
+    "Once upon a time, there was a little girl named Lily. ",
+    "She loved to play outside in the park with her friends. ",
+    "One day, she saw a big dog with a red ball. ",
+    "The sun was shining and the birds were singing in the trees. ",
+]
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 4
+    server.kv_dynamic = True
+    server.server_slots = True
+    server.temperature = 0.0
+
+
+# a prompt of at least n_tokens tokens, starting with sentence i
+def make_prompt(i: int, n_tokens: int) -> str:
+    global server
+    prompt = ""
+    while True:
+        res = server.make_request("POST", "/tokenize", data={"content": prompt})
+        assert res.status_code == 200
+        if len(res.body["tokens"]) >= n_tokens:
+            return prompt
+        prompt += SENTENCES[i % len(SENTENCES)]
+        i += 1
+
+
+def test_kv_dynamic_long_prompt():
+    global server
+    server.start()
+
+    # each slot may use the whole context instead of n_ctx / n_slots cells
+    res = server.make_request("GET", "/slots")
+    assert res.status_code == 200
+    for slot in res.body:
+        assert slot["n_ctx"] == server.n_ctx
+
+    prompt = make_prompt(0, 3 * server.n_ctx // 4)
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 16,
+        "ignore_eos": True,
+    })
+    assert res.status_code == 200
+    assert not res.body["truncated"]
+    assert res.body["timings"]["prompt_n"] >= 3 * server.n_ctx // 4
+    assert res.body["timings"]["predicted_n"] == 16
+
+
+def test_kv_dynamic_under_load():
+    global server
+    server.start()
+
+    # together the requests need more cells than the context has, so that some of them wait or are
+    # preempted and swapped to host memory, while each of them alone fits
+    n_predict = 64
+    prompts = [make_prompt(i, 40) for i in range(server.n_slots)]
+
+    def make_data(prompt: str):
+        return {
+            "prompt": prompt,
+            "n_predict": n_predict,
+            "ignore_eos": True,
+            "cache_prompt": False,
+        }
+
+    tasks = [(server.make_request, ("POST", "/completion", make_data(prompt))) for prompt in prompts]
+    results = parallel_function_calls(tasks)
+
+    n_required = 0
+    for prompt, res in zip(prompts, results):
+        assert res.status_code == 200
+        assert res.body["timings"]["predicted_n"] == n_predict
+        n_required += res.body["timings"]["prompt_n"] + n_predict
+
+        res_single = server.make_request("POST", "/completion", data=make_data(prompt))
+        assert res_single.status_code == 200
+        assert res.body["content"] == res_single.body["content"]
+    assert n_required > server.n_ctx
+
+    res = server.make_request("GET", "/slots")
+    assert res.status_code == 200
+    for slot in res.body:
+        assert not slot["is_processing"]
+        assert not slot["kv_swapped"]
+
+    # the prompts cached by the idle slots are evicted for a request that needs most of the context
+    prompt = make_prompt(1, 3 * server.n_ctx // 4)
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 16,
+        "ignore_eos": True,
+    })
+    assert res.status_code == 200
+    assert not res.body["truncated"]
+    assert res.body["timings"]["predicted_n"] == 16
@@ -0,0 +1,81 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+# long enough to be stored when it is evicted
+PROMPT = (
+    "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends and her big red ball. "
+    "One day, she saw a big dog in the park. The dog wanted to play with the ball too, so Lily threw it as far as she could."
+)
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 1024
+    server.slot_save_path = "./tmp"
+    server.temperature = 0.0
+
+
+@pytest.mark.parametrize("kv_spill_ram,kv_spill_path", [
+    (64, None),     # the evicted prompt stays in host memory
+    (0,  "./tmp"),  # the evicted prompt is moved to a file and read back
+])
+def test_kv_spill_restore(kv_spill_ram: int, kv_spill_path: str | None):
+    global server
+    server.kv_spill_ram = kv_spill_ram
+    server.kv_spill_path = kv_spill_path
+    server.start()
+
+    # the reference: slot 1 continues its own output, then its cache is erased so that it is not shared
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 16,
+    })
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT + content,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 16,
+    })
+    assert res.status_code == 200
+    expected = res.body
+
+    res = server.make_request("POST", "/slots/1?action=erase")
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 16,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content
+
+    # another request evicts the cached prompt of slot 0 to the store
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "The quick brown fox jumps over the lazy dog. " * 4,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 16,
+    })
+    assert res.status_code == 200
+
+    # slot 0 restores the evicted prompt and continues like the reference
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT + content,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 16,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == expected["timings"]["prompt_n"]
+    assert res.body["content"] == expected["content"]
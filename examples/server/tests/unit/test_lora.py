@@ -66,6 +66,39 @@ def test_lora_per_request():
         assert match_regex(re_test, res.body["content"])
 
 
+
+def test_lora_per_request_batched():
+    global server
+    server.n_slots = 2
+    server.start()
+
+    # the requests with different lora scales share a batch, each must give the same result as when it runs alone
+    prompt = "Look in thy glass"
+    lora_config = [
+        [{"id": 0, "scale": 0.3}],
+        [{"id": 0, "scale": 1.0}],
+    ]
+
+    def make_request(lora):
+        return server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "lora": lora,
+            "seed": 42,
+            "temperature": 0.0,
+            "n_predict": 32,
+            "cache_prompt": False,
+        })
+
+    expected = [make_request(lora) for lora in lora_config]
+    assert all([res.status_code == 200 for res in expected])
+
+    results = parallel_function_calls([(make_request, (lora,)) for lora in lora_config])
+
+    assert all([res.status_code == 200 for res in results])
+    for res, res_alone in zip(results, expected):
+        assert res.body["content"] == res_alone.body["content"]
+
+
 @pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
 def test_with_big_model():
     server = ServerProcess()
@@ -96,3 +96,110 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+PROMPT = "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends and her big red ball."
+
+
+def test_slot_save_preempt_restore():
+    global server
+    server.start()
+
+    # the reference: slot 1 continues its own output, then its cache is erased so that it is not shared
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT + content,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    expected = res.body
+
+    res = server.make_request("POST", "/slots/1?action=erase")
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content
+
+    res = server.make_request("POST", "/slots/0?action=save", data={
+        "filename": "slot0.bin",
+    })
+    assert res.status_code == 200
+    n_saved = res.body["n_saved"]
+
+    # another request overwrites the cache of slot 0
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "The quick brown fox jumps over the lazy dog.",
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot0.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == n_saved
+
+    # the restored slot continues like the reference
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT + content,
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == expected["timings"]["prompt_n"]
+    assert res.body["content"] == expected["content"]
+
+
+def test_slot_save_restore_same_file():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT,
+        "id_slot": 1,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1.bin",
+    })
+    assert res.status_code == 200
+    n_saved_1 = res.body["n_saved"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPT + " The end.",
+        "id_slot": 0,
+        "cache_prompt": True,
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    # the restore reads the file before or after the save, never while it is written
+    results = parallel_function_calls([
+        (server.make_request, ("POST", "/slots/0?action=save", {"filename": "slot1.bin"})),
+        (server.make_request, ("POST", "/slots/1?action=restore", {"filename": "slot1.bin"})),
+    ])
+    assert results[0].status_code == 200
+    assert results[1].status_code == 200
+    assert results[1].body["n_restored"] in [n_saved_1, results[0].body["n_saved"]]
@@ -61,6 +61,9 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    kv_dynamic: bool | None = False
+    kv_spill_ram: int | None = None
+    kv_spill_path: str | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -151,6 +154,12 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.kv_dynamic:
+            server_args.append("--kv-dynamic")
+        if self.kv_spill_ram:
+            server_args.extend(["--kv-spill-ram", self.kv_spill_ram])
+        if self.kv_spill_path:
+            server_args.extend(["--kv-spill-path", self.kv_spill_path])
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
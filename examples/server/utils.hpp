@@ -178,13 +178,34 @@ static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * voca
         result.push_back(json_prompt.get<llama_tokens>());
     } else if (json_prompt.is_array()) {
         // array of prompts
-        result.reserve(json_prompt.size());
-        for (const auto & p : json_prompt) {
-            if (p.is_string() || json_is_array_of_mixed_numbers_strings(p)) {
-                result.push_back(tokenize_mixed(vocab, p, add_special, parse_special));
+        result.resize(json_prompt.size());
+
+        // the plain strings are tokenized in parallel, this matters for the large arrays of documents of /rerank and /embeddings
+        std::vector<std::string> texts;
+        std::vector<size_t>      texts_idx;
+        for (size_t i = 0; i < json_prompt.size(); ++i) {
+            if (json_prompt[i].is_string()) {
+                texts.push_back(json_prompt[i].get<std::string>());
+                texts_idx.push_back(i);
+            }
+        }
+        if (!texts.empty()) {
+            std::vector<llama_tokens> tokens = common_tokenize_batch(vocab, texts, add_special, parse_special);
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                result[texts_idx[i]] = std::move(tokens[i]);
+            }
+        }
+
+        for (size_t i = 0; i < json_prompt.size(); ++i) {
+            const auto & p = json_prompt[i];
+            if (p.is_string()) {
+                continue;
+            }
+            if (json_is_array_of_mixed_numbers_strings(p)) {
+                result[i] = tokenize_mixed(vocab, p, add_special, parse_special);
             } else if (json_is_array_of_numbers(p)) {
                 // array of tokens
-                result.push_back(p.get<llama_tokens>());
+                result[i] = p.get<llama_tokens>();
             } else {
                 throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, or a list of mixed strings & tokens");
             }
@@ -1,5 +1,6 @@
 #include "arg.h"
 #include "common.h"
+#include "fft.h"
 #include "sampling.h"
 #include "log.h"
 #include "llama.h"
@@ -13,7 +14,6 @@
 #include <map>
 #include <regex>
 #include <string>
-#include <thread>
 #include <vector>
 
 //
@@ -113,158 +113,112 @@ static void fill_hann_window(int length, bool periodic, float * output) {
     }
 }
 
-// very poor-man fft
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
-}
-
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
-
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
-    }
-
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
-
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
-
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
-
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
-        }
-    }
-
-    for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
-    }
-}
-
+//
+// inverse STFT with streamed overlap-add, equivalent to
 //
 //  y = torch.nn.functional.fold(
 //       data, output_size=(1, output_size), kernel_size=(1, self.win_length), stride=(1, self.hop_length),
 //  )[:, 0, 0, pad:-pad]
 //
-// data.shape =  torch.Size([1, 1280, 261])
-// output_size =  84480
-// win_length =  1280
-// hop_length =  320
-// pad =  480
+// followed by the division with the folded squared window
 //
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
-
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
-
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
+// frame l covers the samples [l*n_hop - n_pad, l*n_hop - n_pad + n_win) of the output, so after it is added all
+// samples before (l + 1)*n_hop - n_pad are final and can be emitted
+//
+struct vocoder_istft {
+    static constexpr int n_fft = 1280;
+    static constexpr int n_hop = 320;
+    static constexpr int n_win = 1280;
+    static constexpr int n_pad = (n_win - n_hop)/2;
+
+    vocoder_istft() : fft(n_fft), hann(n_win), spec(n_fft + 2), frame(n_fft), acc(n_win, 0.0f), env(n_win, 0.0f) {
+        fill_hann_window(hann.size(), true, hann.data());
     }
 
-    output.resize(n_out - 2 * n_pad);
-}
+    // embd holds the log-magnitudes followed by the phases of the n_fft/2 + 1 bins
+    // appends the samples that became final to out
+    void push(const float * embd, int n_embd, std::vector<float> & out) {
+        GGML_ASSERT(n_embd == n_fft + 2);
 
-// TODO: not optimized at all
-static std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
-    const int n_fft = 1280;
-    const int n_hop = 320;
-    const int n_win = 1280;
-    const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
-
-    std::vector<float> hann(n_fft);
+        const int n_bin = n_embd/2;
+        for (int k = 0; k < n_bin; ++k) {
+            float mag = embd[k];
+            float phi = embd[k + n_bin];
 
-    fill_hann_window(hann.size(), true, hann.data());
+            mag = exp(mag);
 
-    int n_spec = n_embd*n_codes;
+            if (mag > 1e2) {
+                mag = 1e2;
+            }
+            spec[2*k + 0] = mag*cosf(phi);
+            spec[2*k + 1] = mag*sinf(phi);
+        }
 
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
+        fft.inverse(spec.data(), frame.data());
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
+        for (int j = 0; j < n_win; ++j) {
+            acc[j] += frame[j]*hann[j];
+            env[j] += hann[j]*hann[j];
         }
+
+        emit(n_hop, out);
+
+        // slide the window by one hop
+        std::copy(acc.begin() + n_hop, acc.end(), acc.begin());
+        std::copy(env.begin() + n_hop, env.end(), env.begin());
+        std::fill(acc.end() - n_hop, acc.end(), 0.0f);
+        std::fill(env.end() - n_hop, env.end(), 0.0f);
+
+        pos += n_hop;
+        n_frames++;
     }
 
-    for (int k = 0; k < n_embd/2; ++k) {
-        for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
+    // appends the remaining samples, n_frames*n_hop in total
+    void flush(std::vector<float> & out) {
+        emit(n_frames*n_hop - pos, out);
 
-            mag = exp(mag);
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        std::fill(env.begin(), env.end(), 0.0f);
 
-            if (mag > 1e2) {
-                mag = 1e2;
-            }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
-        }
+        pos      = -n_pad;
+        n_frames = 0;
     }
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
+private:
+    // emit the first n samples of the window, skipping the padding at the start
+    void emit(int n, std::vector<float> & out) {
+        for (int j = std::max(0, -pos); j < n; ++j) {
+            out.push_back(acc[j]/env[j]);
         }
     }
 
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
-
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
-                }
-            }
-        });
-    }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
-    }
+    common_fft fft;
 
-    std::vector<float> audio;
+    std::vector<float> hann;
+    std::vector<float> spec;
+    std::vector<float> frame;
+
+    // overlap-add accumulators for the output samples [pos, pos + n_win)
+    std::vector<float> acc;
     std::vector<float> env;
 
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env); // TODO: can be done once
+    int pos      = -n_pad;
+    int n_frames = 0;
+};
 
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
+static std::vector<float> embd_to_audio(
+        const float * embd,
+        const int n_codes,
+        const int n_embd) {
+    vocoder_istft istft;
+
+    std::vector<float> audio;
+    audio.reserve(n_codes*vocoder_istft::n_hop);
+
+    for (int l = 0; l < n_codes; ++l) {
+        istft.push(embd + l*n_embd, n_embd, audio);
     }
+    istft.flush(audio);
 
     return audio;
 }
@@ -921,7 +875,7 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
     const int n_embd = llama_model_n_embd(model_cts);
     const float * embd = llama_get_embeddings(ctx_cts);
 
-    auto audio = embd_to_audio(embd, n_codes, n_embd, params.cpuparams.n_threads);
+    auto audio = embd_to_audio(embd, n_codes, n_embd);
 
 #else
     // read the spectrogram from a file for debugging purposes
@@ -947,7 +901,7 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
 
         LOG_INF("%s: n_codes: %d, n_embd: %d\n", __func__, n_codes, n_embd);
 
-        audio = embd_to_audio(embd.data(), n_codes, n_embd, params.cpuparams.n_threads);
+        audio = embd_to_audio(embd.data(), n_codes, n_embd);
     }
 #endif
 
@@ -7,6 +7,9 @@
 extern "C" {
 #endif
 
+#define RPC_PROTO_MAJOR_VERSION    1
+#define RPC_PROTO_MINOR_VERSION    2
+#define RPC_PROTO_PATCH_VERSION    0
 #define GGML_RPC_MAX_SERVERS       16
 
 // backend API
@@ -15,9 +18,18 @@ GGML_BACKEND_API bool ggml_backend_is_rpc(ggml_backend_t backend);
 
 GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint);
 
+// split tensor buffer that splits matrices by rows across the RPC servers, in the order they were added
+// the matrix multiplications with split weights are computed on all the servers
+// main_device and tensor_split are indexed by the devices of ggml_backend_rpc_reg() only, not by a device list that also
+// contains local devices: tensor_split[i] is the proportion of rows of the i-th RPC device (ggml_backend_reg_dev_get())
+// and has one entry per RPC device; NULL or all zeros splits the rows in proportion to the free memory of the servers
+GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_rpc_split_buffer_type(int main_device, const float * tensor_split);
+
 GGML_BACKEND_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total);
 
-GGML_BACKEND_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem);
+// cache_dir: directory of the weight cache, or NULL to disable it
+// the files in the cache are named by the SHA-256 of their data, the cache is not bounded and files are never evicted
+GGML_BACKEND_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t free_mem, size_t total_mem);
 
 GGML_BACKEND_API ggml_backend_reg_t ggml_backend_rpc_reg(void);
 
@@ -520,6 +520,8 @@ extern "C" {
         GGML_OP_CROSS_ENTROPY_LOSS_BACK,
         GGML_OP_OPT_STEP_ADAMW,
 
+        GGML_OP_TOP_K,
+
         GGML_OP_COUNT,
     };
 
@@ -1769,12 +1771,19 @@ extern "C" {
             float                 stop,
             float                 step);
 
-    // top k elements per row
+    // indices of the top k elements per row, in descending order
     GGML_API struct ggml_tensor * ggml_top_k(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
             int                   k);
 
+    // same as ggml_top_k, but implemented as a view of ggml_argsort
+    // can be used with backends that support GGML_OP_ARGSORT, but not GGML_OP_TOP_K
+    GGML_API struct ggml_tensor * ggml_argsort_top_k(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
 #define GGML_KQ_MASK_PAD 32
 
     // q:    [n_embd, n_batch,     n_head,    1]
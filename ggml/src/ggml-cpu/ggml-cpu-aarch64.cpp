@@ -15,6 +15,7 @@
 #include <cfloat>
 #include <cstdlib> // for qsort
 #include <cstdio>  // for GGML_ASSERT
+#include <type_traits>
 
 #include "ggml-cpu-aarch64.h"
 
@@ -52,6 +53,38 @@ struct block_iq4_nlx4 {
 
 static_assert(sizeof(block_iq4_nlx4) == 4 * sizeof(ggml_half) + QK4_NL * 2, "wrong iq4_nlx4 block size/padding");
 
+// K-quant super blocks of 8 rows. the quants, the packed scales and the high bits are interleaved
+// in groups of 4 bytes: byte 32*i + 4*r + j is byte 4*i + j of row r, so that one 256 bit load
+// holds the same 4 positions of the 8 rows
+struct block_q4_Kx8 {
+    ggml_half d[8];           // super-block scales for the quantized scales
+    ggml_half dmin[8];        // super-block scales for the quantized mins
+    uint8_t   scales[96];     // scales and mins, quantized with 6 bits
+    uint8_t   qs[QK_K * 4];   // 4-bit quants
+};
+
+static_assert(sizeof(block_q4_Kx8) == 8 * sizeof(block_q4_K), "wrong q4_Kx8 block size/padding");
+
+struct block_q5_Kx8 {
+    ggml_half d[8];           // super-block scales for the quantized scales
+    ggml_half dmin[8];        // super-block scales for the quantized mins
+    uint8_t   scales[96];     // scales and mins, quantized with 6 bits
+    uint8_t   qh[QK_K];       // high bits of the quants
+    uint8_t   qs[QK_K * 4];   // low 4 bits of the quants
+};
+
+static_assert(sizeof(block_q5_Kx8) == 8 * sizeof(block_q5_K), "wrong q5_Kx8 block size/padding");
+
+// the scales are interleaved one byte at a time
+struct block_q6_Kx8 {
+    ggml_half d[8];                // super-block scales
+    int8_t    scales[QK_K / 2];    // scales, quantized with 8 bits
+    uint8_t   qh[QK_K * 2];        // upper 2 bits of the quants
+    uint8_t   ql[QK_K * 4];        // lower 4 bits of the quants
+};
+
+static_assert(sizeof(block_q6_Kx8) == 8 * sizeof(block_q6_K), "wrong q6_Kx8 block size/padding");
+
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
 #elif defined(_MSC_VER)
@@ -3591,6 +3624,454 @@ static void ggml_gemm_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs,
     }
 }
 
+// byte 32*i + 4*r + j of dst is byte 4*i + j of row r, the rows of src are stride bytes apart
+static void interleave_8x4(uint8_t * GGML_RESTRICT dst, const uint8_t * GGML_RESTRICT src, size_t stride, int n) {
+    for (int i = 0; i < n / 4; i++) {
+        for (int r = 0; r < 8; r++) {
+            memcpy(dst + 32 * i + 4 * r, src + r * stride + 4 * i, 4);
+        }
+    }
+}
+
+// the inverse of interleave_8x4 for row r
+static void deinterleave_8x4(uint8_t * GGML_RESTRICT dst, const uint8_t * GGML_RESTRICT src, int r, int n) {
+    for (int i = 0; i < n / 4; i++) {
+        memcpy(dst + 4 * i, src + 32 * i + 4 * r, 4);
+    }
+}
+
+static block_q4_K take_block(const block_q4_Kx8 & in, int r) {
+    block_q4_K out;
+    out.GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d    = in.d[r];
+    out.GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin = in.dmin[r];
+    deinterleave_8x4(out.scales, in.scales, r, K_SCALE_SIZE);
+    deinterleave_8x4(out.qs, in.qs, r, QK_K / 2);
+    return out;
+}
+
+static block_q5_K take_block(const block_q5_Kx8 & in, int r) {
+    block_q5_K out;
+    out.GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d    = in.d[r];
+    out.GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin = in.dmin[r];
+    deinterleave_8x4(out.scales, in.scales, r, K_SCALE_SIZE);
+    deinterleave_8x4(out.qh, in.qh, r, QK_K / 8);
+    deinterleave_8x4(out.qs, in.qs, r, QK_K / 2);
+    return out;
+}
+
+static block_q6_K take_block(const block_q6_Kx8 & in, int r) {
+    block_q6_K out;
+    out.d = in.d[r];
+    for (int i = 0; i < QK_K / 16; i++) {
+        out.scales[i] = in.scales[8 * i + r];
+    }
+    deinterleave_8x4(out.qh, in.qh, r, QK_K / 4);
+    deinterleave_8x4(out.ql, in.ql, r, QK_K / 2);
+    return out;
+}
+
+#if defined(__AVX2__)
+static inline __m256i broadcast_i8x4(const int8_t * x) {
+    int32_t v;
+    memcpy(&v, x, sizeof(v));
+    return _mm256_set1_epi32(v);
+}
+
+// multiply uint8_t with int8_t, add pairwise, multiply the int16_t pairs with the int16_t scales
+// and accumulate as int32_t
+static inline __m256i mul_add_us8_scaled_int32x8(const __m256i acc, const __m256i ax, const __m256i sy, const __m256i scales) {
+    const __m256i dot = _mm256_maddubs_epi16(ax, sy);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpwssd_epi32(acc, dot, scales);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpwssd_avx_epi32(acc, dot, scales);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(dot, scales));
+#endif
+}
+
+// byte i of each 32 bit lane, as a pair of int16_t
+static inline __m256i byte_to_i16_pairs(const __m256i x, const int i) {
+    const __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(0x80008000 | (i << 16) | i),
+                                         _mm256_set_epi32(0x000c000c, 0x00080008, 0x00040004, 0, 0x000c000c, 0x00080008, 0x00040004, 0));
+    return _mm256_shuffle_epi8(x, idx);
+}
+
+static inline const int8_t * q8_0_quants(const block_q8_0 & a, int /* m */, int i) {
+    return a.qs + 4 * i;
+}
+
+static inline const int8_t * q8_0_quants(const block_q8_0x4 & a, int m, int i) {
+    return a.qs + 16 * i + 4 * m;
+}
+
+static inline float q8_0_delta(const block_q8_0 & a, int /* m */) {
+    return GGML_FP16_TO_FP32(a.d);
+}
+
+static inline float q8_0_delta(const block_q8_0x4 & a, int m) {
+    return GGML_FP16_TO_FP32(a.d[m]);
+}
+
+// 8 interleaved rows of q8_0 with NR rows of q8_0 (NR == 1) or with a block_q8_0x4 (NR == 4)
+// lane r of the accumulators is the dot product with row r, the results are stored in s[m * bs + r]
+template <typename TA, int NR>
+static void gemm_q8_0_8x4_avx2(int nb, float * GGML_RESTRICT s, size_t bs, const block_q8_0x8 * GGML_RESTRICT b, const TA * GGML_RESTRICT a) {
+    __m256 acc[NR];
+    for (int m = 0; m < NR; m++) {
+        acc[m] = _mm256_setzero_ps();
+    }
+
+    for (int l = 0; l < nb; l++) {
+        __m256i sumi[NR];
+        for (int m = 0; m < NR; m++) {
+            sumi[m] = _mm256_setzero_si256();
+        }
+        for (int i = 0; i < QK8_0 / 4; i++) {
+            const __m256i qx = _mm256_loadu_si256((const __m256i *) (b[l].qs + 32 * i));
+            const __m256i ax = _mm256_sign_epi8(qx, qx);
+            for (int m = 0; m < NR; m++) {
+                const __m256i sy = _mm256_sign_epi8(broadcast_i8x4(q8_0_quants(a[l], m, i)), qx);
+                sumi[m] = _mm256_add_epi32(sumi[m], mul_sum_us8_pairs_int32x8(ax, sy));
+            }
+        }
+        const __m256 d = GGML_F32Cx8_LOAD(b[l].d);
+        for (int m = 0; m < NR; m++) {
+            acc[m] = _mm256_fmadd_ps(_mm256_mul_ps(d, _mm256_set1_ps(q8_0_delta(a[l], m))), _mm256_cvtepi32_ps(sumi[m]), acc[m]);
+        }
+    }
+
+    for (int m = 0; m < NR; m++) {
+        _mm256_storeu_ps(s + m * bs, acc[m]);
+    }
+}
+
+// 8 interleaved rows of q4_K or q5_K with NR rows of q8_K, the rows of a are nb blocks apart
+template <typename TB, int NR>
+static void gemm_q4_K_8x4_avx2(int nb, float * GGML_RESTRICT s, size_t bs, const TB * GGML_RESTRICT b, const block_q8_K * GGML_RESTRICT a) {
+    constexpr bool has_qh = std::is_same_v<TB, block_q5_Kx8>;
+
+    const __m256i m4     = _mm256_set1_epi8(0x0F);
+    const __m256i mh     = _mm256_set1_epi8(0x10);
+    const __m256i kmask1 = _mm256_set1_epi32(0x3f3f3f3f);
+    const __m256i kmask2 = _mm256_set1_epi32(0x0f0f0f0f);
+    const __m256i kmask3 = _mm256_set1_epi32(0x03030303);
+
+    __m256 acc[NR];
+    for (int m = 0; m < NR; m++) {
+        acc[m] = _mm256_setzero_ps();
+    }
+
+    for (int l = 0; l < nb; l++) {
+        // lane r holds 4 of the 12 bytes of scales and mins of row r, unpacked as in ggml_vec_dot_q4_K_q8_K
+        const __m256i u0 = _mm256_loadu_si256((const __m256i *) (b[l].scales +  0));
+        const __m256i u1 = _mm256_loadu_si256((const __m256i *) (b[l].scales + 32));
+        const __m256i u2 = _mm256_loadu_si256((const __m256i *) (b[l].scales + 64));
+        const __m256i scales[2] = {
+            _mm256_and_si256(u0, kmask1),
+            _mm256_or_si256(_mm256_and_si256(u2, kmask2), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(u0, 6), kmask3), 4)),
+        };
+        const __m256i mins[2] = {
+            _mm256_and_si256(u1, kmask1),
+            _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(u2, 4), kmask2), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(u1, 6), kmask3), 4)),
+        };
+
+        // two independent accumulators per row to hide the latency of the dot products
+        __m256i sumi[NR][2];
+        __m256i summ[NR];
+        for (int m = 0; m < NR; m++) {
+            sumi[m][0] = _mm256_setzero_si256();
+            sumi[m][1] = _mm256_setzero_si256();
+            summ[m]    = _mm256_setzero_si256();
+        }
+
+        for (int j = 0; j < QK_K / 64; j++) {
+            const __m256i sc0 = byte_to_i16_pairs(scales[j / 2], (2 * j + 0) % 4);
+            const __m256i sc1 = byte_to_i16_pairs(scales[j / 2], (2 * j + 1) % 4);
+            for (int i = 0; i < 8; i++) {
+                const __m256i qx = _mm256_loadu_si256((const __m256i *) (b[l].qs + 256 * j + 32 * i));
+                __m256i qx0 = _mm256_and_si256(qx, m4);
+                __m256i qx1 = _mm256_and_si256(_mm256_srli_epi16(qx, 4), m4);
+                if constexpr (has_qh) {
+                    const __m256i qh = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) (b[l].qh + 32 * i)), _mm_cvtsi32_si128(2 * j));
+                    qx0 = _mm256_or_si256(qx0, _mm256_and_si256(_mm256_slli_epi16(qh, 4), mh));
+                    qx1 = _mm256_or_si256(qx1, _mm256_and_si256(_mm256_slli_epi16(qh, 3), mh));
+                }
+                for (int m = 0; m < NR; m++) {
+                    const int8_t * y = a[m * nb + l].qs + 64 * j + 4 * i;
+                    sumi[m][0] = mul_add_us8_scaled_int32x8(sumi[m][0], qx0, broadcast_i8x4(y), sc0);
+                    sumi[m][1] = mul_add_us8_scaled_int32x8(sumi[m][1], qx1, broadcast_i8x4(y + 32), sc1);
+                }
+            }
+        }
+
+        // one min per 32 quants, against the two sums of 16 quants of q8_K
+        for (int g = 0; g < QK_K / 32; g++) {
+            const __m256i mg = byte_to_i16_pairs(mins[g / 4], g % 4);
+            for (int m = 0; m < NR; m++) {
+                const __m256i bsums = broadcast_i8x4((const int8_t *) (a[m * nb + l].bsums + 2 * g));
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+                summ[m] = _mm256_dpwssd_epi32(summ[m], mg, bsums);
+#elif defined(__AVXVNNI__)
+                summ[m] = _mm256_dpwssd_avx_epi32(summ[m], mg, bsums);
+#else
+                summ[m] = _mm256_add_epi32(summ[m], _mm256_madd_epi16(mg, bsums));
+#endif
+            }
+        }
+
+        const __m256 d    = GGML_F32Cx8_LOAD(b[l].d);
+        const __m256 dmin = GGML_F32Cx8_LOAD(b[l].dmin);
+        for (int m = 0; m < NR; m++) {
+            const __m256 dy = _mm256_set1_ps(a[m * nb + l].d);
+            acc[m] = _mm256_fmadd_ps(_mm256_mul_ps(d, dy), _mm256_cvtepi32_ps(_mm256_add_epi32(sumi[m][0], sumi[m][1])), acc[m]);
+            acc[m] = _mm256_fnmadd_ps(_mm256_mul_ps(dmin, dy), _mm256_cvtepi32_ps(summ[m]), acc[m]);
+        }
+    }
+
+    for (int m = 0; m < NR; m++) {
+        _mm256_storeu_ps(s + m * bs, acc[m]);
+    }
+}
+
+// 8 interleaved rows of q6_K with NR rows of q8_K, the rows of a are nb blocks apart
+template <int NR>
+static void gemm_q6_K_8x4_avx2(int nb, float * GGML_RESTRICT s, size_t bs, const block_q6_Kx8 * GGML_RESTRICT b, const block_q8_K * GGML_RESTRICT a) {
+    const __m256i m4 = _mm256_set1_epi8(0x0F);
+    const __m256i m2 = _mm256_set1_epi8(0x30);
+
+    __m256 acc[NR];
+    for (int m = 0; m < NR; m++) {
+        acc[m] = _mm256_setzero_ps();
+    }
+
+    for (int l = 0; l < nb; l++) {
+        // two independent accumulators per row to hide the latency of the dot products
+        __m256i sumi[NR][2];
+        __m256i summ[NR];
+        for (int m = 0; m < NR; m++) {
+            sumi[m][0] = _mm256_setzero_si256();
+            sumi[m][1] = _mm256_setzero_si256();
+            summ[m]    = _mm256_setzero_si256();
+        }
+
+        // 128 quants per iteration of n, in 4 chunks of 32 with one scale for each 16
+        for (int n = 0; n < QK_K / 128; n++) {
+            for (int h = 0; h < 2; h++) {
+                __m256i sc[4];
+                for (int c = 0; c < 4; c++) {
+                    const int g = 2 * (4 * n + c) + h;
+                    const __m256i s32 = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (b[l].scales + 8 * g)));
+                    sc[c] = _mm256_blend_epi16(s32, _mm256_slli_epi32(s32, 16), 0xAA);
+                    // the quants are offset by 32
+                    for (int m = 0; m < NR; m++) {
+                        const __m256i bsum = _mm256_set1_epi32((uint16_t) a[m * nb + l].bsums[g]);
+                        summ[m] = _mm256_add_epi32(summ[m], _mm256_madd_epi16(sc[c], bsum));
+                    }
+                }
+                for (int i = 4 * h; i < 4 * h + 4; i++) {
+                    const __m256i ql0 = _mm256_loadu_si256((const __m256i *) (b[l].ql + 512 * n + 32 * i));
+                    const __m256i ql1 = _mm256_loadu_si256((const __m256i *) (b[l].ql + 512 * n + 256 + 32 * i));
+                    const __m256i qh  = _mm256_loadu_si256((const __m256i *) (b[l].qh + 256 * n + 32 * i));
+                    const __m256i qx[4] = {
+                        _mm256_or_si256(_mm256_and_si256(ql0, m4), _mm256_and_si256(_mm256_slli_epi16(qh, 4), m2)),
+                        _mm256_or_si256(_mm256_and_si256(ql1, m4), _mm256_and_si256(_mm256_slli_epi16(qh, 2), m2)),
+                        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql0, 4), m4), _mm256_and_si256(qh, m2)),
+                        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql1, 4), m4), _mm256_and_si256(_mm256_srli_epi16(qh, 2), m2)),
+                    };
+                    for (int m = 0; m < NR; m++) {
+                        const int8_t * y = a[m * nb + l].qs + 128 * n + 4 * i;
+                        for (int c = 0; c < 4; c++) {
+                            sumi[m][c % 2] = mul_add_us8_scaled_int32x8(sumi[m][c % 2], qx[c], broadcast_i8x4(y + 32 * c), sc[c]);
+                        }
+                    }
+                }
+            }
+        }
+
+        const __m256 d = GGML_F32Cx8_LOAD(b[l].d);
+        for (int m = 0; m < NR; m++) {
+            const __m256i isum = _mm256_sub_epi32(_mm256_add_epi32(sumi[m][0], sumi[m][1]), _mm256_slli_epi32(summ[m], 5));
+            acc[m] = _mm256_fmadd_ps(_mm256_mul_ps(d, _mm256_set1_ps(a[m * nb + l].d)), _mm256_cvtepi32_ps(isum), acc[m]);
+        }
+    }
+
+    for (int m = 0; m < NR; m++) {
+        _mm256_storeu_ps(s + m * bs, acc[m]);
+    }
+}
+#endif // __AVX2__
+
+static void ggml_gemv_q8_0_8x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(bs);
+    UNUSED(nr);
+
+#if defined(__AVX2__)
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        gemm_q8_0_8x4_avx2<block_q8_0, 1>(nb, s + x * ncols_interleaved, 0,
+                                          (const block_q8_0x8 *) vx + x * nb, (const block_q8_0 *) vy);
+    }
+    return;
+#endif
+    float sumf[8];
+
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+        for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+        for (int l = 0; l < nb; l++) {
+            for (int j = 0; j < ncols_interleaved; j++) {
+                int sumi = 0;
+                for (int k = 0; k < qk / blocklen; k++) {
+                    for (int i = 0; i < blocklen; ++i) {
+                        sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] * a_ptr[l].qs[k * blocklen + i];
+                    }
+                }
+                sumf[j] += sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d);
+            }
+        }
+        for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+    }
+}
+
+static void ggml_gemm_q8_0_8x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+#if defined(__AVX2__)
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            gemm_q8_0_8x4_avx2<block_q8_0x4, 4>(nb, s + (y * 4) * bs + x * ncols_interleaved, bs,
+                                                (const block_q8_0x8 *) vx + x * nb, a_ptr);
+        }
+    }
+    return;
+#endif
+    float sumf[4][8];
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+            }
+            for (int l = 0; l < nb; l++) {
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        int sumi = 0;
+                        for (int k = 0; k < qk / blocklen; k++) {
+                            for (int i = 0; i < blocklen; ++i) {
+                                sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] *
+                                        a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                            }
+                        }
+                        sumf[m][j] += sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d[m]);
+                    }
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++)
+                    s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+            }
+        }
+    }
+}
+
+#if defined(__AVX2__)
+template <typename TB, int NR>
+static void gemm_x8_q8_K_avx2(int nb, float * GGML_RESTRICT s, size_t bs, const TB * GGML_RESTRICT b, const block_q8_K * GGML_RESTRICT a) {
+    if constexpr (std::is_same_v<TB, block_q6_Kx8>) {
+        gemm_q6_K_8x4_avx2<NR>(nb, s, bs, b, a);
+    } else {
+        gemm_q4_K_8x4_avx2<TB, NR>(nb, s, bs, b, a);
+    }
+}
+#endif // __AVX2__
+
+// 8 interleaved rows of a K-quant with nr plain rows of q8_K
+// without AVX2 the blocks of each row are taken out of the interleaved layout for ggml_vec_dot
+template <typename TB>
+static void gemm_x8_q8_K(ggml_type type, int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int nb = n / QK_K;
+    const int ncols_interleaved = 8;
+
+    assert (n % QK_K == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    const TB         * b_ptr = (const TB *) vx;
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+    int y = 0;
+#if defined(__AVX2__)
+    for (; y + 4 <= nr; y += 4) {
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            gemm_x8_q8_K_avx2<TB, 4>(nb, s + y * bs + x * ncols_interleaved, bs, b_ptr + x * nb, a_ptr + y * nb);
+        }
+    }
+    for (; y < nr; y++) {
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            gemm_x8_q8_K_avx2<TB, 1>(nb, s + y * bs + x * ncols_interleaved, bs, b_ptr + x * nb, a_ptr + y * nb);
+        }
+    }
+#endif
+    const ggml_vec_dot_t vec_dot = ggml_get_type_traits_cpu(type)->vec_dot;
+
+    for (; y < nr; y++) {
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            for (int j = 0; j < ncols_interleaved; j++) {
+                float sumf = 0.0f;
+                for (int l = 0; l < nb; l++) {
+                    const auto b = take_block(b_ptr[x * nb + l], j);
+                    float sumb;
+                    vec_dot(QK_K, &sumb, 0, &b, 0, a_ptr + y * nb + l, 0, 1);
+                    sumf += sumb;
+                }
+                s[y * bs + x * ncols_interleaved + j] = sumf;
+            }
+        }
+    }
+}
+
+static void ggml_gemv_q4_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q4_Kx8>(GGML_TYPE_Q4_K, n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q4_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q4_Kx8>(GGML_TYPE_Q4_K, n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemv_q5_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q5_Kx8>(GGML_TYPE_Q5_K, n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q5_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q5_Kx8>(GGML_TYPE_Q5_K, n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemv_q6_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q6_Kx8>(GGML_TYPE_Q6_K, n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q6_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_x8_q8_K<block_q6_Kx8>(GGML_TYPE_Q6_K, n, s, bs, vx, vy, nr, nc);
+}
 static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
     block_q4_0x4 out;
 
@@ -3789,6 +4270,91 @@ static int repack_iq4_nl_to_iq4_nl_4_bl(struct ggml_tensor * t, int interleave_b
     GGML_UNUSED(data_size);
 }
 
+static block_q8_0x8 make_block_q8_0x8(const block_q8_0 * in) {
+    block_q8_0x8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+    }
+    interleave_8x4((uint8_t *) out.qs, (const uint8_t *) in[0].qs, sizeof(block_q8_0), QK8_0);
+
+    return out;
+}
+
+static block_q4_Kx8 make_block_q4_Kx8(const block_q4_K * in) {
+    block_q4_Kx8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i]    = in[i].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d;
+        out.dmin[i] = in[i].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin;
+    }
+    interleave_8x4(out.scales, in[0].scales, sizeof(block_q4_K), K_SCALE_SIZE);
+    interleave_8x4(out.qs, in[0].qs, sizeof(block_q4_K), QK_K / 2);
+
+    return out;
+}
+
+static block_q5_Kx8 make_block_q5_Kx8(const block_q5_K * in) {
+    block_q5_Kx8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i]    = in[i].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d;
+        out.dmin[i] = in[i].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin;
+    }
+    interleave_8x4(out.scales, in[0].scales, sizeof(block_q5_K), K_SCALE_SIZE);
+    interleave_8x4(out.qh, in[0].qh, sizeof(block_q5_K), QK_K / 8);
+    interleave_8x4(out.qs, in[0].qs, sizeof(block_q5_K), QK_K / 2);
+
+    return out;
+}
+
+static block_q6_Kx8 make_block_q6_Kx8(const block_q6_K * in) {
+    block_q6_Kx8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+        for (int j = 0; j < QK_K / 16; j++) {
+            out.scales[8 * j + i] = in[i].scales[j];
+        }
+    }
+    interleave_8x4(out.qh, in[0].qh, sizeof(block_q6_K), QK_K / 4);
+    interleave_8x4(out.ql, in[0].ql, sizeof(block_q6_K), QK_K / 2);
+
+    return out;
+}
+
+// interleave the blocks of each group of 8 rows
+template <typename BLOC_TYPE, typename BLOC_TYPE_X8>
+static int repack_to_x8_bl(struct ggml_tensor * t, const void * GGML_RESTRICT data, size_t data_size,
+                           BLOC_TYPE_X8 (*make_block)(const BLOC_TYPE *)) {
+    constexpr int nrows_interleaved = 8;
+
+    BLOC_TYPE_X8 * dst = (BLOC_TYPE_X8 *) t->data;
+    const BLOC_TYPE * src = (const BLOC_TYPE *) data;
+    BLOC_TYPE dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / ggml_blck_size(t->type);
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(BLOC_TYPE));
+
+    if (t->ne[1] % nrows_interleaved != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block(dst_tmp);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 namespace ggml::cpu::aarch64 {
 // repack
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
@@ -3816,6 +4382,26 @@ template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void *
 //    return repack_iq4_nl_to_iq4_nl_4_bl(t, 8, data, data_size);
 //}
 
+template <> int repack<block_q8_0, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q8_0);
+    return repack_to_x8_bl<block_q8_0, block_q8_0x8>(t, data, data_size, make_block_q8_0x8);
+}
+
+template <> int repack<block_q4_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q4_K);
+    return repack_to_x8_bl<block_q4_K, block_q4_Kx8>(t, data, data_size, make_block_q4_Kx8);
+}
+
+template <> int repack<block_q5_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q5_K);
+    return repack_to_x8_bl<block_q5_K, block_q5_Kx8>(t, data, data_size, make_block_q5_Kx8);
+}
+
+template <> int repack<block_q6_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q6_K);
+    return repack_to_x8_bl<block_q6_K, block_q6_Kx8>(t, data, data_size, make_block_q6_Kx8);
+}
+
 // gemv
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
 void gemv(int, float *, size_t, const void *, const void *, int, int);
@@ -3837,6 +4423,22 @@ void gemv<block_iq4_nl, 4, 4>(int n, float * s, size_t bs, const void * vx, cons
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q8_0, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q8_0_8x4_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q4_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q4_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q5_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q5_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q6_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q6_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 // gemm
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
 void gemm(int, float *, size_t, const void *, const void *, int, int);
@@ -3858,21 +4460,60 @@ void gemm<block_iq4_nl, 4, 4>(int n, float * s, size_t bs, const void * vx, cons
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q8_0, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q8_0_8x4_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q4_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q4_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q5_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q5_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q6_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q6_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+// quantize groups of 4 rows of src1 into the layout expected by gemm
+template <int64_t INTER_SIZE, ggml_type PARAM_TYPE>
+void quantize_mat(const float * x, void * vy, int64_t nrow, int64_t n_per_row);
+
+template <> void quantize_mat<4, GGML_TYPE_Q8_0>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    quantize_mat_q8_0(x, vy, nrow, n_per_row, 4);
+}
+
+template <> void quantize_mat<8, GGML_TYPE_Q8_0>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    quantize_mat_q8_0(x, vy, nrow, n_per_row, 8);
+}
+
+// the K-quant kernels read plain q8_K rows
+template <> void quantize_mat<4, GGML_TYPE_Q8_K>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_K)->from_float;
+    const size_t            row_size   = ggml_row_size(GGML_TYPE_Q8_K, n_per_row);
+
+    for (int64_t i = 0; i < nrow; i++) {
+        from_float(x + i * n_per_row, (char *) vy + i * row_size, n_per_row);
+    }
+}
+
 class tensor_traits_base : public ggml::cpu::tensor_traits {
   public:
     virtual int repack(struct ggml_tensor * t, const void * data, size_t data_size) = 0;
 };
 
-template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_traits : public tensor_traits_base {
+template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PARAM_TYPE>
+class tensor_traits : public tensor_traits_base {
 
     bool work_size(int /* n_threads */, const struct ggml_tensor * op, size_t & size) override {
-        // not realy a GGML_TYPE_Q8_0 but same size.
+        // not realy a PARAM_TYPE but same size.
         switch (op->op) {
         case GGML_OP_MUL_MAT:
-            size = ggml_row_size(GGML_TYPE_Q8_0, ggml_nelements(op->src[1]));
+            size = ggml_row_size(PARAM_TYPE, ggml_nelements(op->src[1]));
             return true;
         case GGML_OP_MUL_MAT_ID:
-            size = ggml_row_size(GGML_TYPE_Q8_0, ggml_nelements(op->src[1]));
+            size = ggml_row_size(PARAM_TYPE, ggml_nelements(op->src[1]));
             size = GGML_PAD(size, sizeof(int64_t));  // + padding for next bloc.
             size += sizeof(int64_t) * (1+op->src[0]->ne[2]) * op->src[1]->ne[2];
             return true;
@@ -3925,16 +4566,16 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         // GGML_ASSERT(ggml_n_dims(op->src[1]) == 2);
 
         char *       wdata = static_cast<char *>(params->wdata);
-        const size_t nbw1  = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t nbw1  = ggml_row_size(PARAM_TYPE, ne10);
 
         assert(params->wsize >= nbw1 * ne11);
 
-        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->from_float;
+        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
         int64_t i11_processed = 0;
         for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
-            quantize_mat_q8_0((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10,
-                              INTER_SIZE);
+            quantize_mat<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11),
+                                                 (void *) (wdata + i11 * nbw1), 4, ne10);
         }
         i11_processed = ne11 - ne11 % 4;
         for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
@@ -3944,7 +4585,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         ggml_barrier(params->threadpool);
 
         const void * src1_wdata      = params->wdata;
-        const size_t src1_col_stride = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t src1_col_stride = ggml_row_size(PARAM_TYPE, ne10);
         int64_t      src0_start      = (ith * ne01) / nth;
         int64_t      src0_end        = ((ith + 1) * ne01) / nth;
         src0_start = (src0_start % NB_COLS) ? src0_start + NB_COLS - (src0_start % NB_COLS) : src0_start;
@@ -3978,7 +4619,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         const int ith = params->ith;
         const int nth = params->nth;
 
-        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->from_float;
+        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
         // we don't support permuted src0 or src1
         GGML_ASSERT(nb00 == ggml_type_size(src0->type));
@@ -4000,7 +4641,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         const int n_ids = ids->ne[0]; // n_expert_used
         const int n_as  = ne02;       // n_expert
 
-        const size_t nbw1 = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t nbw1 = ggml_row_size(PARAM_TYPE, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
@@ -4017,7 +4658,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         int64_t *                 matrix_row_counts = (int64_t *) (wdata_src1_end);                      // [n_as]
         struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *) (matrix_row_counts + n_as);  // [n_as][ne12]
 
-        // src1: float32 => block_q8_0
+        // src1: float32 => PARAM_TYPE
         for (int64_t i12 = 0; i12 < ne12; ++i12) {
             for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
                 from_float((float *)((char *) src1->data + i12 * nb12 + i11 * nb11),
@@ -4098,12 +4739,20 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
 };
 
 // instance for Q4
-static const tensor_traits<block_q4_0, 4, 4> q4_0_4x4_q8_0;
-static const tensor_traits<block_q4_0, 8, 4> q4_0_4x8_q8_0;
-static const tensor_traits<block_q4_0, 8, 8> q4_0_8x8_q8_0;
+static const tensor_traits<block_q4_0, 4, 4, GGML_TYPE_Q8_0> q4_0_4x4_q8_0;
+static const tensor_traits<block_q4_0, 8, 4, GGML_TYPE_Q8_0> q4_0_4x8_q8_0;
+static const tensor_traits<block_q4_0, 8, 8, GGML_TYPE_Q8_0> q4_0_8x8_q8_0;
 
 // instance for IQ4
-static const tensor_traits<block_iq4_nl, 4, 4> iq4_nl_4x4_q8_0;
+static const tensor_traits<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
+
+// instance for Q8_0
+static const tensor_traits<block_q8_0, 4, 8, GGML_TYPE_Q8_0> q8_0_8x4_q8_0;
+
+// instance for K-quants
+static const tensor_traits<block_q4_K, 4, 8, GGML_TYPE_Q8_K> q4_K_8x4_q8_K;
+static const tensor_traits<block_q5_K, 4, 8, GGML_TYPE_Q8_K> q5_K_8x4_q8_K;
+static const tensor_traits<block_q6_K, 4, 8, GGML_TYPE_Q8_K> q6_K_8x4_q8_K;
 
 }  // namespace ggml::cpu::aarch64
 
@@ -4130,6 +4779,30 @@ static const ggml::cpu::tensor_traits * ggml_aarch64_get_optimal_repack_type(con
                 return &ggml::cpu::aarch64::iq4_nl_4x4_q8_0;
             }
         }
+    } else if (cur->type == GGML_TYPE_Q8_0) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q8_0_8x4_q8_0;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q4_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q4_K_8x4_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q5_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q5_K_8x4_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q6_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q6_K_8x4_q8_K;
+            }
+        }
     }
 
     return nullptr;
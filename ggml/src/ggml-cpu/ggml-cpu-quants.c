@@ -10918,3 +10918,138 @@ void quantize_row_iq4_xs(const float * restrict x, void * restrict y, int64_t k)
     assert(k % QK_K == 0);
     quantize_iq4_xs(x, y, 1, k, NULL);
 }
+
+// ============================ fused dequantize + multiply-add
+
+// y[i] += x[i]*v for a quantized row x, without materializing the dequantized row
+// used by the flash attention V accumulation over a quantized V cache
+
+void ggml_vec_mad_q8_0(const int n, float * restrict y, const void * restrict vx, const float v) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+
+#if defined(__AVX512F__)
+    for (int i = 0; i < nb; ++i) {
+        const __m512 d = _mm512_set1_ps(GGML_FP16_TO_FP32(x[i].d)*v);
+
+        for (int j = 0; j < qk; j += 16) {
+            const __m512 q = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(x[i].qs + j))));
+
+            float * yj = y + i*qk + j;
+            _mm512_storeu_ps(yj, _mm512_fmadd_ps(q, d, _mm512_loadu_ps(yj)));
+        }
+    }
+#elif defined(__AVX2__)
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*v);
+
+        for (int j = 0; j < qk; j += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(x[i].qs + j))));
+
+            float * yj = y + i*qk + j;
+            _mm256_storeu_ps(yj, _mm256_fmadd_ps(q, d, _mm256_loadu_ps(yj)));
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < nb; ++i) {
+        const float32x4_t d = vdupq_n_f32(GGML_FP16_TO_FP32(x[i].d)*v);
+
+        for (int j = 0; j < qk; j += 16) {
+            const int8x16_t q8 = vld1q_s8(x[i].qs + j);
+
+            const int16x8_t q16_l = vmovl_s8(vget_low_s8 (q8));
+            const int16x8_t q16_h = vmovl_s8(vget_high_s8(q8));
+
+            float * yj = y + i*qk + j;
+            vst1q_f32(yj +  0, vmlaq_f32(vld1q_f32(yj +  0), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16_l))), d));
+            vst1q_f32(yj +  4, vmlaq_f32(vld1q_f32(yj +  4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16_l))), d));
+            vst1q_f32(yj +  8, vmlaq_f32(vld1q_f32(yj +  8), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16_h))), d));
+            vst1q_f32(yj + 12, vmlaq_f32(vld1q_f32(yj + 12), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16_h))), d));
+        }
+    }
+#else
+    for (int i = 0; i < nb; ++i) {
+        const float d = GGML_FP16_TO_FP32(x[i].d)*v;
+
+        for (int j = 0; j < qk; ++j) {
+            y[i*qk + j] += x[i].qs[j]*d;
+        }
+    }
+#endif
+}
+
+void ggml_vec_mad_q4_0(const int n, float * restrict y, const void * restrict vx, const float v) {
+    const int qk = QK4_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+    const __m128i m4 = _mm_set1_epi8(0xF);
+    const __m128i s8 = _mm_set1_epi8(8);
+
+    for (int i = 0; i < nb; ++i) {
+        const float d = GGML_FP16_TO_FP32(x[i].d)*v;
+
+        // the low nibbles hold elements [0, 16), the high nibbles [16, 32)
+        const __m128i qs = _mm_loadu_si128((const __m128i *) x[i].qs);
+        const __m128i ql = _mm_sub_epi8(_mm_and_si128(qs, m4), s8);
+        const __m128i qh = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qs, 4), m4), s8);
+
+        float * yi = y + i*qk;
+#if defined(__AVX512F__)
+        const __m512 vd = _mm512_set1_ps(d);
+
+        _mm512_storeu_ps(yi +  0, _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(ql)), vd, _mm512_loadu_ps(yi +  0)));
+        _mm512_storeu_ps(yi + 16, _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(qh)), vd, _mm512_loadu_ps(yi + 16)));
+#else
+        const __m256 vd = _mm256_set1_ps(d);
+
+        _mm256_storeu_ps(yi +  0, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(ql)),                   vd, _mm256_loadu_ps(yi +  0)));
+        _mm256_storeu_ps(yi +  8, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(ql, 8))), vd, _mm256_loadu_ps(yi +  8)));
+        _mm256_storeu_ps(yi + 16, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(qh)),                   vd, _mm256_loadu_ps(yi + 16)));
+        _mm256_storeu_ps(yi + 24, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(qh, 8))), vd, _mm256_loadu_ps(yi + 24)));
+#endif
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t m4 = vdupq_n_u8(0xF);
+    const int8x16_t  s8 = vdupq_n_s8(8);
+
+    for (int i = 0; i < nb; ++i) {
+        const float32x4_t d = vdupq_n_f32(GGML_FP16_TO_FP32(x[i].d)*v);
+
+        const uint8x16_t qs = vld1q_u8(x[i].qs);
+
+        const int8x16_t q8[2] = {
+            vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (qs, m4)), s8),
+            vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(qs, 4)),  s8),
+        };
+
+        for (int k = 0; k < 2; ++k) {
+            const int16x8_t q16_l = vmovl_s8(vget_low_s8 (q8[k]));
+            const int16x8_t q16_h = vmovl_s8(vget_high_s8(q8[k]));
+
+            float * yk = y + i*qk + k*qk/2;
+            vst1q_f32(yk +  0, vmlaq_f32(vld1q_f32(yk +  0), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16_l))), d));
+            vst1q_f32(yk +  4, vmlaq_f32(vld1q_f32(yk +  4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16_l))), d));
+            vst1q_f32(yk +  8, vmlaq_f32(vld1q_f32(yk +  8), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16_h))), d));
+            vst1q_f32(yk + 12, vmlaq_f32(vld1q_f32(yk + 12), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16_h))), d));
+        }
+    }
+#else
+    for (int i = 0; i < nb; ++i) {
+        const float d = GGML_FP16_TO_FP32(x[i].d)*v;
+
+        for (int j = 0; j < qk/2; ++j) {
+            y[i*qk + j]        += ((x[i].qs[j] & 0x0F) - 8)*d;
+            y[i*qk + j + qk/2] += ((x[i].qs[j] >>   4) - 8)*d;
+        }
+    }
+#endif
+}
@@ -34,6 +34,7 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <linux/mempolicy.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -1311,6 +1312,9 @@ struct ggml_threadpool {
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
 
+    bool         fusion;      // compute chains of elementwise nodes together, off with GGML_CPU_DISABLE_FUSION at creation
+    int          n_fused;     // number of nodes computed in fused chains by the current graph
+
     enum ggml_status ec;
 };
 
@@ -2377,6 +2381,69 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// with GGML_NUMA_STRATEGY_PARTITION, the rows [ir0, ir1) of a matrix with nr rows are placed on the given node, and
+// are multiplied by the threads that run on it
+static bool ggml_numa_is_partition(void) {
+    return g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_PARTITION && ggml_is_numa();
+}
+
+static void ggml_numa_node_rows(int64_t nr, int node, int64_t * ir0, int64_t * ir1) {
+    const int64_t n_nodes = g_state.numa.n_nodes;
+
+    *ir0 = nr*node/n_nodes;
+    *ir1 = nr*(node + 1)/n_nodes;
+}
+
+void ggml_numa_place_tensor(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    if (!ggml_numa_is_partition() || tensor->data == NULL || !ggml_is_contiguous(tensor)) {
+        return;
+    }
+
+    const int64_t nr = tensor->ne[1];
+    const int64_t nm = tensor->ne[2]*tensor->ne[3];
+
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    // don't bother with matrices that fit in a few pages per node
+    if (nr < (int64_t) g_state.numa.n_nodes || tensor->nb[2] < 4*page_size*g_state.numa.n_nodes) {
+        return;
+    }
+
+    static bool warned = false;
+
+    for (int64_t im = 0; im < nm; ++im) {
+        const uintptr_t data = (uintptr_t) tensor->data + im*tensor->nb[2];
+
+        for (int node = 0; node < (int) g_state.numa.n_nodes; ++node) {
+            int64_t ir0;
+            int64_t ir1;
+            ggml_numa_node_rows(nr, node, &ir0, &ir1);
+
+            // the pages at the boundaries go to the node that has most of their rows
+            const uintptr_t start = (data + ir0*tensor->nb[1] + page_size/2) / page_size * page_size;
+            const uintptr_t end   = (data + ir1*tensor->nb[1] + page_size/2) / page_size * page_size;
+            if (end <= start) {
+                continue;
+            }
+
+            // only the pages that are mapped are moved, fault in the pages of mmap'd files first
+            for (uintptr_t p = start; p < end; p += page_size) {
+                (void) *(volatile const char *) p;
+            }
+
+            unsigned long nodemask = 1UL << node;
+            if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &nodemask, sizeof(nodemask)*8, MPOL_MF_MOVE) != 0 && !warned) {
+                GGML_LOG_WARN("%s: mbind failed: %s\n", __func__, strerror(errno));
+                warned = true;
+            }
+        }
+    }
+#else
+    UNUSED(tensor);
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -7551,6 +7618,34 @@ UseGgmlGemm2:;
     // This is the size of the rest of the dimensions of the result
     const int64_t nr1 = ne1 * ne2 * ne3;
 
+    // with the rows of the weights placed on the NUMA nodes, each thread computes a part of the rows of its node
+    if (ggml_numa_is_partition() && nth >= (int) g_state.numa.n_nodes && nr0 > nr1 &&
+        src0->buffer && ggml_backend_buffer_get_usage(src0->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+        const int n_nodes  = g_state.numa.n_nodes;
+        const int node     = ith % n_nodes;
+        const int ith_node = ith / n_nodes;
+        const int nth_node = (nth - node + n_nodes - 1) / n_nodes;
+
+        int64_t ir0_node;
+        int64_t ir1_node;
+        ggml_numa_node_rows(nr0, node, &ir0_node, &ir1_node);
+
+        const int64_t dr0 = (ir1_node - ir0_node + nth_node - 1) / nth_node;
+
+        const int64_t ir0_start = MIN(ir0_node + dr0*ith_node, ir1_node);
+        const int64_t ir0_end   = MIN(ir0_start + dr0, ir1_node);
+
+        int64_t num_rows_per_vec_dot = vec_dot_num_rows;
+        if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || (nr1 % 2 != 0)) {
+            num_rows_per_vec_dot = 1;
+        }
+
+        if (ir0_start < ir0_end) {
+            ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+        }
+        return;
+    }
+
     // Now select a reasonable chunk size.
     int chunk_size = 16;
 
@@ -10753,6 +10848,72 @@ static void ggml_compute_forward_timestep_embedding(
 
 // ggml_compute_forward_argsort
 
+// rows are sorted in runs of this size with insertion sort before merging
+#define GGML_ARGSORT_RUN 16
+
+// returns true if element a must be placed before element b
+static inline bool ggml_argsort_before(const float * x, int32_t a, int32_t b, enum ggml_sort_order order) {
+    return order == GGML_SORT_ORDER_ASC ? x[a] < x[b] : x[a] > x[b];
+}
+
+// stable bottom-up merge sort of the indices of a row
+// tmp must hold at least n elements
+static void ggml_argsort_f32_row(const float * x, int32_t * idx, int32_t * tmp, int64_t n, enum ggml_sort_order order) {
+    for (int64_t j = 0; j < n; j++) {
+        idx[j] = j;
+    }
+
+    for (int64_t i0 = 0; i0 < n; i0 += GGML_ARGSORT_RUN) {
+        const int64_t i1 = MIN(i0 + GGML_ARGSORT_RUN, n);
+
+        for (int64_t j = i0 + 1; j < i1; j++) {
+            const int32_t v = idx[j];
+
+            int64_t k = j;
+            for (; k > i0 && ggml_argsort_before(x, v, idx[k - 1], order); k--) {
+                idx[k] = idx[k - 1];
+            }
+            idx[k] = v;
+        }
+    }
+
+    int32_t * src = idx;
+    int32_t * dst = tmp;
+
+    for (int64_t w = GGML_ARGSORT_RUN; w < n; w *= 2) {
+        for (int64_t i0 = 0; i0 < n; i0 += 2*w) {
+            const int64_t im = MIN(i0 +   w, n);
+            const int64_t i1 = MIN(i0 + 2*w, n);
+
+            // the runs are already in order
+            if (im == i1 || !ggml_argsort_before(x, src[im], src[im - 1], order)) {
+                memcpy(dst + i0, src + i0, (i1 - i0)*sizeof(int32_t));
+                continue;
+            }
+
+            int64_t a = i0;
+            int64_t b = im;
+            int64_t k = i0;
+
+            while (a < im && b < i1) {
+                dst[k++] = ggml_argsort_before(x, src[b], src[a], order) ? src[b++] : src[a++];
+            }
+            while (a < im) {
+                dst[k++] = src[a++];
+            }
+            while (b < i1) {
+                dst[k++] = src[b++];
+            }
+        }
+
+        int32_t * t = src; src = dst; dst = t;
+    }
+
+    if (src != idx) {
+        memcpy(idx, src, n*sizeof(int32_t));
+    }
+}
+
 static void ggml_compute_forward_argsort_f32(
     const struct ggml_compute_params * params,
     struct ggml_tensor * dst) {
@@ -10770,29 +10931,111 @@ static void ggml_compute_forward_argsort_f32(
 
     enum ggml_sort_order order = (enum ggml_sort_order) ggml_get_op_params_i32(dst, 0);
 
+    int32_t * tmp = (int32_t *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
+
     for (int64_t i = ith; i < nr; i += nth) {
         int32_t * dst_data = (int32_t *)((char *) dst->data + i*nb1);
         const float * src_data = (float *)((char *) src0->data + i*nb01);
 
-        for (int64_t j = 0; j < ne0; j++) {
-            dst_data[j] = j;
+        ggml_argsort_f32_row(src_data, dst_data, tmp, ne0, order);
+    }
+}
+
+static void ggml_compute_forward_argsort(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_argsort_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+// ggml_compute_forward_top_k
+
+// returns true if element a ranks below element b (ties are broken by the lower index)
+static inline bool ggml_top_k_worse(const float * x, int32_t a, int32_t b) {
+    return x[a] < x[b] || (x[a] == x[b] && a > b);
+}
+
+// min-heap with the worst selected element at the root
+static void ggml_top_k_sift_down(const float * x, int32_t * heap, int64_t n, int64_t i) {
+    const int32_t v = heap[i];
+
+    while (true) {
+        int64_t c = 2*i + 1;
+        if (c >= n) {
+            break;
+        }
+        if (c + 1 < n && ggml_top_k_worse(x, heap[c + 1], heap[c])) {
+            c++;
+        }
+        if (!ggml_top_k_worse(x, heap[c], v)) {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+
+    heap[i] = v;
+}
+
+static void ggml_compute_forward_top_k_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(int32_t));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(src0);
+    const int64_t k  = ne0;
+
+    for (int64_t i = ith; i < nr; i += nth) {
+        const int64_t i3 = i/(ne01*ne02);
+        const int64_t i2 = (i - i3*ne01*ne02)/ne01;
+        const int64_t i1 = (i - i3*ne01*ne02 - i2*ne01);
+
+        const float * x    = (const float *)((const char *) src0->data + i1*nb01 + i2*nb02 + i3*nb03);
+              int32_t * heap = (int32_t *)((char *) dst->data + i1*nb1 + i2*nb2 + i3*nb3);
+
+        for (int64_t j = 0; j < k; j++) {
+            heap[j] = j;
+        }
+        for (int64_t j = k/2 - 1; j >= 0; j--) {
+            ggml_top_k_sift_down(x, heap, k, j);
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
+        for (int64_t j = k; j < ne00; j++) {
+            if (ggml_top_k_worse(x, heap[0], j)) {
+                heap[0] = j;
+                ggml_top_k_sift_down(x, heap, k, 0);
             }
         }
+
+        // move the worst remaining element to the back until the row is in descending order
+        for (int64_t j = k - 1; j > 0; j--) {
+            const int32_t t = heap[0]; heap[0] = heap[j]; heap[j] = t;
+            ggml_top_k_sift_down(x, heap, j, 0);
+        }
     }
 }
 
-static void ggml_compute_forward_argsort(
+static void ggml_compute_forward_top_k(
     const struct ggml_compute_params * params,
     struct ggml_tensor * dst) {
 
@@ -10801,7 +11044,7 @@ static void ggml_compute_forward_argsort(
     switch (src0->type) {
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_argsort_f32(params, dst);
+                ggml_compute_forward_top_k_f32(params, dst);
             } break;
         default:
             {
@@ -10812,6 +11055,171 @@ static void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+typedef void (*ggml_vec_mad_q_t)(int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, float v);
+
+// kernels that dequantize a V row and accumulate it into VKQ in a single pass
+static ggml_vec_mad_q_t ggml_get_vec_mad_q(enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q8_0: return ggml_vec_mad_q8_0;
+        case GGML_TYPE_Q4_0: return ggml_vec_mad_q4_0;
+        default:             return NULL;
+    }
+}
+
+// minimum number of KV entries per chunk when the KV sequence is split across threads
+#define GGML_FA_KV_CHUNK_MIN 256
+
+// number of chunks along the KV dimension for each q row
+// the KV sequence is split only when there are not enough q rows to keep all threads busy (e.g. single-token decode)
+static int64_t ggml_flash_attn_ext_n_kv_chunks(int64_t nr, int64_t n_kv, int nth) {
+    if (nr >= nth) {
+        return 1;
+    }
+
+    const int64_t n_chunks = (nth + nr - 1)/nr;
+
+    return MAX(1, MIN(n_chunks, n_kv/GGML_FA_KV_CHUNK_MIN));
+}
+
+// online softmax attention of a single q row over the KV range [ic0, ic1)
+// the result in VKQ32 is not normalized - M and S are the maximum KQ value and the softmax sum of the range
+static void ggml_compute_forward_flash_attn_ext_f16_one_row(
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        int64_t iq1, int64_t iq2, int64_t iq3,
+        int64_t ic0, int64_t ic1,
+        float scale, float logit_softcap, float slope,
+        float * VKQ32, float * M_out, float * S_out) {
+
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+
+    const int64_t D = neq0;
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    enum ggml_type    const k_vec_dot_type = type_traits_cpu[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits_cpu[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits_cpu[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+    ggml_vec_mad_q_t  const v_mad_q        = ggml_get_vec_mad_q(v->type);
+
+    float S = 0.0f;      // sum
+    float M = -INFINITY; // maximum KQ value
+
+    float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
+    ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
+    ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
+
+    if (v->type == GGML_TYPE_F16) {
+        memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
+    } else {
+        memset(VKQ32, 0, D*sizeof(float));
+    }
+
+    const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+    // k indices
+    const int ik3 = iq3 / rk3;
+    const int ik2 = iq2 / rk2;
+
+    // v indices
+    const int iv3 = iq3 / rv3;
+    const int iv2 = iq2 / rv2;
+
+    const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+    q_to_vec_dot(pq, Q_q, D);
+
+    // online softmax / attention
+    // loop over n_kv and n_head_kv
+    // ref: https://arxiv.org/pdf/2112.05682.pdf
+    for (int64_t ic = ic0; ic < ic1; ++ic) {
+        const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+        if (mv == -INFINITY) {
+            continue;
+        }
+
+        float s; // KQ value
+
+        const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+        kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+
+        s = s*scale; // scale KQ value
+
+        if (logit_softcap != 0.0f) {
+            s = logit_softcap*tanhf(s);
+        }
+
+        s += mv; // apply mask
+
+        const float Mold = M;
+
+        float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+        float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+
+        const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+
+        if (v->type == GGML_TYPE_F16) {
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = expf(Mold - M);
+
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f16(D, VKQ16, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = expf(s - M);
+            }
+
+            // V += v*expf(s - M)
+            ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
+        } else {
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = expf(Mold - M);
+
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f32(D, VKQ32, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = expf(s - M);
+            }
+
+            // V += v*expf(s - M)
+            if (v_mad_q) {
+                v_mad_q(D, VKQ32, v_data, vs);
+            } else {
+                v_to_float(v_data, V32, D);
+                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+            }
+        }
+
+        S = S*ms + vs; // scale and increment sum with partial sum
+    }
+
+    if (v->type == GGML_TYPE_F16) {
+        for (int64_t d = 0; d < D; ++d) {
+            VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+        }
+    }
+
+    *M_out = M;
+    *S_out = S;
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -10856,25 +11264,9 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
-    // broadcast factors
-    const int64_t rk2 = neq2/nek2;
-    const int64_t rk3 = neq3/nek3;
-
-    const int64_t rv2 = neq2/nev2;
-    const int64_t rv3 = neq3/nev3;
-
-    // parallelize by q rows using ggml_vec_dot_f32
-
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
     float scale         = 1.0f;
     float max_bias      = 0.0f;
     float logit_softcap = 0.0f;
@@ -10895,135 +11287,126 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 
     enum ggml_type    const k_vec_dot_type = type_traits_cpu[k->type].vec_dot_type;
     ggml_from_float_t const q_to_vec_dot   = type_traits_cpu[k_vec_dot_type].from_float;
-    ggml_vec_dot_t    const kq_vec_dot     = type_traits_cpu[k->type].vec_dot;
     ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
 
     GGML_ASSERT(q_to_vec_dot && "fattn: unsupported K-type");
     GGML_ASSERT(v_to_float   && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    float * VKQ32 = (float *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    const int64_t n_chunks = ggml_flash_attn_ext_n_kv_chunks(nr, nek1, nth);
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    if (n_chunks == 1) {
+        // parallelize by q rows using ggml_vec_dot_f32
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
+        // rows per thread
+        const int dr = (nr + nth - 1)/nth;
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, D*sizeof(float));
-        }
+        // row range for this thread
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+        // loop over n_batch and n_head
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // q indices
+            const int iq3 = ir/(neq2*neq1);
+            const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+            const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+            const uint32_t h = iq2; // head index
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+            float M;
+            float S;
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
+            ggml_compute_forward_flash_attn_ext_f16_one_row(q, k, v, mask, iq1, iq2, iq3, 0, nek1,
+                    scale, logit_softcap, slope, VKQ32, &M, &S);
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+            // V /= S
+            const float S_inv = 1.0f/S;
+            ggml_vec_scale_f32(D, VKQ32, S_inv);
 
-            float s; // KQ value
+            // dst indices
+            const int i1 = iq1;
+            const int i2 = iq2;
+            const int i3 = iq3;
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
-            s = s*scale; // scale KQ value
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+        }
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+        return;
+    }
 
-            s += mv; // apply mask
+    // split the KV sequence across threads (flash-decoding)
+    // each (row, chunk) pair produces a partial result [M, S, VKQ] that is reduced after a barrier
+    const int64_t chunk_size = (nek1 + n_chunks - 1)/n_chunks;
 
-            const float Mold = M;
+    float * partials = (float *) params->wdata + nth*(3*D + CACHE_LINE_SIZE_F32);
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+    for (int64_t it = ith; it < nr*n_chunks; it += nth) {
+        const int64_t ir = it/n_chunks;
+        const int64_t ic = it - ir*n_chunks;
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+        // q indices
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+        const uint32_t h = iq2; // head index
+        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+        const int64_t ic0 = ic*chunk_size;
+        const int64_t ic1 = MIN(ic0 + chunk_size, nek1);
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+        float * part = partials + it*(D + 2);
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+        ggml_compute_forward_flash_attn_ext_f16_one_row(q, k, v, mask, iq1, iq2, iq3, ic0, ic1,
+                scale, logit_softcap, slope, VKQ32, &part[0], &part[1]);
 
-                v_to_float(v_data, V32, D);
+        memcpy(part + 2, VKQ32, D*sizeof(float));
+    }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
-            }
+    ggml_barrier(params->threadpool);
+
+    // log-sum-exp reduction of the partial results of each row
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const float * part = partials + ir*n_chunks*(D + 2);
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+        float M = -INFINITY;
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            M = MAX(M, part[ic*(D + 2)]);
         }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < D; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+        float S = 0.0f;
+        memset(VKQ32, 0, D*sizeof(float));
+
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            const float * pc = part + ic*(D + 2);
+            if (pc[0] == -INFINITY) {
+                continue;
             }
+
+            const float ms = expf(pc[0] - M);
+
+            S += pc[1]*ms;
+            ggml_vec_mad_f32(D, VKQ32, pc + 2, ms);
         }
 
         // V /= S
         const float S_inv = 1.0f/S;
         ggml_vec_scale_f32(D, VKQ32, S_inv);
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
-
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+        // q indices
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
         // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+        memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + iq1*ne1)*nb1, VKQ32, nb1);
     }
 }
 
@@ -12965,6 +13348,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_TOP_K:
+            {
+                ggml_compute_forward_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -13105,6 +13492,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_PARTITION:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -13303,6 +13691,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
+        case GGML_OP_TOP_K:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -13651,6 +14040,10 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+int ggml_threadpool_get_n_fused(struct ggml_threadpool * threadpool) {
+    return threadpool->n_fused;
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -13744,6 +14137,10 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
                     } break;
+                case GGML_OP_ARGSORT:
+                    {
+                        cur = sizeof(int32_t) * node->ne[0] * n_tasks;
+                    } break;
                 case GGML_OP_CONV_TRANSPOSE_1D:
                     {
                         GGML_ASSERT(node->src[0]->ne[3] == 1);
@@ -13788,6 +14185,13 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne00 = node->src[0]->ne[0]; // D
 
                         cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+
+                        // partial results when the KV sequence is split across threads
+                        const int64_t nr       = ggml_nrows(node->src[0]);
+                        const int64_t n_chunks = ggml_flash_attn_ext_n_kv_chunks(nr, node->src[1]->ne[1], n_tasks);
+                        if (n_chunks > 1) {
+                            cur += CACHE_LINE_SIZE*n_tasks + sizeof(float)*(ne00 + 2)*nr*n_chunks;
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -13834,6 +14238,461 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// the threads only wait for each other before a node that needs the results of the nodes computed since the last
+// barrier (or would overwrite their inputs), so that the independent small ops of a graph run back to back
+
+enum ggml_node_sync {
+    GGML_NODE_SYNC_SKIP,  // no-op, e.g. views
+    GGML_NODE_SYNC_DATA,  // only waits for its data dependencies
+    GGML_NODE_SYNC_WDATA, // also uses a per-thread part of the work buffer, can't overlap with another such node
+    GGML_NODE_SYNC_FULL,  // uses the shared state of the threadpool, needs a barrier before and after
+};
+
+static enum ggml_node_sync ggml_get_node_sync(const struct ggml_tensor * node) {
+    if (ggml_is_empty(node)) {
+        return GGML_NODE_SYNC_SKIP;
+    }
+
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return GGML_NODE_SYNC_SKIP;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            return ggml_is_quantized(node->src[0]->type) ? GGML_NODE_SYNC_WDATA : GGML_NODE_SYNC_DATA;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return ggml_is_quantized(node->type) ? GGML_NODE_SYNC_WDATA : GGML_NODE_SYNC_DATA;
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SIN:
+        case GGML_OP_COS:
+        case GGML_OP_SCALE:
+        case GGML_OP_CLAMP:
+        case GGML_OP_UNARY:
+        case GGML_OP_CONCAT:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_GET_ROWS:
+            return GGML_NODE_SYNC_DATA;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            return GGML_NODE_SYNC_WDATA;
+        default:
+            return GGML_NODE_SYNC_FULL;
+    }
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if node reads or writes the memory written by prev, or writes the memory read by prev
+static bool ggml_node_depends_on(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    if (ggml_tensors_overlap(node, prev)) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (ggml_tensors_overlap(node->src[i], prev) || ggml_tensors_overlap(node, prev->src[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the nodes computed since the last barrier
+#define GGML_MAX_SEGMENT_NODES 16
+
+struct ggml_compute_segment {
+    const struct ggml_tensor * nodes[GGML_MAX_SEGMENT_NODES];
+    int  n_nodes;
+    bool wdata;
+};
+
+static bool ggml_segment_needs_barrier(const struct ggml_compute_segment * seg, struct ggml_tensor * const * nodes, int n_nodes, enum ggml_node_sync sync) {
+    if (seg->n_nodes == 0) {
+        return false;
+    }
+    if (sync == GGML_NODE_SYNC_FULL || (sync == GGML_NODE_SYNC_WDATA && seg->wdata) || seg->n_nodes + n_nodes > GGML_MAX_SEGMENT_NODES) {
+        return true;
+    }
+    for (int j = 0; j < n_nodes; ++j) {
+        for (int i = 0; i < seg->n_nodes; ++i) {
+            if (ggml_node_depends_on(nodes[j], seg->nodes[i])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void ggml_segment_add(struct ggml_compute_segment * seg, struct ggml_tensor * const * nodes, int n_nodes, enum ggml_node_sync sync) {
+    for (int j = 0; j < n_nodes; ++j) {
+        seg->nodes[seg->n_nodes++] = nodes[j];
+    }
+    seg->wdata |= sync == GGML_NODE_SYNC_WDATA;
+}
+
+// chains of elementwise nodes that are computed in a single pass over their rows
+//
+// the last node of a chain must be found within a few nodes of the first one. the chain is computed at the position
+// of its last node, and the nodes in between must not depend on the first ones - except for rope -> cpy, that is
+// computed at the position of the rope, and the nodes in between must not depend on the cpy or the other way around.
+// the results of all the nodes of the chain are still written, since they may be used outside of the graph.
+// setting GGML_CPU_DISABLE_FUSION in the environment computes every node on its own, e.g. to compare the results; it is
+// read when the threadpool is created
+
+enum ggml_fusion_type {
+    GGML_FUSION_NONE,
+    GGML_FUSION_NORM_MUL, // [add ->] rms_norm/norm -> mul by a row of weights
+    GGML_FUSION_GLU,      // silu/gelu -> mul
+    GGML_FUSION_ROPE_CPY, // rope -> cpy, e.g. to the KV cache
+};
+
+#define GGML_MAX_FUSION_NODES     3
+#define GGML_MAX_FUSION_LOOKAHEAD 8
+
+struct ggml_fusion {
+    enum ggml_fusion_type type;
+
+    struct ggml_tensor * nodes[GGML_MAX_FUSION_NODES];
+    int n_nodes;
+    int at;   // index in the graph of the node where the chain is computed
+    int last; // index in the graph of the last node of the chain
+};
+
+static bool ggml_fusion_is_f32_rows(const struct ggml_tensor * t, const struct ggml_tensor * like) {
+    return t->type == GGML_TYPE_F32 && ggml_is_contiguous(t) && ggml_are_same_shape(t, like);
+}
+
+// checks if node can be the next one of the chain
+static bool ggml_fusion_accepts(const struct ggml_fusion * fusion, const struct ggml_tensor * node) {
+    const struct ggml_tensor * prev = fusion->nodes[fusion->n_nodes - 1];
+
+    switch (fusion->type) {
+        case GGML_FUSION_NORM_MUL:
+            if (prev->op == GGML_OP_ADD) {
+                return (node->op == GGML_OP_RMS_NORM || node->op == GGML_OP_NORM) && node->src[0] == prev &&
+                    ggml_fusion_is_f32_rows(node, prev);
+            }
+            return node->op == GGML_OP_MUL && node->src[0] == prev && ggml_fusion_is_f32_rows(node, prev) &&
+                node->src[1]->type == GGML_TYPE_F32 && ggml_is_contiguous(node->src[1]) &&
+                node->src[1]->ne[0] == prev->ne[0] && ggml_nrows(node->src[1]) == 1;
+        case GGML_FUSION_GLU:
+            {
+                if (node->op != GGML_OP_MUL || (node->src[0] != prev && node->src[1] != prev) || !ggml_fusion_is_f32_rows(node, prev)) {
+                    return false;
+                }
+                const struct ggml_tensor * other = node->src[0] == prev ? node->src[1] : node->src[0];
+                return ggml_fusion_is_f32_rows(other, prev);
+            }
+        case GGML_FUSION_ROPE_CPY:
+            return node->op == GGML_OP_CPY && node->src[0] == prev && ggml_is_contiguous(node) &&
+                ggml_nelements(node) == ggml_nelements(prev) && prev->ne[0] % ggml_blck_size(node->type) == 0 &&
+                (node->type == GGML_TYPE_F32 || type_traits_cpu[node->type].from_float != NULL);
+        default:
+            return false;
+    }
+}
+
+// each thread computes the whole chain for its own rows without waiting for the others, so the rows written by a
+// node must not be read or written as other rows by the chain. the allocator can place the result of a node in the
+// memory of a tensor that is no longer used, at any offset
+static bool ggml_fusion_rows_are_private(const struct ggml_fusion * fusion) {
+    for (int k = 0; k < fusion->n_nodes; ++k) {
+        const struct ggml_tensor * dst = fusion->nodes[k];
+
+        for (int m = 0; m < fusion->n_nodes; ++m) {
+            const struct ggml_tensor * node = fusion->nodes[m];
+
+            for (int i = -1; i < GGML_MAX_SRC; ++i) {
+                const struct ggml_tensor * t = i < 0 ? node : node->src[i];
+                if (t == NULL || t == dst) {
+                    continue;
+                }
+                if (ggml_tensors_overlap(dst, t) && (dst->data != t->data || dst->nb[1] != t->nb[1])) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// returns true if the node i is the first node of a chain
+static bool ggml_graph_get_fusion(const struct ggml_cgraph * cgraph, int i, struct ggml_fusion * fusion) {
+    struct ggml_tensor * node = cgraph->nodes[i];
+
+    fusion->type = GGML_FUSION_NONE;
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+            if (ggml_fusion_is_f32_rows(node, node) && ggml_fusion_is_f32_rows(node->src[0], node) &&
+                ggml_fusion_is_f32_rows(node->src[1], node)) {
+                fusion->type = GGML_FUSION_NORM_MUL;
+            }
+            break;
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_NORM:
+            if (ggml_fusion_is_f32_rows(node, node) && ggml_fusion_is_f32_rows(node->src[0], node)) {
+                fusion->type = GGML_FUSION_NORM_MUL;
+            }
+            break;
+        case GGML_OP_UNARY:
+            if ((ggml_get_unary_op(node) == GGML_UNARY_OP_SILU || ggml_get_unary_op(node) == GGML_UNARY_OP_GELU) &&
+                ggml_fusion_is_f32_rows(node, node) && ggml_fusion_is_f32_rows(node->src[0], node)) {
+                fusion->type = GGML_FUSION_GLU;
+            }
+            break;
+        case GGML_OP_ROPE:
+            if (ggml_fusion_is_f32_rows(node, node)) {
+                fusion->type = GGML_FUSION_ROPE_CPY;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (fusion->type == GGML_FUSION_NONE) {
+        return false;
+    }
+
+    const bool pull = fusion->type == GGML_FUSION_ROPE_CPY;
+
+    fusion->nodes[0] = node;
+    fusion->n_nodes  = 1;
+    fusion->last     = -1;
+
+    int n_ahead = 0;
+    for (int j = i + 1; j < cgraph->n_nodes && n_ahead < GGML_MAX_FUSION_LOOKAHEAD; ++j) {
+        struct ggml_tensor * next = cgraph->nodes[j];
+        if (ggml_get_node_sync(next) == GGML_NODE_SYNC_SKIP) {
+            continue;
+        }
+
+        if (ggml_fusion_accepts(fusion, next)) {
+            fusion->nodes[fusion->n_nodes++] = next;
+
+            // an add or a norm alone is not a chain
+            if (fusion->type != GGML_FUSION_NORM_MUL || next->op == GGML_OP_MUL) {
+                fusion->at   = pull ? i : j;
+                fusion->last = j;
+                break;
+            }
+            if (fusion->n_nodes == GGML_MAX_FUSION_NODES) {
+                break;
+            }
+            continue;
+        }
+
+        // with the chain computed at its last node, this node is now computed before the first ones
+        for (int k = 0; k < fusion->n_nodes && !pull; ++k) {
+            if (ggml_node_depends_on(next, fusion->nodes[k])) {
+                fusion->type = GGML_FUSION_NONE;
+                return false;
+            }
+        }
+        n_ahead++;
+    }
+
+    if (fusion->type == GGML_FUSION_NONE || fusion->n_nodes < 2 || fusion->last <= i) {
+        fusion->type = GGML_FUSION_NONE;
+        return false;
+    }
+
+    // with the chain computed at its first node, the nodes in between are now computed after the last one
+    if (pull) {
+        const struct ggml_tensor * tail = fusion->nodes[fusion->n_nodes - 1];
+        for (int j = i + 1; j < fusion->last; ++j) {
+            const struct ggml_tensor * next = cgraph->nodes[j];
+            if (ggml_get_node_sync(next) != GGML_NODE_SYNC_SKIP &&
+                (ggml_node_depends_on(next, tail) || ggml_node_depends_on(tail, next))) {
+                fusion->type = GGML_FUSION_NONE;
+                return false;
+            }
+        }
+    }
+
+    if (!ggml_fusion_rows_are_private(fusion)) {
+        fusion->type = GGML_FUSION_NONE;
+        return false;
+    }
+
+    return true;
+}
+
+static bool ggml_fusion_contains(const struct ggml_fusion * fusion, const struct ggml_tensor * node) {
+    for (int k = 0; k < fusion->n_nodes; ++k) {
+        if (fusion->nodes[k] == node) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ggml_compute_forward_fused_norm_mul(const struct ggml_compute_params * params, const struct ggml_fusion * fusion) {
+    const struct ggml_tensor * add  = fusion->n_nodes == 3 ? fusion->nodes[0] : NULL;
+    const struct ggml_tensor * norm = fusion->nodes[fusion->n_nodes - 2];
+    const struct ggml_tensor * mul  = fusion->nodes[fusion->n_nodes - 1];
+
+    const float * w = (const float *) mul->src[1]->data;
+
+    const int64_t ne0 = norm->ne[0];
+    const int64_t nr  = ggml_nrows(norm);
+
+    const int64_t dr  = (nr + params->nth - 1)/params->nth;
+    const int64_t ir0 = dr*params->ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        float * x = (float *) ((char *) norm->src[0]->data + ir*norm->src[0]->nb[1]);
+        float * y = (float *) ((char *) norm->data + ir*norm->nb[1]);
+        float * z = (float *) ((char *) mul->data  + ir*mul->nb[1]);
+
+        if (add) {
+            ggml_vec_add_f32(ne0, x,
+                    (const float *) ((const char *) add->src[0]->data + ir*add->src[0]->nb[1]),
+                    (const float *) ((const char *) add->src[1]->data + ir*add->src[1]->nb[1]));
+        }
+
+        if (norm->op == GGML_OP_RMS_NORM) {
+            ggml_float sum = 0.0;
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                sum += (ggml_float)(x[i0] * x[i0]);
+            }
+
+            const float mean = sum/ne0;
+
+            memcpy(y, x, ne0 * sizeof(float));
+            ggml_vec_scale_f32(ne0, y, 1.0f/sqrtf(mean + eps));
+        } else {
+            ggml_float sum = 0.0;
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                sum += (ggml_float)x[i0];
+            }
+
+            const float mean = sum/ne0;
+
+            ggml_float sum2 = 0.0;
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                float v = x[i0] - mean;
+                y[i0] = v;
+                sum2 += (ggml_float)(v*v);
+            }
+
+            const float variance = sum2/ne0;
+            ggml_vec_scale_f32(ne0, y, 1.0f/sqrtf(variance + eps));
+        }
+
+        ggml_vec_mul_f32(ne0, z, y, w);
+    }
+}
+
+static void ggml_compute_forward_fused_glu(const struct ggml_compute_params * params, const struct ggml_fusion * fusion) {
+    const struct ggml_tensor * act = fusion->nodes[0];
+    const struct ggml_tensor * mul = fusion->nodes[1];
+
+    const struct ggml_tensor * other = mul->src[0] == act ? mul->src[1] : mul->src[0];
+
+    const int64_t ne0 = act->ne[0];
+    const int64_t nr  = ggml_nrows(act);
+
+    const int64_t dr  = (nr + params->nth - 1)/params->nth;
+    const int64_t ir0 = dr*params->ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    const bool silu = ggml_get_unary_op(act) == GGML_UNARY_OP_SILU;
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *) ((const char *) act->src[0]->data + ir*act->src[0]->nb[1]);
+        float       * y = (float *) ((char *) act->data + ir*act->nb[1]);
+
+        if (silu) {
+            ggml_vec_silu_f32(ne0, y, x);
+        } else {
+            ggml_vec_gelu_f32(ne0, y, x);
+        }
+
+        ggml_vec_mul_f32(ne0, (float *) ((char *) mul->data + ir*mul->nb[1]), y,
+                (const float *) ((const char *) other->data + ir*other->nb[1]));
+    }
+}
+
+static void ggml_compute_forward_fused_rope_cpy(const struct ggml_compute_params * params, const struct ggml_fusion * fusion) {
+    struct ggml_tensor * rope = fusion->nodes[0];
+    struct ggml_tensor * cpy  = fusion->nodes[1];
+
+    ggml_compute_forward_rope(params, rope);
+
+    // the same rows as ggml_compute_forward_rope_f32, while they are still in the cache
+    const int64_t ne0 = rope->ne[0];
+    const int64_t nr  = ggml_nrows(rope);
+
+    const int64_t dr  = (nr + params->nth - 1)/params->nth;
+    const int64_t ir0 = dr*params->ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    const size_t row_size = ggml_row_size(cpy->type, ne0);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *) ((const char *) rope->data + ir*rope->nb[1]);
+        void        * y = (char *) cpy->data + ir*row_size;
+
+        if (cpy->type == GGML_TYPE_F32) {
+            memcpy(y, x, row_size);
+        } else {
+            type_traits_cpu[cpy->type].from_float(x, y, ne0);
+        }
+    }
+}
+
+static void ggml_compute_forward_fused(const struct ggml_compute_params * params, const struct ggml_fusion * fusion) {
+    switch (fusion->type) {
+        case GGML_FUSION_NORM_MUL: ggml_compute_forward_fused_norm_mul(params, fusion); break;
+        case GGML_FUSION_GLU:      ggml_compute_forward_fused_glu(params, fusion);      break;
+        case GGML_FUSION_ROPE_CPY: ggml_compute_forward_fused_rope_cpy(params, fusion); break;
+        default:
+            GGML_ABORT("fatal error");
+    }
+}
+
+// returns true if the graph is aborted - every thread calls this at the same nodes, so they agree on when to stop
+static bool ggml_graph_compute_sync(struct ggml_compute_state * state, struct ggml_compute_segment * seg) {
+    struct ggml_threadpool   * tp    = state->threadpool;
+    const struct ggml_cplan  * cplan = tp->cplan;
+
+    if (state->ith == 0 && cplan->abort_callback &&
+            cplan->abort_callback(cplan->abort_callback_data)) {
+        tp->abort = true;
+        tp->ec    = GGML_STATUS_ABORTED;
+    }
+
+    ggml_barrier(tp);
+
+    seg->n_nodes = 0;
+    seg->wdata   = false;
+
+    return tp->abort;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -13851,18 +14710,62 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
+    struct ggml_compute_segment seg = { /*.nodes =*/ { NULL }, /*.n_nodes =*/ 0, /*.wdata =*/ false };
+
+    // the chain of nodes that is being computed together
+    struct ggml_fusion fusion = { /*.type =*/ GGML_FUSION_NONE, /*.nodes =*/ { NULL }, /*.n_nodes =*/ 0, /*.at =*/ -1, /*.last =*/ -1 };
+
+    bool aborted = false;
+
+    for (int node_n = 0; node_n < cgraph->n_nodes && !aborted; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
+        enum ggml_node_sync sync = ggml_get_node_sync(node);
+        if (sync == GGML_NODE_SYNC_SKIP) {
+            continue;
+        }
+
+        if (fusion.type == GGML_FUSION_NONE && tp->fusion) {
+            ggml_graph_get_fusion(cgraph, node_n, &fusion);
+        }
+
+        if (fusion.type != GGML_FUSION_NONE && ggml_fusion_contains(&fusion, node)) {
+            if (node_n == fusion.at) {
+                sync = fusion.type == GGML_FUSION_ROPE_CPY ? GGML_NODE_SYNC_WDATA : GGML_NODE_SYNC_DATA;
+
+                if (ggml_segment_needs_barrier(&seg, fusion.nodes, fusion.n_nodes, sync) && ggml_graph_compute_sync(state, &seg)) {
+                    break;
+                }
+
+                ggml_compute_forward_fused(&params, &fusion);
+
+                if (state->ith == 0) {
+                    tp->n_fused += fusion.n_nodes;
+                }
+
+                ggml_segment_add(&seg, fusion.nodes, fusion.n_nodes, sync);
+            }
+            if (node_n == fusion.last) {
+                fusion.type = GGML_FUSION_NONE;
+            }
+            continue;
+        }
+
+        if (ggml_segment_needs_barrier(&seg, &node, 1, sync) && ggml_graph_compute_sync(state, &seg)) {
+            break;
+        }
+
         ggml_compute_forward(&params, node);
 
-        if (state->ith == 0 && cplan->abort_callback &&
-                cplan->abort_callback(cplan->abort_callback_data)) {
-            tp->abort = true;
-            tp->ec    = GGML_STATUS_ABORTED;
+        if (sync == GGML_NODE_SYNC_FULL) {
+            aborted = ggml_graph_compute_sync(state, &seg);
+        } else {
+            ggml_segment_add(&seg, &node, 1, sync);
         }
+    }
 
-        ggml_barrier(state->threadpool);
+    if (seg.n_nodes > 0) {
+        ggml_graph_compute_sync(state, &seg);
     }
 
     return 0;
@@ -14038,6 +14941,8 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->fusion           = getenv("GGML_CPU_DISABLE_FUSION") == NULL;
+        threadpool->n_fused          = 0;
     }
 
     // Allocate and init workers state
@@ -14112,6 +15017,7 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->current_chunk    = 0;
         threadpool->abort            = false;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->n_fused          = 0;
     }
 
 #ifdef GGML_USE_OPENMP
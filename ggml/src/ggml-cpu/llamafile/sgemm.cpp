@@ -1041,6 +1041,303 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// K-QUANT MATRIX MULTIPLICATION
+
+#if defined(__AVX2__)
+// A is one of the K-quant super block formats, B is block_q8_K. each super block of A is unpacked
+// once per tile into unsigned 8-bit quants and 16-bit scales, the products are accumulated as
+// integers over the super block and the min/offset term is applied with the bsums of B
+template <typename TA>
+class tinyBLAS_K_AVX {
+  public:
+    tinyBLAS_K_AVX(int64_t k,
+                   const TA *A, int64_t lda,
+                   const block_q8_K *B, int64_t ldb,
+                   float *C, int64_t ldc,
+                   int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n) {
+        mnpack(0, m, 0, n);
+    }
+
+  private:
+    // one super block of A: quants in [0, 64) for each chunk of 32 values, the chunk scales as
+    // int16 pairs, and the mins for each group of 16 values as int16
+    struct unpacked {
+        __m256i q[QK_K/32];
+        __m256i scales[QK_K/32];
+        __m256i mins;
+        float d;
+        float dmin;
+    };
+
+    // the integer accumulators live as long as the float ones, so the tiles are smaller than in
+    // tinyBLAS_Q0_AVX
+    void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t mc, nc, mp, np;
+        switch ((MIN(m - m0, 4) << 4) | MIN(n - n0, 4)) {
+#if VECTOR_REGISTERS == 32
+        case 0x44:
+        case 0x43:
+            mc = 4;
+            nc = 3;
+            gemm<4, 3>(m0, m, n0, n);
+            break;
+        case 0x34:
+            mc = 3;
+            nc = 4;
+            gemm<3, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+            mc = 3;
+            nc = 3;
+            gemm<3, 3>(m0, m, n0, n);
+            break;
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+#else
+        case 0x44:
+        case 0x43:
+        case 0x42:
+        case 0x34:
+        case 0x33:
+#endif
+        case 0x32:
+            mc = 3;
+            nc = 2;
+            gemm<3, 2>(m0, m, n0, n);
+            break;
+#if VECTOR_REGISTERS != 32
+        case 0x24:
+#endif
+        case 0x23:
+            mc = 2;
+            nc = 3;
+            gemm<2, 3>(m0, m, n0, n);
+            break;
+        case 0x41:
+            mc = 4;
+            nc = 1;
+            gemm<4, 1>(m0, m, n0, n);
+            break;
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x14:
+            mc = 1;
+            nc = 4;
+            gemm<1, 4>(m0, m, n0, n);
+            break;
+        case 0x31:
+            mc = 3;
+            nc = 1;
+            gemm<3, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+            mc = 1;
+            nc = 3;
+            gemm<1, 3>(m0, m, n0, n);
+            break;
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+        mp = m0 + (m - m0) / mc * mc;
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    // each job is a row tile and up to NB column tiles. the super blocks of the rows are unpacked
+    // KB at a time and reused for all the column tiles, the partial sums are accumulated in C
+    template <int RM, int RN>
+    NOINLINE void gemm(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        constexpr int64_t KB = 8;
+        constexpr int64_t NB = 16;
+        int64_t ytiles = (m - m0) / RM;
+        int64_t xtiles = (n - n0) / RN;
+        int64_t xblocks = (xtiles + NB - 1) / NB;
+        int64_t tiles = xblocks * ytiles;
+        int64_t duty = (tiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        unpacked a[KB][RM];
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = m0 + job / xblocks * RM;
+            int64_t jt0 = job % xblocks * NB;
+            int64_t jt1 = MIN(jt0 + NB, xtiles);
+            for (int64_t l0 = 0; l0 < k; l0 += KB) {
+                int64_t kb = MIN(KB, k - l0);
+                for (int64_t l = 0; l < kb; ++l)
+                    for (int64_t i = 0; i < RM; ++i)
+                        unpack(A + lda * (ii + i) + l0 + l, a[l][i]);
+                for (int64_t jt = jt0; jt < jt1; ++jt) {
+                    int64_t jj = n0 + jt * RN;
+                    __m256 Cv[RN][RM] = {};
+                    for (int64_t l = 0; l < kb; ++l) {
+                        __m256i sumi[RN][RM] = {};
+                        for (int c = 0; c < QK_K/32; ++c)
+                            for (int64_t j = 0; j < RN; ++j) {
+                                const __m256i b = _mm256_loadu_si256((const __m256i *)(B[ldb * (jj + j) + l0 + l].qs + 32*c));
+                                for (int64_t i = 0; i < RM; ++i)
+                                    sumi[j][i] = dot(sumi[j][i], a[l][i].q[c], b, a[l][i].scales[c]);
+                            }
+                        for (int64_t j = 0; j < RN; ++j) {
+                            const block_q8_K *b = B + ldb * (jj + j) + l0 + l;
+                            const __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+                            for (int64_t i = 0; i < RM; ++i) {
+                                Cv[j][i] = madd(_mm256_set1_ps(a[l][i].d * b->d),
+                                                _mm256_cvtepi32_ps(sumi[j][i]), Cv[j][i]);
+                                Cv[j][i] = madd(_mm256_set1_ps(-a[l][i].dmin * b->d),
+                                                _mm256_cvtepi32_ps(_mm256_madd_epi16(a[l][i].mins, bsums)), Cv[j][i]);
+                            }
+                        }
+                    }
+                    for (int64_t j = 0; j < RN; ++j)
+                        for (int64_t i = 0; i < RM; ++i) {
+                            float &c = C[ldc * (jj + j) + (ii + i)];
+                            c = l0 == 0 ? hsum(Cv[j][i]) : c + hsum(Cv[j][i]);
+                        }
+                }
+            }
+        }
+    }
+
+    // acc += scales * (q * y), q unsigned and y signed 8-bit, scales and the pairwise products 16-bit
+    static inline __m256i dot(__m256i acc, __m256i q, __m256i y, __m256i scales) {
+        const __m256i p = _mm256_maddubs_epi16(q, y);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        return _mm256_dpwssd_epi32(acc, p, scales);
+#elif defined(__AVXVNNI__)
+        return _mm256_dpwssd_avx_epi32(acc, p, scales);
+#else
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(p, scales));
+#endif
+    }
+
+    // the 6-bit scales and mins of q4_K and q5_K, as 8 scales followed by 8 mins
+    static inline __m128i scales_mins(const uint8_t *scales) {
+        const uint32_t kmask1 = 0x3f3f3f3f;
+        const uint32_t kmask2 = 0x0f0f0f0f;
+        const uint32_t kmask3 = 0x03030303;
+
+        uint32_t utmp[4];
+        memcpy(utmp, scales, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+
+        return _mm_loadu_si128((const __m128i *)utmp);
+    }
+
+    static inline void unpack_scales_mins(const uint8_t *scales, unpacked &u) {
+        const __m128i sm = scales_mins(scales);
+        alignas(16) uint8_t sc[16];
+        _mm_store_si128((__m128i *)sc, sm);
+        for (int c = 0; c < QK_K/32; ++c)
+            u.scales[c] = _mm256_set1_epi16(sc[c]);
+        // one min per 32 values, repeated for each of the two bsums of 16 values
+        const __m128i m = _mm_unpackhi_epi64(sm, sm);
+        u.mins = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(m, m));
+    }
+
+    static inline void unpack(const block_q4_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q4bits = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            u.q[2*j + 0] = _mm256_and_si256(q4bits, m4);
+            u.q[2*j + 1] = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
+        }
+        unpack_scales_mins(x->scales, u);
+        u.d = unhalf(x->d);
+        u.dmin = unhalf(x->dmin);
+    }
+
+    static inline void unpack(const block_q5_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        const __m256i mone = _mm256_set1_epi8(0x10);
+        // bit c of qh is the high bit of chunk c
+        __m256i hbits = _mm256_loadu_si256((const __m256i *)x->qh);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q5bits = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            const __m256i h0 = _mm256_and_si256(_mm256_slli_epi16(hbits, 4), mone);
+            const __m256i h1 = _mm256_and_si256(_mm256_slli_epi16(hbits, 3), mone);
+            hbits = _mm256_srli_epi16(hbits, 2);
+            u.q[2*j + 0] = _mm256_or_si256(_mm256_and_si256(q5bits, m4), h0);
+            u.q[2*j + 1] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q5bits, 4), m4), h1);
+        }
+        unpack_scales_mins(x->scales, u);
+        u.d = unhalf(x->d);
+        u.dmin = unhalf(x->dmin);
+    }
+
+    static inline void unpack(const block_q6_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        const __m256i m2 = _mm256_set1_epi8(0x30);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q4bits1 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j));
+            const __m256i q4bits2 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j + 32));
+            const __m256i q4bitsH = _mm256_loadu_si256((const __m256i *)(x->qh + 32*j));
+            u.q[4*j + 0] = _mm256_or_si256(_mm256_and_si256(q4bits1, m4),
+                                           _mm256_and_si256(_mm256_slli_epi16(q4bitsH, 4), m2));
+            u.q[4*j + 1] = _mm256_or_si256(_mm256_and_si256(q4bits2, m4),
+                                           _mm256_and_si256(_mm256_slli_epi16(q4bitsH, 2), m2));
+            u.q[4*j + 2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits1, 4), m4),
+                                           _mm256_and_si256(q4bitsH, m2));
+            u.q[4*j + 3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits2, 4), m4),
+                                           _mm256_and_si256(_mm256_srli_epi16(q4bitsH, 2), m2));
+        }
+        // one scale per 16 values, the quants are offset by 32
+        for (int c = 0; c < QK_K/32; ++c)
+            u.scales[c] = MM256_SET_M128I(_mm_set1_epi16(x->scales[2*c + 1]), _mm_set1_epi16(x->scales[2*c]));
+        u.mins = _mm256_slli_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)x->scales)), 5);
+        u.d = unhalf(x->d);
+        u.dmin = u.d;
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__
+
 //PPC Implementation
 #if defined(__MMA__)
 
@@ -2577,6 +2874,61 @@ bool llamafile_sgemm(const struct ggml_compute_params * params, int64_t m, int64
 #endif
     }
 
+    case GGML_TYPE_Q4_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        // unpacking the super blocks only pays off over enough columns
+        if (n < 8)
+            return false;
+        tinyBLAS_K_AVX<block_q4_K> tb{
+            k, (const block_q4_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            params->ith, params->nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q5_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 8)
+            return false;
+        tinyBLAS_K_AVX<block_q5_K> tb{
+            k, (const block_q5_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            params->ith, params->nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q6_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 8)
+            return false;
+        tinyBLAS_K_AVX<block_q6_K> tb{
+            k, (const block_q6_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            params->ith, params->nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
@@ -2,7 +2,12 @@
 #include "ggml-impl.h"
 #include "ggml-backend-impl.h"
 
+#include <algorithm>
+#include <array>
 #include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <tuple>
 #include <string>
 #include <vector>
 #include <memory>
@@ -24,6 +29,9 @@
 #  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
 #endif
 #include <cstring>
 
@@ -37,6 +45,17 @@ typedef int sockfd_t;
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client side only:
+    // commands without a response are batched in send_buf and written together with the next command that needs
+    // a response; the graph_compute commands are sent without waiting for the server, and their responses are
+    // received by the next command that needs a response or by synchronize
+    std::mutex mutex;
+    std::vector<uint8_t> send_buf;
+    uint32_t n_pending = 0;
+    enum ggml_status status = GGML_STATUS_SUCCESS; // first failure among the received graph_compute responses, not yet reported
+    uint8_t proto_minor = 0; // minor protocol version of the server
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -86,9 +105,23 @@ enum rpc_cmd {
     RPC_CMD_GET_DEVICE_MEMORY,
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
+    RPC_CMD_HELLO,
+    RPC_CMD_SET_TENSOR_HASH, // since 1.2.0
     RPC_CMD_COUNT,
 };
 
+// commands without a response are buffered on the client up to this size before they are sent
+static const size_t RPC_SEND_BUF_SIZE = 1024*1024;
+
+// weights of at least this size are looked up in the cache of the server by their hash before they are sent
+static const size_t RPC_CACHE_MIN_SIZE = 1024*1024;
+
+struct rpc_msg_hello_rsp {
+    uint8_t major;
+    uint8_t minor;
+    uint8_t patch;
+};
+
 struct rpc_msg_get_alloc_size_req {
     rpc_tensor tensor;
 };
@@ -141,6 +174,17 @@ struct rpc_msg_get_tensor_req {
     uint64_t size;
 };
 
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t  hash[32];
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
 struct rpc_msg_copy_tensor_req {
     rpc_tensor src;
     rpc_tensor dst;
@@ -177,6 +221,9 @@ struct ggml_backend_rpc_buffer_type_context {
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
+
+    // scratch buffers for the row-split matrix multiplications, one per server of the split
+    std::vector<ggml_backend_buffer_t> split_scratch = {};
 };
 
 struct ggml_backend_rpc_buffer_context {
@@ -345,17 +392,160 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
+// SHA-256 of the weights, the key of the cache of the server
+// the cache is shared by all the clients, so the key must be collision resistant: with a weaker hash a client could
+// send data that collides with the hash of the weights of another model and replace them in the cache
+typedef std::array<uint8_t, 32> rpc_hash;
+
+static rpc_hash rpc_data_hash(const uint8_t * data, size_t size) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    auto block = [&](const uint8_t * p) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i + 1] << 16 | (uint32_t)p[4*i + 2] << 8 | (uint32_t)p[4*i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        block(data + i);
+    }
+
+    // padding: 0x80, zeros and the length in bits, big-endian
+    uint8_t tail[128] = {};
+    const size_t n_tail = size - i;
+    memcpy(tail, data + i, n_tail);
+    tail[n_tail] = 0x80;
+    const size_t n_pad = n_tail + 9 <= 64 ? 64 : 128;
+    const uint64_t n_bits = (uint64_t)size*8;
+    for (int j = 0; j < 8; ++j) {
+        tail[n_pad - 1 - j] = (uint8_t)(n_bits >> (8*j));
+    }
+    block(tail);
+    if (n_pad == 128) {
+        block(tail + 64);
+    }
+
+    rpc_hash result;
+    for (int j = 0; j < 8; ++j) {
+        result[4*j + 0] = (uint8_t)(h[j] >> 24);
+        result[4*j + 1] = (uint8_t)(h[j] >> 16);
+        result[4*j + 2] = (uint8_t)(h[j] >> 8);
+        result[4*j + 3] = (uint8_t)(h[j]);
+    }
+    return result;
+}
+
+static bool rpc_flush(socket_t & sock) {
+    if (sock.send_buf.empty()) {
+        return true;
+    }
+    bool status = send_data(sock.fd, sock.send_buf.data(), sock.send_buf.size());
+    sock.send_buf.clear();
+    return status;
+}
+
+static bool rpc_write(socket_t & sock, const void * data, size_t size) {
+    if (sock.send_buf.size() + size > RPC_SEND_BUF_SIZE) {
+        if (!rpc_flush(sock)) {
+            return false;
+        }
+        if (size > RPC_SEND_BUF_SIZE) {
+            return send_data(sock.fd, data, size);
+        }
+    }
+    const uint8_t * ptr = (const uint8_t *)data;
+    sock.send_buf.insert(sock.send_buf.end(), ptr, ptr + size);
+    return true;
+}
+
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+static bool rpc_write_cmd(socket_t & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
     uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
+    uint64_t size = input_size;
+    return rpc_write(sock, &cmd_byte, sizeof(cmd_byte)) &&
+           rpc_write(sock, &size, sizeof(size)) &&
+           rpc_write(sock, input, input_size);
+}
+
+// receive the responses of the graph_compute commands that are still in flight
+static bool rpc_wait_pending(socket_t & sock) {
+    for (; sock.n_pending > 0; sock.n_pending--) {
+        rpc_msg_graph_compute_rsp response;
+        if (!recv_msg(sock.fd, &response, sizeof(response))) {
+            return false;
+        }
+        // a failed graph does not break the protocol, its status is kept until it is reported by a graph_compute
+        if (response.result != GGML_STATUS_SUCCESS) {
+            GGML_LOG_ERROR("[%s] remote graph compute failed with status %d\n", __func__, response.result);
+            if (sock.status == GGML_STATUS_SUCCESS) {
+                sock.status = (enum ggml_status)response.result;
+            }
+        }
+    }
+    return true;
+}
+
+// return and clear the first failure among the graph_compute responses received so far, without waiting for the
+// commands that are still in flight
+static enum ggml_status rpc_take_status(const std::shared_ptr<socket_t> & sock) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    enum ggml_status result = sock->status;
+    sock->status = GGML_STATUS_SUCCESS;
+    return result;
+}
+
+// send a command without a response, it is batched with the following commands
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    return rpc_write_cmd(*sock, cmd, input, input_size);
+}
+
+// send a command and return without waiting for its response
+static bool send_rpc_cmd_async(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    if (!rpc_write_cmd(*sock, cmd, input, input_size) || !rpc_flush(*sock)) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    sock->n_pending++;
+    return true;
+}
+
+// send a command and wait for its response
+// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    if (!rpc_write_cmd(*sock, cmd, input, input_size) || !rpc_flush(*sock)) {
         return false;
     }
-    if (!send_data(sock->fd, input, input_size)) {
+    if (!rpc_wait_pending(*sock)) {
         return false;
     }
     // TODO: currently the output_size is always known, do we need support for commands with variable output size?
@@ -375,6 +565,24 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
 
 // RPC client-side implementation
 
+static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
+    rpc_msg_hello_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
+    if (!status) {
+        fprintf(stderr, "RPC server did not respond to HELLO, it may be running an older version\n");
+        return false;
+    }
+    if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
+        fprintf(stderr, "RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
+        return false;
+    }
+    if (response.minor != RPC_PROTO_MINOR_VERSION || response.patch != RPC_PROTO_PATCH_VERSION) {
+        fprintf(stderr, "WARNING: RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
+    }
+    sock->proto_minor = response.minor;
+    return true;
+}
+
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
@@ -408,6 +616,9 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
+    if (!check_server_version(sock)) {
+        return nullptr;
+    }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -416,7 +627,7 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
 static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request));
     GGML_ASSERT(status);
     delete ctx;
 }
@@ -438,11 +649,13 @@ static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
     rpc_tensor result;
     result.id = reinterpret_cast<uint64_t>(tensor);
     result.type = tensor->type;
-    if (tensor->buffer) {
+    if (tensor->buffer && tensor->buffer->iface.free_buffer == ggml_backend_rpc_buffer_free_buffer) {
         ggml_backend_buffer_t buffer = tensor->buffer;
         ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
         result.buffer = ctx->remote_ptr;
     } else {
+        // the split buffers do not exist on the servers, the slices of their tensors are sent instead
+        // the server ignores tensors without a buffer unless they are computed, which the split ones never are
         result.buffer = 0;
     }
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
@@ -475,13 +688,28 @@ static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t buffer, gg
 
         request.tensor = serialize_tensor(tensor);
 
-        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_INIT_TENSOR, &request, sizeof(request), nullptr, 0);
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_INIT_TENSOR, &request, sizeof(request));
         GGML_ASSERT(status);
     }
 }
 
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    if (size >= RPC_CACHE_MIN_SIZE && ggml_backend_buffer_get_usage(buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS && ctx->sock->proto_minor >= 2) {
+        // skip the transfer if the server already has the data in its cache
+        rpc_msg_set_tensor_hash_req request;
+        request.tensor = serialize_tensor(tensor);
+        request.offset = offset;
+        request.size   = size;
+        const rpc_hash hash = rpc_data_hash((const uint8_t *)data, size);
+        memcpy(request.hash, hash.data(), sizeof(request.hash));
+        rpc_msg_set_tensor_hash_rsp response;
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_HASH, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.result) {
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
@@ -489,7 +717,7 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size());
     GGML_ASSERT(status);
 }
 
@@ -525,7 +753,7 @@ static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, con
 static void ggml_backend_rpc_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_buffer_clear_req request = {ctx->remote_ptr, value};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request), nullptr, 0);
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request));
     GGML_ASSERT(status);
 }
 
@@ -617,6 +845,203 @@ static ggml_backend_buffer_type_i ggml_backend_rpc_buffer_type_interface = {
     /* .is_host          = */ NULL,
 };
 
+// RPC split buffer type
+//
+// the rows of the matrices are distributed among the RPC servers, each server holds its slice in a regular RPC
+// buffer. the matrix multiplications with split weights are computed on all the servers in parallel and the
+// client gathers the results on the server of the backend that computes the graph
+
+struct ggml_backend_rpc_split_buffer_type_context {
+    int main_device;
+    std::vector<std::string> endpoints;
+    std::array<float, GGML_RPC_MAX_SERVERS> tensor_split; // first row of each server, as a fraction of the rows
+    std::string name;
+};
+
+// the slice of each server, slices without rows have no buffer
+struct ggml_tensor_extra_rpc_split {
+    ggml_tensor slices[GGML_RPC_MAX_SERVERS];
+};
+
+struct ggml_backend_rpc_split_buffer_context {
+    ~ggml_backend_rpc_split_buffer_context() {
+        for (ggml_tensor_extra_rpc_split * extra : tensor_extras) {
+            for (auto & slice : extra->slices) {
+                if (slice.buffer != nullptr) {
+                    ggml_backend_buffer_free(slice.buffer);
+                }
+            }
+            delete extra;
+        }
+    }
+
+    std::vector<ggml_tensor_extra_rpc_split *> tensor_extras;
+};
+
+static void get_row_split(int64_t * row_low, int64_t * row_high, const ggml_tensor * tensor, const ggml_backend_rpc_split_buffer_type_context * ctx, int id) {
+    const int64_t nrows = ggml_nrows(tensor);
+    const int n_servers = ctx->endpoints.size();
+
+    *row_low  = id == 0 ? 0 : (int64_t)(nrows*ctx->tensor_split[id]);
+    *row_high = id == n_servers - 1 ? nrows : (int64_t)(nrows*ctx->tensor_split[id + 1]);
+}
+
+static void ggml_backend_rpc_split_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    ggml_backend_rpc_split_buffer_context * ctx = (ggml_backend_rpc_split_buffer_context *)buffer->context;
+    delete ctx;
+}
+
+static void * ggml_backend_rpc_split_buffer_get_base(ggml_backend_buffer_t buffer) {
+    // the slices are allocated separately, this is just a dummy address and never dereferenced
+    return (void *)0x1000;
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_rpc_split_buffer_init_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->view_src == nullptr); // views of split tensors are not supported
+    GGML_ASSERT(ggml_is_contiguous(tensor));
+
+    ggml_backend_rpc_split_buffer_context * ctx = (ggml_backend_rpc_split_buffer_context *)buffer->context;
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buffer->buft->context;
+
+    ggml_tensor_extra_rpc_split * extra = new ggml_tensor_extra_rpc_split{};
+    ctx->tensor_extras.push_back(extra);
+
+    for (int id = 0; id < (int) buft_ctx->endpoints.size(); ++id) {
+        int64_t row_low, row_high;
+        get_row_split(&row_low, &row_high, tensor, buft_ctx, id);
+
+        const int64_t nrows_split = row_high - row_low;
+        if (nrows_split == 0) {
+            continue;
+        }
+
+        ggml_tensor * slice = &extra->slices[id];
+        slice->type  = tensor->type;
+        slice->ne[0] = tensor->ne[0];
+        slice->ne[1] = nrows_split;
+        slice->ne[2] = 1;
+        slice->ne[3] = 1;
+        slice->nb[0] = ggml_type_size(tensor->type);
+        slice->nb[1] = ggml_row_size(tensor->type, tensor->ne[0]);
+        slice->nb[2] = slice->nb[1]*nrows_split;
+        slice->nb[3] = slice->nb[2];
+        ggml_format_name(slice, "%s (split %d)", tensor->name, id);
+
+        // FIXME: init_tensor cannot fail, it needs to be fixed in ggml-backend first
+        ggml_backend_buffer_type_t slice_buft = ggml_backend_rpc_buffer_type(buft_ctx->endpoints[id].c_str());
+        GGML_ASSERT(slice_buft != nullptr);
+        ggml_backend_buffer_t slice_buffer = ggml_backend_buft_alloc_buffer(slice_buft, ggml_backend_buft_get_alloc_size(slice_buft, slice));
+        GGML_ASSERT(slice_buffer != nullptr);
+        ggml_backend_buffer_set_usage(slice_buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        ggml_backend_tensor_alloc(slice_buffer, slice, ggml_backend_buffer_get_base(slice_buffer));
+    }
+    tensor->extra = extra;
+}
+
+static void ggml_backend_rpc_split_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    // split tensors must always be set in their entirety at once
+    GGML_ASSERT(offset == 0);
+    GGML_ASSERT(size == ggml_nbytes(tensor));
+
+    ggml_tensor_extra_rpc_split * extra = (ggml_tensor_extra_rpc_split *)tensor->extra;
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buffer->buft->context;
+
+    for (int id = 0; id < (int) buft_ctx->endpoints.size(); ++id) {
+        ggml_tensor * slice = &extra->slices[id];
+        if (slice->buffer == nullptr) {
+            continue;
+        }
+        int64_t row_low, row_high;
+        get_row_split(&row_low, &row_high, tensor, buft_ctx, id);
+
+        ggml_backend_tensor_set(slice, (const char *)data + row_low*tensor->nb[1], 0, ggml_nbytes(slice));
+    }
+}
+
+static void ggml_backend_rpc_split_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    // split tensors must always be read in their entirety at once
+    GGML_ASSERT(offset == 0);
+    GGML_ASSERT(size == ggml_nbytes(tensor));
+
+    ggml_tensor_extra_rpc_split * extra = (ggml_tensor_extra_rpc_split *)tensor->extra;
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buffer->buft->context;
+
+    for (int id = 0; id < (int) buft_ctx->endpoints.size(); ++id) {
+        const ggml_tensor * slice = &extra->slices[id];
+        if (slice->buffer == nullptr) {
+            continue;
+        }
+        int64_t row_low, row_high;
+        get_row_split(&row_low, &row_high, tensor, buft_ctx, id);
+
+        ggml_backend_tensor_get(slice, (char *)data + row_low*tensor->nb[1], 0, ggml_nbytes(slice));
+    }
+}
+
+static void ggml_backend_rpc_split_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    GGML_UNUSED(buffer);
+    GGML_UNUSED(value);
+}
+
+static const ggml_backend_buffer_i ggml_backend_rpc_split_buffer_interface = {
+    /* .free_buffer     = */ ggml_backend_rpc_split_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_rpc_split_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_rpc_split_buffer_init_tensor,
+    /* .memset_tensor   = */ NULL,
+    /* .set_tensor      = */ ggml_backend_rpc_split_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_rpc_split_buffer_get_tensor,
+    /* .cpy_tensor      = */ NULL,
+    /* .clear           = */ ggml_backend_rpc_split_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+static const char * ggml_backend_rpc_split_buffer_type_name(ggml_backend_buffer_type_t buft) {
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buft->context;
+    return buft_ctx->name.c_str();
+}
+
+static bool ggml_backend_buft_is_rpc_split(ggml_backend_buffer_type_t buft) {
+    return buft->iface.get_name == ggml_backend_rpc_split_buffer_type_name;
+}
+
+static ggml_backend_buffer_t ggml_backend_rpc_split_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    // the slices are allocated for each tensor separately in init_tensor, the size is only the upper bound that
+    // ggml-alloc enforces, as returned by get_alloc_size
+    ggml_backend_rpc_split_buffer_context * ctx = new ggml_backend_rpc_split_buffer_context();
+
+    return ggml_backend_buffer_init(buft, ggml_backend_rpc_split_buffer_interface, ctx, size);
+}
+
+static size_t ggml_backend_rpc_split_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return 128;
+
+    GGML_UNUSED(buft);
+}
+
+static size_t ggml_backend_rpc_split_buffer_type_get_alloc_size(ggml_backend_buffer_type_t buft, const ggml_tensor * tensor) {
+    // the padding that the servers may need is part of the slice buffers, which are allocated separately
+    return ggml_nbytes(tensor);
+
+    GGML_UNUSED(buft);
+}
+
+static bool ggml_backend_rpc_split_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    return false;
+
+    GGML_UNUSED(buft);
+}
+
+static const ggml_backend_buffer_type_i ggml_backend_rpc_split_buffer_type_interface = {
+    /* .get_name         = */ ggml_backend_rpc_split_buffer_type_name,
+    /* .alloc_buffer     = */ ggml_backend_rpc_split_buffer_type_alloc_buffer,
+    /* .get_alignment    = */ ggml_backend_rpc_split_buffer_type_get_alignment,
+    /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+    /* .get_alloc_size   = */ ggml_backend_rpc_split_buffer_type_get_alloc_size,
+    /* .is_host          = */ ggml_backend_rpc_split_buffer_type_is_host,
+};
+
 static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
 
@@ -625,13 +1050,22 @@ static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
 
 static void ggml_backend_rpc_free(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    for (ggml_backend_buffer_t buffer : rpc_ctx->split_scratch) {
+        if (buffer != nullptr) {
+            ggml_backend_buffer_free(buffer);
+        }
+    }
     delete rpc_ctx;
     delete backend;
 }
 
+// receives the responses of the graphs in flight, a failed graph is logged here and returned by the next graph_compute
 static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
-    GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    bool status = rpc_flush(*sock) && rpc_wait_pending(*sock);
+    GGML_ASSERT(status);
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -649,12 +1083,11 @@ static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors,
     tensors.push_back(serialize_tensor(tensor));
 }
 
-static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & output) {
-    uint32_t n_nodes = cgraph->n_nodes;
+static void serialize_graph(ggml_tensor * const * nodes, uint32_t n_nodes, std::vector<uint8_t> & output) {
     std::vector<rpc_tensor> tensors;
     std::unordered_set<ggml_tensor*> visited;
     for (uint32_t i = 0; i < n_nodes; i++) {
-        add_tensor(cgraph->nodes[i], tensors, visited);
+        add_tensor(nodes[i], tensors, visited);
     }
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
@@ -663,7 +1096,7 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     output.resize(output_size, 0);
     memcpy(output.data(), &n_nodes, sizeof(n_nodes));
     for (uint32_t i = 0; i < n_nodes; i++) {
-        memcpy(output.data() + sizeof(n_nodes) + i * sizeof(uint64_t), &cgraph->nodes[i], sizeof(uint64_t));
+        memcpy(output.data() + sizeof(n_nodes) + i * sizeof(uint64_t), &nodes[i], sizeof(uint64_t));
     }
     uint32_t * out_ntensors = (uint32_t *)(output.data() + sizeof(n_nodes) + n_nodes * sizeof(uint64_t));
     *out_ntensors = n_tensors;
@@ -671,15 +1104,229 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
+// the result is checked when the socket is synchronized
+static bool rpc_graph_compute_async(const std::shared_ptr<socket_t> & sock, ggml_tensor * const * nodes, uint32_t n_nodes) {
+    std::vector<uint8_t> input;
+    serialize_graph(nodes, n_nodes, input);
+    return send_rpc_cmd_async(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size());
+}
+
+static bool ggml_rpc_is_split_mul_mat(const ggml_tensor * node) {
+    return node->op == GGML_OP_MUL_MAT && node->src[0]->buffer && ggml_backend_buft_is_rpc_split(node->src[0]->buffer->buft);
+}
+
+static bool ggml_rpc_is_view_op(enum ggml_op op) {
+    return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+// result of a split matrix multiplication, gathered on the client
+struct rpc_split_result {
+    ggml_tensor * node;
+    std::vector<uint8_t> data;
+};
+
+// compute the matrix multiplications with split weights in the group, which have the same src1 and the same split
+// buffer type, on all the servers in parallel, and return the first failure among the servers
+static enum ggml_status rpc_split_mul_mat(ggml_backend_rpc_context * rpc_ctx, const std::vector<ggml_tensor *> & group, std::vector<rpc_split_result> & results) {
+    ggml_tensor * src1 = group[0]->src[1];
+    const ggml_backend_rpc_split_buffer_type_context * buft_ctx = (const ggml_backend_rpc_split_buffer_type_context *)group[0]->src[0]->buffer->buft->context;
+    const int n_servers = buft_ctx->endpoints.size();
+    const int n_group   = group.size();
+
+    // src1 is already on this server, the other servers get a copy of it
+    std::vector<uint8_t> src1_data;
+    for (int id = 0; id < n_servers; ++id) {
+        if (buft_ctx->endpoints[id] != rpc_ctx->endpoint) {
+            src1_data.resize(ggml_nbytes(src1));
+            ggml_backend_tensor_get(src1, src1_data.data(), 0, src1_data.size());
+            break;
+        }
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ n_servers*(ggml_tensor_overhead()*(n_group + 2) + ggml_graph_overhead_custom(2*n_group + 1, false)),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+    GGML_ASSERT(ctx != nullptr);
+
+    rpc_ctx->split_scratch.resize(std::max((int) rpc_ctx->split_scratch.size(), n_servers), nullptr);
+
+    // the slices of the results on each server, stored one after another
+    std::vector<ggml_tensor *> out(n_servers*n_group, nullptr);
+    std::vector<ggml_tensor *> out_all(n_servers, nullptr);
+
+    for (int id = 0; id < n_servers; ++id) {
+        const bool is_main = buft_ctx->endpoints[id] == rpc_ctx->endpoint;
+
+        // scratch buffer layout: | src1 | slices of the results |
+        ggml_backend_buffer_type_t buft = ggml_backend_rpc_buffer_type(buft_ctx->endpoints[id].c_str());
+        const size_t size_src1 = is_main ? 0 : GGML_PAD(ggml_nbytes(src1), ggml_backend_buft_get_alignment(buft));
+
+        size_t size_out = 0;
+        for (int k = 0; k < n_group; ++k) {
+            const ggml_tensor_extra_rpc_split * extra = (const ggml_tensor_extra_rpc_split *)group[k]->src[0]->extra;
+            size_out += extra->slices[id].ne[1]*ggml_nrows(src1)*sizeof(float);
+        }
+        if (size_out == 0) {
+            continue;
+        }
+
+        ggml_backend_buffer_t & scratch = rpc_ctx->split_scratch[id];
+        if (scratch == nullptr || ggml_backend_buffer_get_size(scratch) < size_src1 + size_out) {
+            if (scratch != nullptr) {
+                ggml_backend_buffer_free(scratch);
+            }
+            scratch = ggml_backend_buft_alloc_buffer(buft, size_src1 + size_out);
+            GGML_ASSERT(scratch != nullptr);
+        }
+        char * base = (char *)ggml_backend_buffer_get_base(scratch);
+
+        // src1 without its sources, which must not be part of the graph
+        ggml_tensor * x = ggml_new_tensor_4d(ctx, src1->type, src1->ne[0], src1->ne[1], src1->ne[2], src1->ne[3]);
+        if (is_main) {
+            x->buffer = src1->buffer;
+            x->data   = src1->data;
+        } else {
+            ggml_backend_tensor_alloc(scratch, x, base);
+            ggml_backend_tensor_set(x, src1_data.data(), 0, src1_data.size());
+        }
+
+        // the slices and x are leafs of the graph
+        ggml_cgraph * gf = ggml_new_graph_custom(ctx, 2*n_group + 1, false);
+
+        size_t offs = size_src1;
+        for (int k = 0; k < n_group; ++k) {
+            ggml_tensor_extra_rpc_split * extra = (ggml_tensor_extra_rpc_split *)group[k]->src[0]->extra;
+            ggml_tensor * slice = &extra->slices[id];
+            if (slice->buffer == nullptr) {
+                continue;
+            }
+            ggml_tensor * cur = ggml_mul_mat(ctx, slice, x);
+            ggml_backend_tensor_alloc(scratch, cur, base + offs);
+            ggml_build_forward_expand(gf, cur);
+            offs += ggml_nbytes(cur);
+            out[id*n_group + k] = cur;
+        }
+
+        out_all[id] = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, size_out);
+        ggml_backend_tensor_alloc(scratch, out_all[id], base + size_src1);
+
+        bool status = rpc_graph_compute_async(get_socket(buft_ctx->endpoints[id]), gf->nodes, gf->n_nodes);
+        GGML_ASSERT(status);
+    }
+
+    // gather the slices, the servers compute while the previous ones are being read
+    const size_t n_results = results.size();
+    for (int k = 0; k < n_group; ++k) {
+        GGML_ASSERT(ggml_is_contiguous(group[k]));
+        results.push_back({ group[k], std::vector<uint8_t>(ggml_nbytes(group[k])) });
+    }
+
+    std::vector<uint8_t> buf;
+    for (int id = 0; id < n_servers; ++id) {
+        if (out_all[id] == nullptr) {
+            continue;
+        }
+        buf.resize(ggml_nbytes(out_all[id]));
+        ggml_backend_tensor_get(out_all[id], buf.data(), 0, buf.size());
+
+        size_t offs = 0;
+        for (int k = 0; k < n_group; ++k) {
+            const ggml_tensor * cur = out[id*n_group + k];
+            if (cur == nullptr) {
+                continue;
+            }
+            const ggml_tensor * dst = group[k];
+            int64_t row_low, row_high;
+            get_row_split(&row_low, &row_high, dst->src[0], buft_ctx, id);
+
+            uint8_t * dst_data = results[n_results + k].data.data();
+            for (int64_t i = 0; i < ggml_nrows(cur); ++i) {
+                memcpy(dst_data + i*dst->nb[1] + row_low*sizeof(float), buf.data() + offs + i*cur->nb[1], cur->ne[0]*sizeof(float));
+            }
+            offs += ggml_nbytes(cur);
+        }
+    }
+
+    ggml_free(ctx);
+
+    // the responses of the servers have been received when their outputs were read
+    enum ggml_status result = GGML_STATUS_SUCCESS;
+    for (int id = 0; id < n_servers; ++id) {
+        if (out_all[id] == nullptr) {
+            continue;
+        }
+        enum ggml_status status = rpc_take_status(get_socket(buft_ctx->endpoints[id]));
+        if (result == GGML_STATUS_SUCCESS) {
+            result = status;
+        }
+    }
+    return result;
+}
+
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
-    std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
-    GGML_ASSERT(status);
-    return (enum ggml_status)response.result;
+
+    // a graph that failed since the last call is reported before anything else is computed
+    enum ggml_status result = rpc_take_status(sock);
+    if (result != GGML_STATUS_SUCCESS) {
+        return result;
+    }
+
+    // the nodes between the matrix multiplications with split weights are computed on this server
+    std::vector<rpc_split_result> results;
+    int i0 = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ggml_tensor * node = cgraph->nodes[i];
+        if (!ggml_rpc_is_split_mul_mat(node)) {
+            continue;
+        }
+        if (i > i0) {
+            bool status = rpc_graph_compute_async(sock, cgraph->nodes + i0, i - i0);
+            GGML_ASSERT(status);
+        }
+        i0 = i + 1;
+
+        auto find_result = [&]() {
+            return std::find_if(results.begin(), results.end(), [&](const rpc_split_result & r) { return r.node == node; });
+        };
+        auto it = find_result();
+        if (it == results.end()) {
+            // the following multiplications with the same src1 (e.g. Q, K and V) are computed at the same time,
+            // unless src1 is modified in between; their results are kept until the graph reaches them
+            ggml_tensor * src1 = node->src[1];
+            ggml_tensor * src1_base = src1->view_src ? src1->view_src : src1;
+
+            std::vector<ggml_tensor *> group = { node };
+            for (int j = i + 1; j < cgraph->n_nodes; j++) {
+                ggml_tensor * next = cgraph->nodes[j];
+                if (next->view_src == src1_base && !ggml_rpc_is_view_op(next->op)) {
+                    break;
+                }
+                if (ggml_rpc_is_split_mul_mat(next) && next->src[1] == src1 && next->src[0]->buffer->buft == node->src[0]->buffer->buft) {
+                    group.push_back(next);
+                }
+            }
+            enum ggml_status status = rpc_split_mul_mat(rpc_ctx, group, results);
+            if (result == GGML_STATUS_SUCCESS) {
+                result = status;
+            }
+            it = find_result();
+        }
+        ggml_backend_tensor_set(node, it->data.data(), 0, it->data.size());
+        results.erase(it);
+    }
+    if (i0 < cgraph->n_nodes) {
+        bool status = rpc_graph_compute_async(sock, cgraph->nodes + i0, cgraph->n_nodes - i0);
+        GGML_ASSERT(status);
+    }
+
+    // the graph is computed asynchronously, its responses are received by synchronize or by the next command that
+    // needs a response (e.g. get_tensor), so several graphs can be in flight
+    return result;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
@@ -769,9 +1416,61 @@ void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, si
 
 // RPC server-side implementation
 
+// read-only view of a file in the weight cache, mapped in memory where possible
+struct rpc_cache_file {
+    rpc_cache_file(const std::string & path) {
+#ifdef _WIN32
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f == nullptr) {
+            return;
+        }
+        if (fseek(f, 0, SEEK_END) == 0) {
+            long n = ftell(f);
+            if (n > 0 && fseek(f, 0, SEEK_SET) == 0) {
+                buf.resize(n);
+                if (fread(buf.data(), 1, n, f) == (size_t) n) {
+                    data = buf.data();
+                    size = n;
+                }
+            }
+        }
+        fclose(f);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = addr;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~rpc_cache_file() {
+#ifndef _WIN32
+        if (data != nullptr) {
+            munmap(const_cast<void *>(data), size);
+        }
+#endif
+    }
+
+    const void * data = nullptr;
+    size_t       size = 0;
+
+#ifdef _WIN32
+    std::vector<uint8_t> buf;
+#endif
+};
+
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(ggml_backend_t backend, const char * cache_dir) : backend(backend), cache_dir(cache_dir ? cache_dir : "") {}
     ~rpc_server();
 
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
@@ -781,11 +1480,13 @@ public:
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
+    void hello(rpc_msg_hello_rsp & response);
 
 private:
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
@@ -794,9 +1495,18 @@ private:
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
 
+    std::string cache_path(const rpc_hash & hash) const;
+    void cache_store(const rpc_hash & hash, const void * data, size_t size);
 
     ggml_backend_t backend;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+
+    // the weight cache is disabled if empty
+    std::string cache_dir;
+
+    // destination address -> hash of the weights that were not found in the cache,
+    // they are stored in the cache when they arrive with SET_TENSOR
+    std::unordered_map<uint64_t, rpc_hash> cache_missed;
 };
 
 bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response) {
@@ -844,6 +1554,12 @@ void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_
     }
 }
 
+void rpc_server::hello(rpc_msg_hello_rsp & response) {
+    response.major = RPC_PROTO_MAJOR_VERSION;
+    response.minor = RPC_PROTO_MINOR_VERSION;
+    response.patch = RPC_PROTO_PATCH_VERSION;
+}
+
 void rpc_server::get_alignment(rpc_msg_get_alignment_rsp & response) {
     ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
     size_t alignment = ggml_backend_buft_get_alignment(buft);
@@ -959,11 +1675,98 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     }
 
     const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    if (!cache_missed.empty()) {
+        auto it = cache_missed.find(in_tensor->data + offset);
+        if (it != cache_missed.end()) {
+            // the hash from the client is not trusted, the data is only stored under its own hash
+            if (rpc_data_hash((const uint8_t *)data, size) == it->second) {
+                cache_store(it->second, data, size);
+            }
+            cache_missed.erase(it);
+        }
+    }
     ggml_backend_tensor_set(tensor, data, offset, size);
     ggml_free(ctx);
     return true;
 }
 
+std::string rpc_server::cache_path(const rpc_hash & hash) const {
+    char name[2*sizeof(rpc_hash) + 1];
+    for (size_t i = 0; i < hash.size(); ++i) {
+        snprintf(name + 2*i, 3, "%02x", hash[i]);
+    }
+    std::string path = cache_dir;
+    if (path.back() != '/' && path.back() != '\\') {
+        path += '/';
+    }
+    return path + name;
+}
+
+void rpc_server::cache_store(const rpc_hash & hash, const void * data, size_t size) {
+    const std::string path = cache_path(hash);
+    const std::string path_tmp = path + ".tmp";
+
+    FILE * f = fopen(path_tmp.c_str(), "wb");
+    if (f == nullptr) {
+        GGML_LOG_ERROR("[%s] failed to open %s\n", __func__, path_tmp.c_str());
+        return;
+    }
+    const bool ok = fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0 || !ok || std::rename(path_tmp.c_str(), path.c_str()) != 0) {
+        GGML_LOG_ERROR("[%s] failed to write %s\n", __func__, path.c_str());
+        std::remove(path_tmp.c_str());
+        return;
+    }
+    GGML_PRINT_DEBUG("[%s] stored %zu bytes in %s\n", __func__, size, path.c_str());
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    response.result = 0;
+    if (cache_dir.empty()) {
+        return true;
+    }
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr || tensor->buffer == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 ||
+            request.tensor.data + request.offset >= p1 ||
+            request.size > (p1 - request.tensor.data - request.offset)) {
+                GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    rpc_hash hash;
+    memcpy(hash.data(), request.hash, hash.size());
+    const std::string path = cache_path(hash);
+    rpc_cache_file file(path);
+    if (file.data != nullptr && file.size == request.size) {
+        GGML_PRINT_DEBUG("[%s] cache hit for %s, size: %" PRIu64 "\n", __func__, path.c_str(), request.size);
+        ggml_backend_tensor_set(tensor, file.data, request.offset, request.size);
+        response.result = 1;
+    } else {
+        cache_missed[request.tensor.data + request.offset] = hash;
+    }
+
+    ggml_free(ctx);
+    return true;
+}
+
 bool rpc_server::init_tensor(const rpc_msg_init_tensor_req & request) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -1126,8 +1929,29 @@ rpc_server::~rpc_server() {
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir);
+    // the first command must be HELLO so that the client can check the protocol version
+    {
+        uint8_t cmd;
+        if (!recv_data(sockfd, &cmd, 1)) {
+            return;
+        }
+        if (cmd != RPC_CMD_HELLO) {
+            fprintf(stderr, "Expected HELLO command, update client\n");
+            return;
+        }
+        if (!recv_msg(sockfd, nullptr, 0)) {
+            return;
+        }
+        rpc_msg_hello_rsp response;
+        server.hello(response);
+        if (!send_msg(sockfd, &response, sizeof(response))) {
+            return;
+        }
+    }
+    // commands without a response (FREE_BUFFER, BUFFER_CLEAR, SET_TENSOR, INIT_TENSOR) are not acknowledged,
+    // a failure closes the connection and the client notices it on its next synchronous command
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1139,6 +1963,10 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
             break;
         }
         switch (cmd) {
+            case RPC_CMD_HELLO: {
+                fprintf(stderr, "Unexpected HELLO command\n");
+                return;
+            }
             case RPC_CMD_ALLOC_BUFFER: {
                 rpc_msg_alloc_buffer_req request;
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1207,9 +2035,6 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 if (!server.free_buffer(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
                 break;
             }
             case RPC_CMD_BUFFER_CLEAR: {
@@ -1220,9 +2045,6 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 if (!server.buffer_clear(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
                 break;
             }
             case RPC_CMD_SET_TENSOR: {
@@ -1233,7 +2055,18 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 if (!server.set_tensor(input)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_HASH: {
+                rpc_msg_set_tensor_hash_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_hash_rsp response;
+                if (!server.set_tensor_hash(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1246,9 +2079,6 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 if (!server.init_tensor(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
                 break;
             }
             case RPC_CMD_GET_TENSOR: {
@@ -1313,7 +2143,7 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1342,7 +2172,7 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
         printf("Client connection closed\n");
         fflush(stdout);
     }
@@ -1415,13 +2245,27 @@ static ggml_backend_buffer_type_t ggml_backend_rpc_device_get_buffer_type(ggml_b
 }
 
 static bool ggml_backend_rpc_device_supports_op(ggml_backend_dev_t dev, const struct ggml_tensor * op) {
-    GGML_UNUSED(dev);
-    GGML_UNUSED(op);
+    // split buffers can only be used as src0 of GGML_OP_MUL_MAT, with a contiguous src1
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        const ggml_tensor * src = op->src[i];
+        if (src && src->buffer && ggml_backend_buft_is_rpc_split(src->buffer->buft)) {
+            if (op->op != GGML_OP_MUL_MAT || i != 0 || src->buffer->buft->device != dev) {
+                return false;
+            }
+            if (src->ne[2] != 1 || src->ne[3] != 1 || !ggml_is_contiguous(op->src[1])) {
+                return false;
+            }
+        }
+    }
+
     //TODO: call the remote backend and cache the results
     return true;
 }
 
 static bool ggml_backend_rpc_device_supports_buft(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft) {
+    if (buft && ggml_backend_buft_is_rpc_split(buft)) {
+        return buft->device == dev;
+    }
     if (!buft || buft->iface.get_name != ggml_backend_rpc_buffer_type_name) {
         return false;
     }
@@ -1450,6 +2294,12 @@ static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
 
 // backend reg interface
 
+// the devices are added with ggml_backend_rpc_add_device, in this order
+struct ggml_backend_rpc_reg_context {
+    std::mutex mutex;
+    std::vector<ggml_backend_dev_t> devices;
+};
+
 static const char * ggml_backend_rpc_reg_get_name(ggml_backend_reg_t reg) {
     return "RPC";
 
@@ -1457,22 +2307,27 @@ static const char * ggml_backend_rpc_reg_get_name(ggml_backend_reg_t reg) {
 }
 
 static size_t ggml_backend_rpc_reg_get_device_count(ggml_backend_reg_t reg) {
-    return 0;
+    ggml_backend_rpc_reg_context * ctx = (ggml_backend_rpc_reg_context *)reg->context;
+    std::lock_guard<std::mutex> lock(ctx->mutex);
 
-    GGML_UNUSED(reg);
+    return ctx->devices.size();
 }
 
 static ggml_backend_dev_t ggml_backend_rpc_reg_get_device(ggml_backend_reg_t reg, size_t index) {
-    GGML_ABORT("The RPC backend does not have enumerated devices - use ggml_backend_add_device instead");
+    ggml_backend_rpc_reg_context * ctx = (ggml_backend_rpc_reg_context *)reg->context;
+    std::lock_guard<std::mutex> lock(ctx->mutex);
 
-    GGML_UNUSED(reg);
-    GGML_UNUSED(index);
+    GGML_ASSERT(index < ctx->devices.size());
+    return ctx->devices[index];
 }
 
 static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const char * name) {
     if (std::strcmp(name, "ggml_backend_rpc_add_device") == 0) {
         return (void *)ggml_backend_rpc_add_device;
     }
+    if (std::strcmp(name, "ggml_backend_split_buffer_type") == 0) {
+        return (void *)ggml_backend_rpc_split_buffer_type;
+    }
     return NULL;
 
     GGML_UNUSED(reg);
@@ -1486,10 +2341,12 @@ static const struct ggml_backend_reg_i ggml_backend_rpc_reg_i = {
 };
 
 ggml_backend_reg_t ggml_backend_rpc_reg(void) {
+    static ggml_backend_rpc_reg_context ctx;
+
     static struct ggml_backend_reg ggml_backend_rpc_reg = {
         /* .api_version = */ GGML_BACKEND_API_VERSION,
         /* .iface       = */ ggml_backend_rpc_reg_i,
-        /* .context     = */ NULL,
+        /* .context     = */ &ctx,
     };
 
     return &ggml_backend_rpc_reg;
@@ -1518,7 +2375,80 @@ ggml_backend_dev_t ggml_backend_rpc_add_device(const char * endpoint) {
 
     dev_map[endpoint] = dev;
 
+    {
+        ggml_backend_rpc_reg_context * reg_ctx = (ggml_backend_rpc_reg_context *)ggml_backend_rpc_reg()->context;
+        std::lock_guard<std::mutex> reg_lock(reg_ctx->mutex);
+        reg_ctx->devices.push_back(dev);
+    }
+
     return dev;
 }
 
+ggml_backend_buffer_type_t ggml_backend_rpc_split_buffer_type(int main_device, const float * tensor_split) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    ggml_backend_reg_t reg = ggml_backend_rpc_reg();
+    const int n_servers = ggml_backend_reg_dev_count(reg);
+    if (main_device < 0 || main_device >= n_servers || n_servers > GGML_RPC_MAX_SERVERS) {
+        return nullptr;
+    }
+
+    std::vector<std::string> endpoints;
+    for (int id = 0; id < n_servers; ++id) {
+        ggml_backend_dev_t dev = ggml_backend_reg_dev_get(reg, id);
+        endpoints.push_back(((ggml_backend_rpc_device_context *)dev->context)->endpoint);
+    }
+
+    // by default, the rows are split in proportion to the free memory of the servers
+    std::array<float, GGML_RPC_MAX_SERVERS> split = {};
+    bool all_zero = tensor_split == nullptr || std::all_of(tensor_split, tensor_split + n_servers, [](float x) { return x == 0.0f; });
+    for (int id = 0; id < n_servers; ++id) {
+        if (all_zero) {
+            size_t free, total;
+            ggml_backend_rpc_get_device_memory(endpoints[id].c_str(), &free, &total);
+            split[id] = free;
+        } else {
+            split[id] = tensor_split[id];
+        }
+    }
+
+    std::array<float, GGML_RPC_MAX_SERVERS> tensor_split_arr = {};
+    float split_sum = 0.0f;
+    for (int id = 0; id < n_servers; ++id) {
+        tensor_split_arr[id] = split_sum;
+        split_sum += split[id];
+    }
+    if (split_sum <= 0.0f) {
+        return nullptr;
+    }
+    for (int id = 0; id < n_servers; ++id) {
+        tensor_split_arr[id] /= split_sum;
+    }
+
+    // NOTE: buffer types are allocated and never freed; this is by design
+    static std::map<std::tuple<int, int, std::array<float, GGML_RPC_MAX_SERVERS>>, ggml_backend_buffer_type_t> buft_map;
+
+    auto key = std::make_tuple(main_device, n_servers, tensor_split_arr);
+    auto it = buft_map.find(key);
+    if (it != buft_map.end()) {
+        return it->second;
+    }
+
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = new ggml_backend_rpc_split_buffer_type_context {
+        /* .main_device  = */ main_device,
+        /* .endpoints    = */ endpoints,
+        /* .tensor_split = */ tensor_split_arr,
+        /* .name         = */ "RPC[" + endpoints[main_device] + "]_Split",
+    };
+
+    ggml_backend_buffer_type_t buft = new ggml_backend_buffer_type {
+        /* .iface   = */ ggml_backend_rpc_split_buffer_type_interface,
+        /* .device  = */ ggml_backend_reg_dev_get(reg, main_device),
+        /* .context = */ buft_ctx,
+    };
+    buft_map[key] = buft;
+    return buft;
+}
+
 GGML_BACKEND_DL_IMPL(ggml_backend_rpc_reg)
@@ -529,6 +529,10 @@ extern "C" {
     // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
     LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
 
+    // Returns true if the model attends in both directions within a sequence (like BERT)
+    // Such models don't use the KV cache and can evaluate their batches with llama_encode()
+    LLAMA_API bool llama_model_is_non_causal(const struct llama_model * model);
+
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -564,8 +568,35 @@ extern "C" {
             struct llama_adapter_lora * adapter);
 
     // Remove all LoRA adapters from given context
+    // The adapters of the sequences are not affected, see llama_clear_adapter_lora_seq
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the tokens of a sequence, in addition to the adapters of the context
+    // The sequences of a batch can use different adapters - the tokens shared by several sequences use the
+    // adapters of the first one
+    // The adapters of all the sequences are copied into a common buffer on the next decode, the adapter must be kept
+    // alive while set. The buffer keeps the type of the adapters when they all have the same one, adapters of
+    // different types take the memory of F32 tensors. Adapters with expert tensors are not supported
+    // This will not modify model's weight
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id,
+            struct llama_adapter_lora * adapter,
+            float scale);
+
+    // Remove a specific LoRA adapter from a sequence
+    // Return -1 if the adapter is not present in the sequence
+    LLAMA_API int32_t llama_rm_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id,
+            struct llama_adapter_lora * adapter);
+
+    // Remove all LoRA adapters from a sequence
+    // seq_id < 0 : all the sequences
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -850,6 +881,9 @@ extern "C" {
 
     // Processes a batch of tokens with the ecoder part of the encoder-decoder model.
     // Stores the encoder output internally for later use by the decoder cross-attention layers.
+    // For non-causal models (see llama_model_is_non_causal), the batch can hold many independent
+    // sequences: each of them is evaluated whole, without the KV cache, and several are packed
+    // into every ubatch. A sequence must belong alone to its tokens and fit in n_ubatch.
     //   0 - success
     // < 0 - error. the KV cache state is restored to the state before this call
     LLAMA_API int32_t llama_encode(
@@ -1006,6 +1040,24 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert multiple texts into tokens, using up to n_threads threads.
+    /// @param texts The n_texts texts to tokenize, of text_lens[i] bytes each.
+    /// @param tokens The tokens[i] pointer must be large enough to hold n_tokens_max[i] tokens.
+    /// @param n_tokens Receives the result of llama_tokenize() for each text.
+    /// @param n_threads The number of threads to use, or <= 0 to use all hardware threads.
+    /// @return Returns 0 on success, or the number of texts whose tokens did not fit in their buffer.
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_vocab * vocab,
+                     const char ** texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                    llama_token ** tokens,
+                   const int32_t * n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1140,6 +1192,12 @@ extern "C" {
     // after removing a sampler, the chain will no longer own it, and it will not be freed when the chain is freed
     LLAMA_API struct llama_sampler * llama_sampler_chain_remove(   struct llama_sampler * chain, int32_t i);
 
+    // initialize the candidates for the logits of a single output in a buffer owned by the chain
+    // if the chain starts with a top-k sampler (not counting samplers that have no effect), only the top-k candidates
+    // are extracted from the logits, sorted in descending order - the full vocabulary is never materialized
+    // the returned array is valid until the next call or until the chain is freed
+    LLAMA_API llama_token_data_array llama_sampler_chain_candidates(struct llama_sampler * chain, const float * logits, int32_t n_vocab);
+
     // available samplers:
 
     LLAMA_API struct llama_sampler * llama_sampler_init_greedy(void);
@@ -1298,6 +1356,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of decodes that reused the graph of the previous ubatch
     };
 
     struct llama_perf_sampler_data {
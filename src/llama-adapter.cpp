@@ -5,8 +5,10 @@
 #include "llama-model.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <cassert>
+#include <cstring>
 #include <stdexcept>
 
 // vec
@@ -135,6 +137,10 @@ int32_t llama_adapter_cvec::apply(
 
 // lora
 
+static std::atomic<uint64_t> llama_adapter_lora_next_uid { 1 };
+
+llama_adapter_lora::llama_adapter_lora() : uid(llama_adapter_lora_next_uid++) {}
+
 llama_adapter_lora_weight * llama_adapter_lora::get_weight(struct ggml_tensor * w) {
     const std::string name(w->name);
 
@@ -345,3 +351,234 @@ struct llama_adapter_lora * llama_adapter_lora_init(struct llama_model * model,
 void llama_adapter_lora_free(struct llama_adapter_lora * adapter) {
     delete adapter;
 }
+
+// lora stack
+
+int32_t llama_adapter_lora_stack::find(const llama_adapter_lora * adapter) const {
+    for (size_t i = 0; i < adapters.size(); ++i) {
+        if (adapters[i].first == adapter && adapters[i].second == adapter->uid) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const llama_adapter_lora_stack::weight * llama_adapter_lora_stack::get_weight(const struct ggml_tensor * w) const {
+    if (weights.empty()) {
+        return nullptr;
+    }
+
+    const auto pos = weights.find(std::string(w->name));
+    if (pos != weights.end()) {
+        return &pos->second;
+    }
+
+    return nullptr;
+}
+
+// write a 2d adapter tensor into the top-left corner of the slice i of the stacked tensor dst, the rest is zero
+// the rows are copied as is if the types match and there is no scale to apply, otherwise they are converted via F32
+static void llama_adapter_lora_stack_set(const struct ggml_tensor * src, struct ggml_tensor * dst, int64_t i, float scale,
+        std::vector<uint8_t> & buf, std::vector<float> & row, std::vector<uint8_t> & slice) {
+    // all-zero bytes are zero values for every type, as in a cleared KV cache
+    slice.assign(dst->nb[2], 0);
+
+    if (src) {
+        buf.resize(ggml_nbytes(src));
+        ggml_backend_tensor_get(src, buf.data(), 0, buf.size());
+
+        const bool as_is = src->type == dst->type && scale == 1.0f;
+
+        for (int64_t i1 = 0; i1 < src->ne[1]; ++i1) {
+            const uint8_t * src_row = buf.data()   + i1*src->nb[1];
+                  uint8_t * dst_row = slice.data() + i1*dst->nb[1];
+
+            if (as_is) {
+                memcpy(dst_row, src_row, ggml_row_size(src->type, src->ne[0]));
+                continue;
+            }
+
+            row.assign(dst->ne[0], 0.0f);
+            if (src->type == GGML_TYPE_F32) {
+                memcpy(row.data(), src_row, src->ne[0]*sizeof(float));
+            } else {
+                ggml_get_type_traits(src->type)->to_float(src_row, row.data(), src->ne[0]);
+            }
+
+            if (scale != 1.0f) {
+                for (int64_t i0 = 0; i0 < src->ne[0]; ++i0) {
+                    row[i0] *= scale;
+                }
+            }
+
+            if (dst->type == GGML_TYPE_F32) {
+                memcpy(dst_row, row.data(), dst->ne[0]*sizeof(float));
+            } else {
+                ggml_get_type_traits(dst->type)->from_float_ref(row.data(), dst_row, dst->ne[0]);
+            }
+        }
+    }
+
+    ggml_backend_tensor_set(dst, slice.data(), i*dst->nb[2], dst->nb[2]);
+}
+
+void llama_adapter_lora_stack::build(const std::vector<llama_adapter_lora *> & adapters_new) {
+    auto str_endswith = [](const std::string & str, const std::string & suffix) {
+        return str.size() >= suffix.size() && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    // the stack keeps the common type of the adapters, and uses F32 for adapters of different types
+    // lora_b can only be copied as is when it needs no scale, a scaled quantized lora_b is stacked as F16
+    auto stack_type = [](ggml_type type, ggml_type other) {
+        if (type == GGML_TYPE_COUNT) {
+            type = other;
+        }
+        return type == other ? type : GGML_TYPE_F32;
+    };
+
+    auto is_float = [](ggml_type type) {
+        return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_BF16;
+    };
+
+    struct stack_info {
+        ggml_backend_buffer_type_t buft = nullptr;
+
+        ggml_type type_a = GGML_TYPE_COUNT;
+        ggml_type type_b = GGML_TYPE_COUNT;
+
+        int64_t n_in  = 0; // token_embd: n_vocab
+        int64_t n_out = 0;
+        int64_t r_max = 0;
+
+        bool is_token_embd = false;
+        bool is_scaled_b   = false;
+    };
+
+    // collect the shapes of the stacked tensors
+    std::map<std::string, stack_info> infos;
+
+    for (const auto * adapter : adapters_new) {
+        for (const auto & it : adapter->ab_map) {
+            const llama_adapter_lora_weight & w = it.second;
+
+            if (ggml_n_dims(w.a) > 2 || ggml_n_dims(w.b) > 2) {
+                throw std::runtime_error("LoRA tensor '" + it.first + "' has more than 2 dimensions, per-sequence adapters do not support expert tensors");
+            }
+
+            stack_info & info = infos[it.first];
+
+            info.is_token_embd = str_endswith(it.first, "token_embd.weight");
+
+            if (!info.buft) {
+                info.buft = ggml_backend_buffer_get_type(w.a->buffer);
+            }
+
+            info.type_a = stack_type(info.type_a, w.a->type);
+            info.type_b = stack_type(info.type_b, w.b->type);
+
+            info.is_scaled_b = info.is_scaled_b || w.get_scale(adapter->alpha, 1.0f) != 1.0f;
+
+            info.n_in  = info.is_token_embd ? w.a->ne[1] : w.a->ne[0];
+            info.n_out = w.b->ne[1];
+            info.r_max = std::max(info.r_max, w.b->ne[0]);
+        }
+    }
+
+    // contexts for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    std::vector<ggml_context_ptr> ctxs_new;
+    std::vector<ggml_backend_buffer_ptr> bufs_new;
+
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ 2*infos.size()*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context * buft_ctx = ggml_init(params);
+            if (!buft_ctx) {
+                throw std::runtime_error("failed to create context for the LoRA stack");
+            }
+            ctx_map[buft] = buft_ctx;
+            ctxs_new.emplace_back(buft_ctx);
+            return buft_ctx;
+        }
+        return it->second;
+    };
+
+    const int64_t n_adapters = adapters_new.size();
+
+    std::unordered_map<std::string, weight> weights_new;
+
+    for (auto & it : infos) {
+        stack_info & info = it.second;
+
+        if (info.is_scaled_b && !is_float(info.type_b)) {
+            info.type_b = GGML_TYPE_F16;
+        }
+
+        ggml_context * ctx = ctx_for_buft(info.buft);
+
+        weight & w = weights_new[it.first];
+        if (info.is_token_embd) {
+            w.a = ggml_new_tensor_3d(ctx, info.type_a, info.r_max, info.n_in, n_adapters);
+        } else {
+            w.a = ggml_new_tensor_3d(ctx, info.type_a, info.n_in, info.r_max, n_adapters);
+        }
+        w.b = ggml_new_tensor_3d(ctx, info.type_b, info.r_max, info.n_out, n_adapters);
+
+        ggml_format_name(w.a, "%s.lora_a_stack", it.first.c_str());
+        ggml_format_name(w.b, "%s.lora_b_stack", it.first.c_str());
+    }
+
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first) };
+        if (!buf) {
+            throw std::runtime_error("failed to allocate buffer for the LoRA stack");
+        }
+        LLAMA_LOG_INFO("%s: %10s LoRA stack buffer size = %8.2f MiB (%d adapters)\n", __func__,
+                ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0, (int) n_adapters);
+        bufs_new.emplace_back(std::move(buf));
+    }
+
+    // copy the adapters, one slice at a time
+    {
+        std::vector<uint8_t> read_buf;
+        std::vector<float>   row;
+        std::vector<uint8_t> slice;
+
+        for (auto & it : weights_new) {
+            weight & w = it.second;
+
+            for (int64_t i = 0; i < n_adapters; ++i) {
+                llama_adapter_lora * adapter = adapters_new[i];
+
+                llama_adapter_lora_weight * lw = nullptr;
+                {
+                    const auto pos = adapter->ab_map.find(it.first);
+                    if (pos != adapter->ab_map.end()) {
+                        lw = &pos->second;
+                    }
+                }
+
+                // A: the rank is the second dimension, except for token_embd
+                llama_adapter_lora_stack_set(lw ? lw->a : nullptr, w.a, i, 1.0f, read_buf, row, slice);
+
+                // B: the rank is the first dimension, pad every row
+                llama_adapter_lora_stack_set(lw ? lw->b : nullptr, w.b, i, lw ? lw->get_scale(adapter->alpha, 1.0f) : 1.0f, read_buf, row, slice);
+            }
+        }
+    }
+
+    adapters.clear();
+    for (const auto * adapter : adapters_new) {
+        adapters.emplace_back(adapter, adapter->uid);
+    }
+
+    weights = std::move(weights_new);
+    ctxs    = std::move(ctxs_new);
+    bufs    = std::move(bufs_new);
+}
@@ -4,6 +4,7 @@
 
 #include "ggml-cpp.h"
 
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -67,8 +68,49 @@ struct llama_adapter_lora {
 
     float alpha;
 
-    llama_adapter_lora() = default;
+    // unique for the lifetime of the process, used to tell apart adapters allocated at the same address
+    const uint64_t uid;
+
+    llama_adapter_lora();
     ~llama_adapter_lora() = default;
 
     llama_adapter_lora_weight * get_weight(struct ggml_tensor * w);
 };
+
+//
+// llama_adapter_lora_stack
+//
+
+// the per-sequence adapters of a context, stacked per model tensor so that every token of a batch can select its own
+// adapters with ggml_mul_mat_id
+// the adapters are zero-padded to the largest rank, and lora_b is pre-scaled by alpha/rank
+// the stacked tensors keep the type of the adapters, except for:
+//  - adapters of different types, stacked as F32 (2x the memory of F16 adapters, ~4x the memory of Q8_0 adapters)
+//  - a quantized lora_b with a scale other than 1, stacked as F16
+struct llama_adapter_lora_stack {
+    // the last dimension is the index of the adapter in the stack
+    struct weight {
+        struct ggml_tensor * a = nullptr; // [n_in, r_max, n_adapters], token_embd: [r_max, n_vocab, n_adapters]
+        struct ggml_tensor * b = nullptr; // [r_max, n_out, n_adapters]
+    };
+
+    // index of an adapter in the stack, or -1 if the adapter is not stacked
+    int32_t find(const llama_adapter_lora * adapter) const;
+
+    const weight * get_weight(const struct ggml_tensor * w) const;
+
+    // replace the stack with the given adapters, throws on failure
+    void build(const std::vector<llama_adapter_lora *> & adapters);
+
+    bool empty() const { return adapters.empty(); }
+
+    size_t size() const { return adapters.size(); }
+
+private:
+    std::vector<std::pair<const llama_adapter_lora *, uint64_t>> adapters; // (adapter, uid)
+
+    std::unordered_map<std::string, weight> weights;
+
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+};
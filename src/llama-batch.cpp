@@ -189,6 +189,46 @@ llama_ubatch llama_sbatch::split_seq(size_t n_ubatch) {
     return ubatch;
 }
 
+llama_ubatch llama_sbatch::split_packed(size_t n_ubatch) {
+    n_ubatch = n_tokens < n_ubatch ? n_tokens : n_ubatch;
+    llama_ubatch ubatch = reserve_ubatch(n_ubatch, /* has_embd */ batch->embd != nullptr);
+    ubatch.equal_seqs = false;
+    ubatch_seq_id_packed.resize(n_ubatch);
+    packed_seq_id.clear();
+    // the sequences are sorted by length, so this is a first-fit decreasing packing
+    for (llama_sbatch_seq & s : seq) {
+        if (s.length == 0 || ubatch.n_tokens + s.length > n_ubatch) {
+            continue;
+        }
+        GGML_ASSERT(s.n_seq_id == 1); // shared prompts can't be packed
+        const llama_seq_id id = packed_seq_id.size();
+        packed_seq_id.push_back(s.seq_id[0]);
+        ubatch_seq_id_packed[id] = id;
+        for (size_t i = 0; i < s.length; ++i) {
+            const size_t bi = ids[s.offset + i];
+            const size_t ti = ubatch.n_tokens + i;
+            if (batch->token) {
+                ubatch.token[ti] = batch->token[bi];
+            }
+            if (batch->embd) {
+                memcpy(ubatch.embd + n_embd * ti, batch->embd + n_embd * bi, n_embd * sizeof(float));
+            }
+            ubatch.pos[ti]      = batch->pos[bi];
+            ubatch.n_seq_id[ti] = 1;
+            ubatch.seq_id[ti]   = &ubatch_seq_id_packed[id];
+            ubatch.output[ti]   = 1;
+            out_ids.push_back(bi);
+        }
+        ubatch.n_tokens += s.length;
+        n_tokens -= s.length;
+        s.offset += s.length;
+        s.length = 0;
+    }
+    ubatch.n_seq_tokens = 1;
+    ubatch.n_seqs = ubatch.n_tokens;
+    return ubatch;
+}
+
 void llama_sbatch::from_batch(const llama_batch & batch, size_t n_embd, bool simple_split, bool logits_all) {
     GGML_ASSERT(batch.n_tokens >= 0);
     this->batch = &batch;
@@ -198,6 +238,7 @@ void llama_sbatch::from_batch(const llama_batch & batch, size_t n_embd, bool sim
     n_tokens = batch.n_tokens;
     ids.resize(n_tokens);
     out_ids.clear();
+    packed_seq_id.clear();
     // TODO: reserve out_ids and seq
 
     for (size_t i = 0; i < n_tokens; ++i) {
@@ -57,6 +57,10 @@ struct llama_sbatch {
     std::vector<llama_seq_id *> ubatch_seq_id;
     std::vector<int8_t>         ubatch_output;
 
+    // the sequences of a packed ubatch are renumbered from 0, packed_seq_id maps them back to the batch
+    std::vector<llama_seq_id>   ubatch_seq_id_packed;
+    std::vector<llama_seq_id>   packed_seq_id;
+
     llama_ubatch reserve_ubatch(size_t n_ubatch, bool has_embd = false);
 
     void add_seq_to_ubatch(llama_ubatch & ubatch, llama_sbatch_seq & seq, size_t length);
@@ -70,6 +74,10 @@ struct llama_sbatch {
     // sequence-wise split
     llama_ubatch split_seq(size_t n_ubatch);
 
+    // pack whole sequences of unequal lengths, longest first, without splitting any of them
+    // each token is its own virtual sequence, as in split_simple
+    llama_ubatch split_packed(size_t n_ubatch);
+
     void from_batch(const llama_batch & batch, size_t n_embd, bool simple_split = false, bool logits_all = false);
 };
 
@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 #include "llama-mmap.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -32,6 +33,12 @@ void llama_set_s_copy(struct llama_context & lctx) {
     }
 }
 
+// the sequences of a packed ubatch are renumbered, map them back to the ids used in the batch
+static llama_seq_id llama_ubatch_seq_id_batch(const llama_context & lctx, llama_seq_id seq_id) {
+    const auto & packed_seq_id = lctx.sbatch.packed_seq_id;
+    return packed_seq_id.empty() ? seq_id : packed_seq_id[seq_id];
+}
+
 // llama input
 
 static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
@@ -159,12 +166,14 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
                         const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
 
                         for (int i = 0; i < n_kv; ++i) {
+                            const llama_kv_cell & cell = kv_self.cells[kv_self.base + i];
+
                             float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                            if (!cell.has_seq_id(seq_id) || cell.pos > pos) {
                                 f = -INFINITY;
                             } else {
                                 if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
+                                    f = -std::abs(cell.pos - pos);
                                 } else {
                                     f = 0.0f;
                                 }
@@ -176,7 +185,7 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
 
                             // may need to cut off old tokens for sliding window
                             if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - cell.pos >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                                 data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
@@ -411,7 +420,7 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     for (int i = 0; i < n_kv; ++i) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[i].pos, ubatch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[kv_self.base + i].pos, ubatch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
                     }
                 }
             }
@@ -463,6 +472,133 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
             }
         }
     }
+
+    if (lctx.inp_lora_ids || lctx.inp_lora_ids_out) {
+        const int64_t n_used       = lctx.n_lora_seq;
+        const int64_t n_tokens     = ubatch.n_tokens;
+        const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+        const int64_t n_seqs       = ubatch.n_seqs;
+
+        std::vector<int32_t> ids  (n_used*n_tokens);
+        std::vector<float>   scale(n_used*n_tokens);
+
+        for (int64_t s = 0; s < n_seqs; ++s) {
+            // the tokens shared by several sequences use the adapters of the first one
+            const auto it = lctx.lora_seq.find(llama_ubatch_seq_id_batch(lctx, ubatch.seq_id[s][0]));
+
+            for (int64_t j = 0; j < n_seq_tokens; ++j) {
+                int32_t * ids_i   = ids.data()   + (s*n_seq_tokens + j)*n_used;
+                float   * scale_i = scale.data() + (s*n_seq_tokens + j)*n_used;
+
+                int64_t k = 0;
+                if (it != lctx.lora_seq.end()) {
+                    for (const auto & la : it->second) {
+                        ids_i  [k] = lctx.lora_stack.find(la.first);
+                        scale_i[k] = la.second;
+                        k++;
+                    }
+                }
+
+                // the unused entries select other adapters with a zero scale
+                // mul_mat_id expects the ids of a token to be distinct, like the experts of a MoE
+                for (int32_t id = 0; k < n_used; ++id) {
+                    if (std::find(ids_i, ids_i + k, id) == ids_i + k) {
+                        ids_i  [k] = id;
+                        scale_i[k] = 0.0f;
+                        k++;
+                    }
+                }
+            }
+        }
+
+        if (lctx.inp_lora_ids) {
+            ggml_backend_tensor_set(lctx.inp_lora_ids,   ids.data(),   0, ggml_nbytes(lctx.inp_lora_ids));
+            ggml_backend_tensor_set(lctx.inp_lora_scale, scale.data(), 0, ggml_nbytes(lctx.inp_lora_scale));
+        }
+
+        if (lctx.inp_lora_rows) {
+            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_lora_rows->buffer));
+
+            int32_t * data = (int32_t *) lctx.inp_lora_rows->data;
+
+            // the rows of the stacked token_embd lora_a, viewed as [r_max, n_vocab*n_adapters]
+            const int64_t n_vocab = lctx.model.vocab.n_tokens();
+
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                for (int64_t k = 0; k < n_used; ++k) {
+                    data[i*n_used + k] = ids[i*n_used + k]*n_vocab + ubatch.token[i];
+                }
+            }
+        }
+
+        if (lctx.inp_lora_ids_out) {
+            GGML_ASSERT(lctx.inp_out_ids);
+            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_out_ids->buffer));
+            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_lora_ids_out->buffer));
+            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_lora_scale_out->buffer));
+
+            const int32_t * out_ids = (const int32_t *) lctx.inp_out_ids->data;
+
+            int32_t * ids_out   = (int32_t *) lctx.inp_lora_ids_out->data;
+            float   * scale_out = (float   *) lctx.inp_lora_scale_out->data;
+
+            for (int64_t i = 0; i < lctx.n_outputs; ++i) {
+                memcpy(ids_out   + i*n_used, ids.data()   + out_ids[i]*n_used, n_used*sizeof(int32_t));
+                memcpy(scale_out + i*n_used, scale.data() + out_ids[i]*n_used, n_used*sizeof(float));
+            }
+        }
+    }
+}
+
+bool llama_lora_seq_update(struct llama_context & lctx) {
+    std::vector<llama_adapter_lora *> adapters;
+    bool stacked = true;
+
+    for (const auto & it : lctx.lora_seq) {
+        for (const auto & la : it.second) {
+            if (std::find(adapters.begin(), adapters.end(), la.first) == adapters.end()) {
+                adapters.push_back(la.first);
+                stacked = stacked && lctx.lora_stack.find(la.first) >= 0;
+            }
+        }
+    }
+
+    if (stacked) {
+        return true;
+    }
+
+    // the previous graph references the old stack
+    lctx.gf_prev = nullptr;
+
+    // the adapters that are no longer used by any sequence are dropped from the stack
+    try {
+        lctx.lora_stack.build(adapters);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to stack the LoRA adapters of the sequences: %s\n", __func__, err.what());
+        lctx.lora_stack.build({});
+        return false;
+    }
+
+    return true;
+}
+
+int32_t llama_lora_seq_n_used(const struct llama_context & lctx, const llama_ubatch * ubatch) {
+    size_t n_used = 0;
+
+    if (ubatch == nullptr) {
+        for (const auto & it : lctx.lora_seq) {
+            n_used = std::max(n_used, it.second.size());
+        }
+    } else {
+        for (uint32_t s = 0; s < ubatch->n_seqs; ++s) {
+            const auto it = lctx.lora_seq.find(llama_ubatch_seq_id_batch(lctx, ubatch->seq_id[s][0]));
+            if (it != lctx.lora_seq.end()) {
+                n_used = std::max(n_used, it->second.size());
+            }
+        }
+    }
+
+    return n_used;
 }
 
 // llama output
@@ -660,6 +796,12 @@ void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched.get());
 
+    // nothing was evaluated since the last synchronization
+    // return without modifying the context, so that the outputs can be read from multiple threads
+    if (ctx->n_queued_tokens == 0) {
+        return;
+    }
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -14,6 +14,36 @@
 #include <vector>
 #include <set>
 
+// parameters that determine the topology of a decode graph
+// if they match the parameters of the previous ubatch, the previous graph can be reused
+// changes of the adapters invalidate the previous graph directly
+struct llama_graph_params {
+    uint32_t n_tokens     = 0;
+    uint32_t n_seq_tokens = 0;
+    uint32_t n_seqs       = 0;
+    int32_t  n_outputs    = 0;
+    int32_t  n_lora_seq   = 0;
+    uint32_t n_kv         = 0;
+    uint32_t kv_base      = 0;
+
+    bool embd        = false; // input embeddings instead of tokens
+    bool embeddings  = false;
+    bool causal_attn = false;
+
+    bool operator==(const llama_graph_params & other) const {
+        return n_tokens     == other.n_tokens     &&
+               n_seq_tokens == other.n_seq_tokens &&
+               n_seqs       == other.n_seqs       &&
+               n_outputs    == other.n_outputs    &&
+               n_lora_seq   == other.n_lora_seq   &&
+               n_kv         == other.n_kv         &&
+               kv_base      == other.kv_base      &&
+               embd         == other.embd         &&
+               embeddings   == other.embeddings   &&
+               causal_attn  == other.causal_attn;
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -29,6 +59,12 @@ struct llama_context {
 
     std::unordered_map<struct llama_adapter_lora *, float> lora;
 
+    // adapters of the individual sequences, applied with lora_stack
+    std::map<llama_seq_id, std::unordered_map<struct llama_adapter_lora *, float>> lora_seq;
+    struct llama_adapter_lora_stack lora_stack;
+
+    int32_t n_lora_seq = 0; // max. number of adapters of a sequence in the current ubatch
+
     std::vector<ggml_backend_ptr> backends;
     std::vector<std::pair<ggml_backend_t, ggml_backend_set_n_threads_t>> set_n_threads_fns;
 
@@ -49,6 +85,7 @@ struct llama_context {
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_reused = 0; // number of decodes that reused gf_prev
 
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
@@ -88,6 +125,19 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_ptr sched;
 
+    // the last decode graph, still allocated in the scheduler
+    // must be reset to nullptr whenever another graph is built or the adapters change
+    struct ggml_cgraph * gf_prev = nullptr;
+
+    bool graph_reuse = true; // false if LLAMA_GRAPH_REUSE_DISABLE is set when the context is created
+
+    llama_graph_params gf_prev_params;
+
+    // the tensors that store the new KV cells in gf_prev, and their offset per cell
+    // they are moved to the new kv_self.head when the graph is reused
+    std::vector<std::pair<struct ggml_tensor *, size_t>> gf_prev_kv_stores;
+    uint32_t gf_prev_kv_head = 0;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -107,6 +157,11 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_lora_ids;      // I32 [n_lora_seq, n_batch]
+    struct ggml_tensor * inp_lora_scale;    // F32 [1, n_lora_seq, n_batch]
+    struct ggml_tensor * inp_lora_ids_out;  // I32 [n_lora_seq, n_outputs]
+    struct ggml_tensor * inp_lora_scale_out; // F32 [1, n_lora_seq, n_outputs]
+    struct ggml_tensor * inp_lora_rows;     // I32 [n_lora_seq*n_batch]
 };
 
 // TODO: make these methods of llama_context
@@ -116,6 +171,12 @@ void llama_set_s_copy(struct llama_context & lctx);
 
 void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch);
 
+// stack the adapters of the sequences that are not stacked yet, returns false on failure
+bool llama_lora_seq_update(struct llama_context & lctx);
+
+// max. number of adapters of a sequence in the ubatch, or of any sequence if ubatch is nullptr
+int32_t llama_lora_seq_n_used(const struct llama_context & lctx, const llama_ubatch * ubatch);
+
 // Make sure enough space is available for outputs.
 // Returns max number of outputs for which space was reserved.
 size_t llama_output_reserve(struct llama_context & lctx, size_t n_outputs);
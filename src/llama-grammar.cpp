@@ -823,11 +823,13 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
-    llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
-
-    for (const auto & stack : grammar->stacks) {
+// produces the stacks that result from accepting chr at the given stacks
+static void llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        const uint32_t               chr,
+              llama_grammar_stacks & stacks_new) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,9 +843,16 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
         }
     }
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    llama_grammar_stacks stacks_new;
+    stacks_new.reserve(grammar->stacks.size());
+
+    llama_grammar_accept_chr(grammar->rules, grammar->stacks, chr, stacks_new);
 
     grammar->stacks = std::move(stacks_new);
 }
@@ -903,6 +912,191 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// compiled grammar
+//
+
+static std::shared_ptr<const llama_grammar_trie> llama_grammar_build_trie(const llama_vocab & vocab) {
+    auto result = std::make_shared<llama_grammar_trie>();
+
+    auto & nodes = result->nodes;
+    nodes.emplace_back();
+
+    result->n_vocab = vocab.n_tokens();
+
+    for (llama_token id = 0; id < (llama_token) result->n_vocab; ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+
+        // these tokens are handled separately by llama_grammar_apply_impl
+        if (vocab.is_eog(id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        const auto decoded = decode_utf8(piece, {});
+
+        uint32_t inode = 0;
+        for (const uint32_t * cp = decoded.first.data(); *cp != 0; ++cp) {
+            auto & children = nodes[inode].children;
+
+            auto it = std::lower_bound(children.begin(), children.end(), std::make_pair(*cp, 0u),
+                    [](const std::pair<uint32_t, uint32_t> & a, const std::pair<uint32_t, uint32_t> & b) {
+                        return a.first < b.first;
+                    });
+
+            if (it == children.end() || it->first != *cp) {
+                const uint32_t inode_new = nodes.size();
+                children.insert(it, { *cp, inode_new });
+                nodes.emplace_back(); // invalidates children
+                inode = inode_new;
+            } else {
+                inode = it->second;
+            }
+        }
+
+        nodes[inode].tokens.emplace_back(id, decoded.second);
+    }
+
+    return result;
+}
+
+// returns the compiled state for the given source, shared by all live grammars with the same source and vocab
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_get_compiled(const llama_vocab * vocab, const std::string & source) {
+    // the weak references expire with the last grammar that uses them, which must not outlive the vocab
+    static std::mutex mutex;
+    static std::map<const llama_vocab *, std::weak_ptr<const llama_grammar_trie>> tries;
+    static std::map<std::pair<const llama_vocab *, std::string>, std::weak_ptr<llama_grammar_compiled>> compiled;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = compiled.begin(); it != compiled.end(); ) {
+        it = it->second.expired() ? compiled.erase(it) : std::next(it);
+    }
+
+    for (auto it = tries.begin(); it != tries.end(); ) {
+        it = it->second.expired() ? tries.erase(it) : std::next(it);
+    }
+
+    auto result = compiled[{ vocab, source }].lock();
+    if (result) {
+        return result;
+    }
+
+    auto trie = tries[vocab].lock();
+    if (!trie) {
+        const int64_t t_start_us = ggml_time_us();
+
+        trie = llama_grammar_build_trie(*vocab);
+        tries[vocab] = trie;
+
+        LLAMA_LOG_DEBUG("%s: built the grammar trie with %zu nodes in %.2f ms\n", __func__, trie->nodes.size(), (ggml_time_us() - t_start_us)/1000.0);
+    }
+
+    result = std::make_shared<llama_grammar_compiled>();
+    result->trie = std::move(trie);
+
+    compiled[{ vocab, source }] = result;
+
+    return result;
+}
+
+// identifies the elements of the stacks by their offsets in the rules
+static std::vector<std::vector<uint32_t>> llama_grammar_stacks_key(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks) {
+    std::vector<std::vector<uint32_t>> result(stacks.size());
+
+    for (size_t is = 0; is < stacks.size(); ++is) {
+        result[is].reserve(stacks[is].size());
+
+        for (const llama_grammar_element * pos : stacks[is]) {
+            uint32_t offs = 0;
+            for (const auto & rule : rules) {
+                if (pos >= rule.data() && pos < rule.data() + rule.size()) {
+                    offs += pos - rule.data();
+                    break;
+                }
+                offs += rule.size();
+            }
+            result[is].push_back(offs);
+        }
+    }
+
+    return result;
+}
+
+// marks the tokens in the subtree of the trie node that are accepted by at least one of the stacks
+static void llama_grammar_walk_trie(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_trie   & trie,
+        uint32_t                     inode,
+        const llama_grammar_stacks & stacks,
+        std::vector<uint64_t>      & allowed) {
+    const auto & node = trie.nodes[inode];
+
+    for (const auto & tok : node.tokens) {
+        const llama_partial_utf8 & partial_utf8 = tok.second;
+
+        for (const auto & stack : stacks) {
+            // a token that ends in an incomplete sequence must be able to continue at this position
+            if (partial_utf8.n_remain == 0 || (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial_utf8))) {
+                allowed[tok.first / 64] |= uint64_t(1) << (tok.first % 64);
+                break;
+            }
+        }
+    }
+
+    llama_grammar_stacks stacks_new;
+
+    for (const auto & child : node.children) {
+        stacks_new.clear();
+
+        llama_grammar_accept_chr(rules, stacks, child.first, stacks_new);
+
+        if (!stacks_new.empty()) {
+            llama_grammar_walk_trie(rules, trie, child.second, stacks_new, allowed);
+        }
+    }
+}
+
+// returns the bitset of the non-EOG tokens allowed by the grammar, computing it if needed
+// returns nullptr if the bitset is not cached and compute is false
+static std::shared_ptr<const std::vector<uint64_t>> llama_grammar_get_allowed(const struct llama_grammar & grammar, bool compute) {
+    // limit the memory of the cache - a bitset for a 256k vocab takes 32 kB
+    constexpr size_t max_states = 256;
+
+    auto & compiled = *grammar.compiled;
+
+    auto key = llama_grammar_stacks_key(grammar.rules, grammar.stacks);
+
+    {
+        std::lock_guard<std::mutex> lock(compiled.mutex);
+
+        auto it = compiled.allowed.find(key);
+        if (it != compiled.allowed.end()) {
+            return it->second;
+        }
+    }
+
+    if (!compute) {
+        return nullptr;
+    }
+
+    const auto & trie = *compiled.trie;
+
+    auto allowed = std::make_shared<std::vector<uint64_t>>((trie.n_vocab + 63)/64, 0);
+    llama_grammar_walk_trie(grammar.rules, trie, 0, grammar.stacks, *allowed);
+
+    std::lock_guard<std::mutex> lock(compiled.mutex);
+
+    if (compiled.allowed.size() >= max_states) {
+        compiled.allowed.clear();
+    }
+
+    compiled.allowed[std::move(key)] = allowed;
+
+    return allowed;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -960,7 +1154,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, nullptr, };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1035,10 +1229,15 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
         }
     } while (true);
 
+    std::shared_ptr<llama_grammar_compiled> compiled;
+    if (vocab) {
+        compiled = llama_grammar_get_compiled(vocab, std::string(grammar_str) + '\0' + grammar_root);
+    }
+
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, std::move(compiled), };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1055,6 +1254,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.rules,
         grammar.stacks,
         grammar.partial_utf8,
+        grammar.compiled,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1084,6 +1284,32 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // the compiled tokens assume that the previous token did not end in an incomplete UTF-8 sequence
+    if (grammar.compiled && grammar.partial_utf8.n_remain == 0) {
+        // walking the trie visits each prefix once for all candidates, but is only worth it for the full vocab
+        // with few candidates (e.g. checking the sampled token), only use the allowed tokens if already known
+        const bool compute = cur_p->size >= grammar.compiled->trie->n_vocab/2;
+
+        const auto allowed = llama_grammar_get_allowed(grammar, compute);
+        if (allowed) {
+            const auto & bits = *allowed;
+
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const llama_token id = cur_p->data[i].id;
+
+                if (grammar.vocab->is_eog(id)) {
+                    if (!allow_eog) {
+                        cur_p->data[i].logit = -INFINITY;
+                    }
+                } else if (!((bits[id / 64] >> (id % 64)) & 1)) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -3,6 +3,8 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -105,6 +107,32 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// trie over the code points of the vocab pieces, built once per vocab
+struct llama_grammar_trie {
+    struct node {
+        std::vector<std::pair<uint32_t, uint32_t>> children; // code point -> node index, sorted
+
+        // tokens whose complete code points end at this node, with their trailing incomplete UTF-8 sequence
+        std::vector<std::pair<llama_token, llama_partial_utf8>> tokens;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+
+    uint32_t n_vocab = 0;
+};
+
+// state shared by all grammars with the same source and vocab:
+// the tokens allowed by each set of stacks are computed once with a walk over the trie and cached as a bitset
+struct llama_grammar_compiled {
+    std::shared_ptr<const llama_grammar_trie> trie;
+
+    std::mutex mutex;
+
+    // stacks are keyed by the offsets of their elements in the rules, so that the cache can be shared by the
+    // grammars with identical rules
+    std::map<std::vector<std::vector<uint32_t>>, std::shared_ptr<const std::vector<uint64_t>>> allowed;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
@@ -114,6 +142,9 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // null if the grammar was not created from a string with a vocab
+    std::shared_ptr<llama_grammar_compiled> compiled;
 };
 
 //
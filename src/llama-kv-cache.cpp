@@ -99,6 +99,11 @@ bool llama_kv_cache_init(
         cache.v_l.push_back(v);
     }
 
+    // an empty cache keeps its tensors for the state functions, but has nothing to allocate
+    if (kv_size == 0) {
+        return true;
+    }
+
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
     for (auto it : ctx_map) {
         auto * buft = it.first;
@@ -350,6 +355,43 @@ uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+std::pair<uint32_t, uint32_t> llama_kv_cache_seq_window(
+     const struct llama_kv_cache & cache,
+       const struct llama_ubatch & ubatch,
+                        uint32_t   pad) {
+    // the new tokens are always stored in [head, head + n_tokens)
+    uint32_t begin = cache.head;
+    uint32_t end   = cache.head + ubatch.n_tokens;
+
+    std::set<llama_seq_id> seq_ids;
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            seq_ids.insert(ubatch.seq_id[s][j]);
+        }
+    }
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+
+        if (cell.pos < 0 || (i >= begin && i < end)) {
+            continue;
+        }
+
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            if (seq_ids.find(seq_id) != seq_ids.end()) {
+                begin = std::min(begin, i);
+                end   = std::max(end,   i + 1);
+                break;
+            }
+        }
+    }
+
+    begin = (begin/pad)*pad;
+    end   = std::min(cache.size, GGML_PAD(end, pad));
+
+    return { begin, end };
+}
+
 void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
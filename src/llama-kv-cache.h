@@ -44,7 +44,9 @@ struct llama_kv_cache {
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
     // computed before each graph build
-    uint32_t n = 0;
+    // the attention only considers the cells in [base, base + n)
+    uint32_t base = 0;
+    uint32_t n    = 0;
 
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
@@ -112,6 +114,14 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
 // find how many cells are currently in use
 uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache);
 
+// find the range of cells [begin, end) that the sequences in the batch can attend to
+// the range includes the slot at cache.head and its boundaries are aligned to "pad" cells
+// cells outside of it belong only to other sequences and can be skipped by the attention
+std::pair<uint32_t, uint32_t> llama_kv_cache_seq_window(
+     const struct llama_kv_cache & cache,
+       const struct llama_ubatch & ubatch,
+                        uint32_t   pad);
+
 void llama_kv_cache_clear(struct llama_kv_cache & cache);
 
 bool llama_kv_cache_seq_rm(
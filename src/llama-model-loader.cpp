@@ -976,6 +976,10 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // with --numa partition, the rows of the weights in host memory are moved to the nodes of the threads that use them
+    auto * cpu_reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+    auto * numa_place_fn = (decltype(ggml_numa_place_tensor) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_numa_place_tensor");
+
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
@@ -1060,6 +1064,10 @@ bool llama_model_loader::load_all_data(
             }
         }
 
+        if (numa_place_fn && cur->buffer && ggml_backend_buffer_is_host(cur->buffer)) {
+            numa_place_fn(cur);
+        }
+
         size_done += n_size;
     }
 
@@ -301,7 +301,8 @@ static buft_list_t make_cpu_buft_list(const std::vector<ggml_backend_dev_t> & de
 }
 
 // GPU: split if LLAMA_SPLIT_MODE_ROW -> GPU
-static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, enum llama_split_mode split_mode, const float * tensor_split) {
+// tensor_split is indexed by the devices of the model
+static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, enum llama_split_mode split_mode, const float * tensor_split, const std::vector<ggml_backend_dev_t> & devices) {
     buft_list_t buft_list;
 
     // add the device split buffer type if requested and available
@@ -319,7 +320,44 @@ static buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, enum llama_split_m
                 }
                 throw std::runtime_error(format("device %s not found in its backend reg", ggml_backend_dev_name(dev)));
             }();
-            auto * buft = ggml_backend_split_buffer_type_fn(dev_index, tensor_split);
+            // the backend expects the split indexed by the devices of its reg, which are usually the devices of the
+            // model: then the split is passed through, and an all-zero split keeps the default split of the backend
+            bool same_devices = ggml_backend_reg_dev_count(reg) == devices.size();
+            for (size_t i = 0; same_devices && i < devices.size(); ++i) {
+                same_devices = ggml_backend_reg_dev_get(reg, i) == devices[i];
+            }
+            // otherwise (e.g. RPC servers used together with local GPUs, or a subset selected with --device) the split
+            // is remapped to the devices of the reg and made explicit, so that the devices that are not used by the
+            // model get no rows, also with the default split by free memory
+            std::vector<float> reg_split;
+            if (!same_devices) {
+                const bool all_zero = tensor_split == nullptr || std::all_of(tensor_split, tensor_split + devices.size(), [](float x) { return x == 0.0f; });
+                reg_split.resize(ggml_backend_reg_dev_count(reg), 0.0f);
+                for (size_t i = 0; i < reg_split.size(); ++i) {
+                    ggml_backend_dev_t reg_dev = ggml_backend_reg_dev_get(reg, i);
+                    auto it = std::find(devices.begin(), devices.end(), reg_dev);
+                    if (it == devices.end()) {
+                        continue;
+                    }
+                    if (all_zero) {
+                        size_t total;
+                        size_t free;
+                        ggml_backend_dev_memory(reg_dev, &free, &total);
+                        reg_split[i] = free;
+                    } else {
+                        reg_split[i] = tensor_split[it - devices.begin()];
+                    }
+                }
+                if (std::all_of(reg_split.begin(), reg_split.end(), [](float x) { return x == 0.0f; })) {
+                    // no memory information, split evenly among the devices of the model
+                    for (size_t i = 0; i < reg_split.size(); ++i) {
+                        if (std::find(devices.begin(), devices.end(), ggml_backend_reg_dev_get(reg, i)) != devices.end()) {
+                            reg_split[i] = 1.0f;
+                        }
+                    }
+                }
+            }
+            auto * buft = ggml_backend_split_buffer_type_fn(dev_index, same_devices ? tensor_split : reg_split.data());
             if (buft != nullptr) {
                 buft_list.emplace_back(dev, buft);
             }
@@ -1266,7 +1304,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     // build a list of buffer types for the CPU and GPU devices
     pimpl->cpu_buft_list = make_cpu_buft_list(devices);
     for (auto * dev : devices) {
-        buft_list_t buft_list = make_gpu_buft_list(dev, split_mode, tensor_split);
+        buft_list_t buft_list = make_gpu_buft_list(dev, split_mode, tensor_split, devices);
         // add CPU buffer types as a fallback
         buft_list.insert(buft_list.end(), pimpl->cpu_buft_list.begin(), pimpl->cpu_buft_list.end());
         pimpl->gpu_buft_list.emplace(dev, std::move(buft_list));
@@ -3999,3 +4037,7 @@ bool llama_model_is_recurrent(const struct llama_model * model) {
         default:              return false;
     }
 }
+
+bool llama_model_is_non_causal(const struct llama_model * model) {
+    return !model->hparams.causal_attn;
+}
@@ -314,6 +314,8 @@ static uint32_t get_rng_seed(uint32_t seed) {
     return seed;
 }
 
+static bool llama_sampler_is_chain(const struct llama_sampler * smpl);
+
 // llama_sampler API
 
 const char * llama_sampler_name(const struct llama_sampler * smpl) {
@@ -376,19 +378,26 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
 
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
+    llama_token_data_array cur_p;
 
-    llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
-        /* .selected   = */ -1,
-        /* .sorted     = */ false,
-    };
+    if (llama_sampler_is_chain(smpl)) {
+        cur_p = llama_sampler_chain_candidates(smpl, logits, n_vocab);
+    } else {
+        // other samplers do not own a candidates buffer
+        static thread_local std::vector<llama_token_data> cur;
+
+        cur.resize(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
+
+        cur_p = {
+            /* .data       = */ cur.data(),
+            /* .size       = */ cur.size(),
+            /* .selected   = */ -1,
+            /* .sorted     = */ false,
+        };
+    }
 
     llama_sampler_apply(smpl, &cur_p);
 
@@ -471,12 +480,17 @@ static struct llama_sampler_i llama_sampler_chain_i = {
     /* .free   = */ llama_sampler_chain_free,
 };
 
+static bool llama_sampler_is_chain(const struct llama_sampler * smpl) {
+    return smpl->iface == &llama_sampler_chain_i;
+}
+
 struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_params params) {
     return new llama_sampler {
         /* .iface = */ &llama_sampler_chain_i,
         /* .ctx   = */ new llama_sampler_chain {
             /* .params      = */ params,
             /* .samplers    = */ {},
+            /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
         },
@@ -2372,6 +2386,83 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
     return LLAMA_DEFAULT_SEED;
 }
 
+// returns the k of the top-k sampler at the start of the chain, skipping samplers that have no effect with their parameters
+// returns 0 if the candidates cannot be pre-selected
+static int32_t llama_sampler_chain_top_k(const struct llama_sampler_chain * chain) {
+    for (const auto * smpl : chain->samplers) {
+        if (smpl->iface == &llama_sampler_top_k_i) {
+            return ((const llama_sampler_top_k *) smpl->ctx)->k;
+        }
+
+        if (smpl->iface == &llama_sampler_logit_bias_i) {
+            const auto * ctx = (const llama_sampler_logit_bias *) smpl->ctx;
+            if (ctx->logit_bias.empty()) {
+                continue;
+            }
+        }
+
+        if (smpl->iface == &llama_sampler_penalties_i) {
+            const auto * ctx = (const llama_sampler_penalties *) smpl->ctx;
+            if ((ctx->penalty_last_n == 0) ||
+                (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f)) {
+                continue;
+            }
+        }
+
+        if (smpl->iface == &llama_sampler_dry_i) {
+            const auto * ctx = (const llama_sampler_dry *) smpl->ctx;
+            if (ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0) {
+                continue;
+            }
+        }
+
+        return 0;
+    }
+
+    return 0;
+}
+
+llama_token_data_array llama_sampler_chain_candidates(struct llama_sampler * chain, const float * logits, int32_t n_vocab) {
+    GGML_ASSERT(llama_sampler_is_chain(chain));
+
+    auto & cur = ((llama_sampler_chain *) chain->ctx)->cur;
+
+    const int32_t k = llama_sampler_chain_top_k((const llama_sampler_chain *) chain->ctx);
+
+    // for large k the bucket sort of the top-k sampler is faster than a heap
+    if (k <= 0 || k > 128 || k >= n_vocab) {
+        cur.resize(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
+
+        return { cur.data(), cur.size(), -1, false };
+    }
+
+    // keep the k largest logits in a min-heap while scanning the row
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    cur.resize(k);
+    for (llama_token token_id = 0; token_id < k; token_id++) {
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+    std::make_heap(cur.begin(), cur.end(), comp);
+
+    for (llama_token token_id = k; token_id < n_vocab; token_id++) {
+        if (logits[token_id] > cur.front().logit) {
+            std::pop_heap(cur.begin(), cur.end(), comp);
+            cur.back() = llama_token_data{token_id, logits[token_id], 0.0f};
+            std::push_heap(cur.begin(), cur.end(), comp);
+        }
+    }
+
+    std::sort_heap(cur.begin(), cur.end(), comp);
+
+    return { cur.data(), cur.size(), -1, true };
+}
+
 // perf
 
 struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * chain) {
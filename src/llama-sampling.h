@@ -16,6 +16,9 @@ struct llama_sampler_chain {
 
     std::vector<struct llama_sampler *> samplers;
 
+    // candidates buffer, reused by llama_sampler_sample and llama_sampler_chain_candidates
+    std::vector<llama_token_data> cur;
+
     // timing
 
     mutable int64_t t_sample_us;
@@ -6,15 +6,23 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -254,6 +262,11 @@ public:
     }
 
     void pop() =  delete;
+
+    // keep the storage for reuse
+    void clear() {
+        this->c.clear();
+    }
 };
 
 struct llm_bigram_bpe {
@@ -267,11 +280,129 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_token id; // the merged token, LLAMA_TOKEN_NULL if the merged text is not a token
     int rank;
     size_t size;
 };
 
+// BPE merges keyed by the token ids of the pair, in a flat open-addressing hash table
+struct llm_bpe_merges {
+    struct entry {
+        uint64_t    key;  // (left << 32) | right, EMPTY for unused slots
+        int32_t     rank;
+        llama_token id;   // the merged token
+    };
+
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+
+    static uint64_t make_key(llama_token left, llama_token right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    void init(size_t n_merges) {
+        size_t n_slots = 16;
+        while (n_slots < 2*n_merges) {
+            n_slots *= 2;
+        }
+        entries.assign(n_slots, { EMPTY, -1, LLAMA_TOKEN_NULL });
+    }
+
+    void insert(llama_token left, llama_token right, int32_t rank, llama_token id) {
+        const uint64_t key  = make_key(left, right);
+        const size_t   mask = entries.size() - 1;
+
+        size_t i = hash(key) & mask;
+        while (entries[i].key != EMPTY) {
+            if (entries[i].key == key) {
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        entries[i] = { key, rank, id };
+    }
+
+    const entry * find(llama_token left, llama_token right) const {
+        if (entries.empty()) {
+            return nullptr;
+        }
+
+        const uint64_t key  = make_key(left, right);
+        const size_t   mask = entries.size() - 1;
+
+        for (size_t i = hash(key) & mask; entries[i].key != EMPTY; i = (i + 1) & mask) {
+            if (entries[i].key == key) {
+                return &entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<entry> entries;
+};
+
+// LRU cache of the tokens of pre-tokenized words
+// the words are spread over shards with their own lock and LRU list, so that threads tokenizing in parallel rarely
+// wait for each other
+struct llm_bpe_word_cache {
+    static constexpr size_t N_SHARDS     = 16;
+    static constexpr size_t MAX_WORDS    = 32768; // over all shards
+    static constexpr size_t MAX_WORD_LEN = 128;
+
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        shard & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+
+        auto it = sh.index.find(word);
+        if (it == sh.index.end()) {
+            return false;
+        }
+        sh.words.splice(sh.words.begin(), sh.words, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (word.size() > MAX_WORD_LEN) {
+            return;
+        }
+
+        shard & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+
+        if (sh.index.find(word) != sh.index.end()) {
+            return;
+        }
+        if (sh.words.size() >= MAX_WORDS / N_SHARDS) {
+            sh.index.erase(sh.words.back().first);
+            sh.words.pop_back();
+        }
+        sh.words.emplace_front(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+        sh.index.emplace(sh.words.front().first, sh.words.begin());
+    }
+
+private:
+    struct shard {
+        std::mutex mutex;
+
+        // most recently used first, the index points into the list nodes
+        std::list<std::pair<std::string, std::vector<llama_token>>> words;
+        std::unordered_map<std::string_view, decltype(words)::iterator> index;
+    };
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string_view>{}(word) % N_SHARDS];
+    }
+
+    std::array<shard, N_SHARDS> shards;
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
@@ -405,6 +536,8 @@ struct llm_tokenizer_bpe : llm_tokenizer {
     }
 
     std::vector<std::string> regex_exprs;
+
+    mutable llm_bpe_word_cache cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -448,133 +581,128 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (tokenizer.cache.get(word, output)) {
+                continue;
+            }
+
+            const size_t n_output = output.size();
+
+            tokenize_word(word, output);
 
-            int index = 0;
-            size_t offset = 0;
+            tokenizer.cache.put(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
+
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue.clear();
+        symbols.clear();
+        symbol_ids.clear();
+
+        int index = 0;
+        size_t offset = 0;
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges()) {
+            const llama_token id = vocab.text_to_token(word);
+            if (id != LLAMA_TOKEN_NULL) {
                 symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+                symbol_ids.push_back(id);
                 offset = word.size();
             }
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
-
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(vocab.text_to_token(std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            // symbols only grow, so the bigram is outdated if any of its sides has changed
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
+            }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
-
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (symbol_ids[i] == LLAMA_TOKEN_NULL) {
+                for (size_t j = 0; j < symbol.n; ++j) {
+                    std::string byte_str(1, symbol.text[j]);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(symbol_ids[i]);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
-            return;
-        }
 
         llm_bigram_bpe bigram;
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.size  = symbols[left].n + symbols[right].n;
+
+        if (symbol_ids[left] != LLAMA_TOKEN_NULL && symbol_ids[right] != LLAMA_TOKEN_NULL) {
+            bigram.rank = vocab.find_bpe_rank(symbol_ids[left], symbol_ids[right], bigram.id);
+        } else {
+            // merges of texts that are not tokens are not in the id table
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            bigram.rank = vocab.find_bpe_rank(left_token, right_token);
+            bigram.id   = bigram.rank < 0 ? LLAMA_TOKEN_NULL : vocab.text_to_token(left_token + right_token);
+        }
+
+        if (bigram.rank < 0) {
+            return;
+        }
 
         work_queue.push(bigram);
     }
@@ -582,8 +710,8 @@ private:
     const llama_vocab & vocab;
     const llm_tokenizer_bpe & tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>  symbols;
+    std::vector<llama_token> symbol_ids; // token of each symbol, LLAMA_TOKEN_NULL if its text is not a token
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1201,6 +1329,89 @@ struct fragment_buffer_variant {
     const uint64_t length;
 };
 
+// the worker threads of llama_vocab::tokenize_batch, started on first use and reused by the following calls
+struct llm_tokenizer_pool {
+    ~llm_tokenizer_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_start.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    // runs job on the calling thread and on n_threads - 1 workers, and waits for all of them
+    // returns false without running the job if the pool is in use by a concurrent call
+    bool run(int32_t n_threads, const std::function<void()> & job) {
+        std::unique_lock<std::mutex> busy_lock(busy, std::try_to_lock);
+        if (!busy_lock.owns_lock()) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int32_t) threads.size() < n_threads - 1) {
+                // a new worker must not miss the generation started below
+                threads.emplace_back(&llm_tokenizer_pool::worker, this, (int32_t) threads.size(), generation);
+            }
+            cur       = &job;
+            n_active  = n_threads - 1;
+            n_pending = n_threads - 1;
+            generation++;
+        }
+        cv_start.notify_all();
+
+        job();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_pending == 0; });
+        cur = nullptr;
+
+        return true;
+    }
+
+private:
+    void worker(int32_t ith, uint64_t seen) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_start.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) {
+                return;
+            }
+            seen = generation;
+            if (ith >= n_active) {
+                continue;
+            }
+
+            const auto * job = cur;
+            lock.unlock();
+            (*job)();
+            lock.lock();
+
+            if (--n_pending == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    std::mutex busy; // held by the caller of run()
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    std::vector<std::thread> threads;
+
+    const std::function<void()> * cur = nullptr;
+
+    uint64_t generation = 0;
+    int32_t  n_active   = 0;
+    int32_t  n_pending  = 0;
+    bool     stop       = false;
+};
+
 struct llama_vocab::impl {
     uint32_t n_token_types = 0; // for BERT-style token types
 
@@ -1248,6 +1459,9 @@ struct llama_vocab::impl {
 
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
+    // the merges of bpe_ranks whose sides are both tokens
+    llm_bpe_merges bpe_merges;
+
     // set of all tokens that cause "end of generation"
     std::set<llama_token> special_eog_ids;
 
@@ -1255,6 +1469,8 @@ struct llama_vocab::impl {
 
     std::vector<char> precompiled_charsmap;
 
+    llm_tokenizer_pool pool;
+
     impl(const llama_vocab & vocab) : vocab(vocab) {
     }
 
@@ -1670,6 +1886,26 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     }
     GGML_ASSERT(id_to_token.size() == token_to_id.size());
 
+    if (type == LLAMA_VOCAB_TYPE_BPE) {
+        bpe_merges.init(bpe_ranks.size());
+
+        for (const auto & it : bpe_ranks) {
+            const auto & first  = it.first.first;
+            const auto & second = it.first.second;
+
+            const auto it_left  = token_to_id.find(first);
+            const auto it_right = token_to_id.find(second);
+            if (it_left == token_to_id.end() || it_right == token_to_id.end()) {
+                continue;
+            }
+
+            const auto it_merged = token_to_id.find(first + second);
+            const llama_token id = it_merged == token_to_id.end() ? LLAMA_TOKEN_NULL : it_merged->second;
+
+            bpe_merges.insert(it_left->second, it_right->second, it.second, id);
+        }
+    }
+
     init_tokenizer(type);
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
@@ -2945,6 +3181,17 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+int llama_vocab::find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const {
+    const auto * merge = pimpl->bpe_merges.find(token_left, token_right);
+    if (merge == nullptr) {
+        token_merged = LLAMA_TOKEN_NULL;
+        return -1;
+    }
+
+    token_merged = merge->id;
+    return merge->rank;
+}
+
 int32_t llama_vocab::tokenize(
                   const char * text,
                      int32_t   text_len,
@@ -2972,6 +3219,63 @@ std::vector<llama_token> llama_vocab::tokenize(
     return pimpl->tokenize(raw_text, add_special, parse_special);
 }
 
+int32_t llama_vocab::tokenize_batch(
+                  const char ** texts,
+                const int32_t * text_lens,
+                      int32_t   n_texts,
+                 llama_token ** tokens,
+                const int32_t * n_tokens_max,
+                      int32_t * n_tokens,
+                         bool   add_special,
+                         bool   parse_special,
+                      int32_t   n_threads) const {
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // small batches are not worth starting a thread for
+    int64_t n_bytes = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        n_bytes += text_lens[i];
+    }
+    n_threads = (int32_t) std::min<int64_t>({ (int64_t) n_threads, (int64_t) n_texts, 1 + n_bytes/16384 });
+
+    std::atomic<int32_t> i_next   = 0;
+    std::atomic<int32_t> n_failed = 0;
+
+    std::mutex         err_mutex;
+    std::exception_ptr err;
+
+    auto worker = [&]() {
+        try {
+            for (int32_t i = i_next++; i < n_texts; i = i_next++) {
+                n_tokens[i] = tokenize(texts[i], text_lens[i], tokens[i], n_tokens_max[i], add_special, parse_special);
+                if (n_tokens[i] < 0) {
+                    n_failed++;
+                }
+            }
+        } catch (...) {
+            // stop the other workers and rethrow on the calling thread
+            i_next = n_texts;
+            std::lock_guard<std::mutex> lock(err_mutex);
+            if (!err) {
+                err = std::current_exception();
+            }
+        }
+    };
+
+    // a concurrent call that finds the pool busy tokenizes its batch on its own thread
+    if (n_threads <= 1 || !pimpl->pool.run(n_threads, worker)) {
+        worker();
+    }
+
+    if (err) {
+        std::rethrow_exception(err);
+    }
+
+    return n_failed;
+}
+
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
@@ -3224,6 +3528,20 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_vocab * vocab,
+                 const char ** texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                llama_token ** tokens,
+               const int32_t * n_tokens_max,
+                     int32_t * n_tokens,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize_batch(texts, text_lens, n_texts, tokens, n_tokens_max, n_tokens, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
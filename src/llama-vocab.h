@@ -80,6 +80,7 @@ struct llama_vocab {
     int max_token_len() const;
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
+    int find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const;
 
     int32_t tokenize(
                    const char * text,
@@ -94,6 +95,18 @@ struct llama_vocab {
                          bool   add_special,
                          bool   parse_special = false) const;
 
+    // the vocab is shared read-only between the threads, each text uses its own tokenizer session
+    int32_t tokenize_batch(
+                  const char ** texts,
+                const int32_t * text_lens,
+                      int32_t   n_texts,
+                 llama_token ** tokens,
+                const int32_t * n_tokens_max,
+                      int32_t * n_tokens,
+                         bool   add_special,
+                         bool   parse_special,
+                      int32_t   n_threads) const;
+
     // does not write null-terminator to buf
     int32_t token_to_piece(
                   llama_token   token,
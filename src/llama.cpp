@@ -106,6 +106,45 @@ enum llm_norm_type {
     LLM_NORM_GROUP,
 };
 
+// the per-token adapter ids and scales of the per-sequence adapters, for all the tokens of the ubatch or only its outputs
+static void llm_build_inp_lora_seq(
+        struct llama_context & lctx,
+         struct ggml_context * ctx,
+                     int64_t   n_rows,
+                        bool   outputs,
+         struct ggml_tensor *& ids,
+         struct ggml_tensor *& scale) {
+    struct ggml_tensor *& inp_ids   = outputs ? lctx.inp_lora_ids_out   : lctx.inp_lora_ids;
+    struct ggml_tensor *& inp_scale = outputs ? lctx.inp_lora_scale_out : lctx.inp_lora_scale;
+
+    if (!inp_ids) {
+        inp_ids   = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, lctx.n_lora_seq, n_rows);
+        inp_scale = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 1, lctx.n_lora_seq, n_rows);
+        ggml_set_name(inp_ids,   outputs ? "inp_lora_ids_out"   : "inp_lora_ids");
+        ggml_set_name(inp_scale, outputs ? "inp_lora_scale_out" : "inp_lora_scale");
+        ggml_set_input(inp_ids);
+        ggml_set_input(inp_scale);
+    }
+
+    ids   = inp_ids;
+    scale = inp_scale;
+}
+
+// scale the per-adapter results ab [n_out, n_lora_seq, n_rows] and sum them up
+static struct ggml_tensor * llm_build_lora_seq_sum(
+         struct ggml_context * ctx,
+          struct ggml_tensor * ab,
+          struct ggml_tensor * scale) {
+    ab = ggml_mul(ctx, ab, scale);
+
+    struct ggml_tensor * res = ggml_view_2d(ctx, ab, ab->ne[0], ab->ne[2], ab->nb[2], 0);
+    for (int64_t i = 1; i < ab->ne[1]; ++i) {
+        res = ggml_add(ctx, res, ggml_view_2d(ctx, ab, ab->ne[0], ab->ne[2], ab->nb[2], i*ab->nb[1]));
+    }
+
+    return res;
+}
+
 static struct ggml_tensor * llm_build_inp_embd(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -138,6 +177,29 @@ static struct ggml_tensor * llm_build_inp_embd(
             ), scale);
             inpL = ggml_add(ctx, inpL, inpL_delta);
         }
+
+        // apply the per-sequence adapters, see llm_build_lora_seq_mm
+        const auto * lsw = lctx.n_lora_seq > 0 ? lctx.lora_stack.get_weight(tok_embd) : nullptr;
+        if (lsw) {
+            const int64_t n_used = lctx.n_lora_seq;
+            const int64_t r_max  = lsw->a->ne[0];
+
+            struct ggml_tensor * ids;
+            struct ggml_tensor * scale;
+            llm_build_inp_lora_seq(lctx, ctx, ubatch.n_tokens, false, ids, scale);
+
+            lctx.inp_lora_rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_used*ubatch.n_tokens);
+            ggml_set_name(lctx.inp_lora_rows, "inp_lora_rows");
+            ggml_set_input(lctx.inp_lora_rows);
+
+            // non-transposed lora_a of all the adapters, see llama_adapter_lora_stack
+            struct ggml_tensor * a = ggml_reshape_2d(ctx, lsw->a, r_max, lsw->a->ne[1]*lsw->a->ne[2]);
+            struct ggml_tensor * x = ggml_get_rows(ctx, a, lctx.inp_lora_rows);
+
+            x = ggml_reshape_3d(ctx, x, r_max, n_used, ubatch.n_tokens);
+
+            inpL = ggml_add(ctx, inpL, llm_build_lora_seq_sum(ctx, ggml_mul_mat_id(ctx, lsw->b, x, ids), scale));
+        }
     } else {
         lctx.inp_embd = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         inpL = lctx.inp_embd;
@@ -198,6 +260,80 @@ static void llm_build_kv_store(
     ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
+// apply the per-sequence adapters of the tokens to the result of a mat_mul
+// the adapters are selected per token with mul_mat_id over the stacked adapters, so that the sequences of a batch can
+// use different adapters - the tokens are the outer dimensions of cur, either all the tokens of the ubatch or only its
+// outputs, and the inner rows of a token use its adapters, e.g. the heads of [n_embd_head, n_head, n_tokens]
+static struct ggml_tensor * llm_build_lora_seq_mm(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * cur,
+          struct ggml_tensor * res) {
+    const auto * lsw = lctx.n_lora_seq > 0 ? lctx.lora_stack.get_weight(w) : nullptr;
+    if (lsw == nullptr) {
+        return res;
+    }
+
+    const int64_t n_used    = lctx.n_lora_seq;
+    const int64_t n_rows    = ggml_nrows(cur);
+    const int64_t n_tokens  = lctx.inp_tokens ? lctx.inp_tokens->ne[0] : lctx.inp_embd ? lctx.inp_embd->ne[1] : -1;
+    const int64_t n_outputs = lctx.inp_out_ids ? lctx.inp_out_ids->ne[0] : -1;
+
+    int64_t n_tok   = 0;
+    bool    outputs = false;
+
+    for (int d = 1; d < GGML_MAX_DIMS && n_tok == 0; ++d) {
+        int64_t n = 1;
+        for (int i = d; i < GGML_MAX_DIMS; ++i) {
+            n *= cur->ne[i];
+        }
+
+        if (n == n_tokens) {
+            n_tok = n;
+        } else if (n == n_outputs) {
+            n_tok   = n;
+            outputs = true;
+        }
+    }
+
+    if (n_tok == 0) {
+        // the rows do not belong to a single token, e.g. pooled embeddings
+        GGML_ASSERT(ggml_n_dims(cur) <= 2 && "the outer dimensions of a LoRA input must be the tokens of the ubatch");
+        return res;
+    }
+
+    struct ggml_tensor * ids;
+    struct ggml_tensor * scale;
+
+    llm_build_inp_lora_seq(lctx, ctx0, n_tok, outputs, ids, scale);
+
+    const int64_t n_rows_tok = n_rows/n_tok;
+
+    if (n_rows_tok > 1) {
+        // each row of a token uses the adapters of the token
+        ids   = ggml_repeat(ctx0, ggml_reshape_3d(ctx0, ids,   n_used, 1, n_tok), ggml_new_tensor_3d(ctx0, GGML_TYPE_I32, n_used, n_rows_tok, n_tok));
+        scale = ggml_repeat(ctx0, ggml_reshape_3d(ctx0, scale, n_used, 1, n_tok), ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_used, n_rows_tok, n_tok));
+
+        ids   = ggml_reshape_2d(ctx0, ids,   n_used, n_rows);
+        scale = ggml_reshape_3d(ctx0, scale, 1, n_used, n_rows);
+    }
+
+    if (ggml_n_dims(cur) > 2 && !ggml_is_contiguous(cur)) {
+        cur = ggml_cont(ctx0, cur);
+    }
+
+    struct ggml_tensor * x = ggml_view_3d(ctx0, cur, cur->ne[0], 1, n_rows, cur->nb[1], cur->nb[1], 0);
+
+    struct ggml_tensor * ab = ggml_mul_mat_id(
+        ctx0, lsw->b,
+        ggml_mul_mat_id(ctx0, lsw->a, x, ids),
+        ids
+    );
+
+    return ggml_add(ctx0, res, ggml_reshape(ctx0, llm_build_lora_seq_sum(ctx0, ab, scale), res));
+}
+
 // do mat_mul, while optionally apply lora
 static struct ggml_tensor * llm_build_lora_mm(
         struct llama_context & lctx,
@@ -219,7 +355,7 @@ static struct ggml_tensor * llm_build_lora_mm(
         ab_cur = ggml_scale(ctx0, ab_cur, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
-    return res;
+    return llm_build_lora_seq_mm(lctx, ctx0, w, cur, res);
 }
 
 // do mat_mul_id, while optionally apply lora
@@ -462,7 +598,7 @@ llama_expert_gating_func_type gating_op,
     }
 
     // select experts
-    ggml_tensor * selected_experts = ggml_top_k(ctx, selection_probs, n_expert_used); // [n_expert_used, n_tokens]
+    ggml_tensor * selected_experts = ggml_argsort_top_k(ctx, selection_probs, n_expert_used); // [n_expert_used, n_tokens]
     cb(selected_experts->src[0], "ffn_moe_argsort", il);
     cb(selected_experts, "ffn_moe_topk", il);
 
@@ -547,6 +683,7 @@ static struct ggml_tensor * llm_build_kqv(
          struct ggml_tensor * q_cur,
          struct ggml_tensor * kq_mask,
                     int32_t   n_tokens,
+                    int32_t   kv_base,
                     int32_t   n_kv,
                     float     kq_scale,
          const llm_build_cb & cb,
@@ -571,7 +708,7 @@ static struct ggml_tensor * llm_build_kqv(
                 n_embd_head_k, n_kv, n_head_kv,
                 ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
                 ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
-                0);
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_base);
     cb(k, "k", il);
 
     struct ggml_tensor * cur;
@@ -586,7 +723,7 @@ static struct ggml_tensor * llm_build_kqv(
                     n_embd_head_v, n_kv, n_head_kv,
                     ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
                     ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
-                    0);
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*kv_base);
         cb(v, "v", il);
 
         cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
@@ -631,7 +768,7 @@ static struct ggml_tensor * llm_build_kqv(
                     n_kv, n_embd_head_v, n_head_kv,
                     ggml_element_size(kv.v_l[il])*n_ctx,
                     ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
-                    0);
+                    ggml_element_size(kv.v_l[il])*kv_base);
         cb(v, "v", il);
 
         struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
@@ -674,6 +811,7 @@ static struct ggml_tensor * llm_build_kv(
          struct ggml_tensor * kq_mask,
                     int32_t   n_tokens,
                     int32_t   kv_head,
+                    int32_t   kv_base,
                     int32_t   n_kv,
                     float     kq_scale,
          const llm_build_cb & cb,
@@ -691,7 +829,7 @@ static struct ggml_tensor * llm_build_kv(
 
     struct ggml_tensor * cur;
 
-    cur  = llm_build_kqv(ctx, lctx, kv, graph, wo, wo_b, q_cur, kq_mask, n_tokens, n_kv, kq_scale, cb, il);
+    cur  = llm_build_kqv(ctx, lctx, kv, graph, wo, wo_b, q_cur, kq_mask, n_tokens, kv_base, n_kv, kq_scale, cb, il);
     cb(cur, "kqv_out", il);
 
     return cur;
@@ -1071,6 +1209,7 @@ struct llm_build_context {
 
     const int32_t n_tokens;
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= kv_self.size)
+    const int32_t kv_base;  // index of the first cell to consider (kv_base + n_kv <= kv_self.size)
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
@@ -1121,6 +1260,7 @@ struct llm_build_context {
         norm_rms_eps     (hparams.f_norm_rms_eps),
         n_tokens         (ubatch.n_tokens),
         n_kv             (worst_case ? kv_self.size : kv_self.n),
+        kv_base          (worst_case ? 0 : kv_self.base),
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
@@ -1142,6 +1282,9 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // the new graph overwrites the meta buffer of the previous one
+        lctx.gf_prev = nullptr;
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -1157,6 +1300,11 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_lora_ids       = nullptr;
+        lctx.inp_lora_scale     = nullptr;
+        lctx.inp_lora_ids_out   = nullptr;
+        lctx.inp_lora_scale_out = nullptr;
+        lctx.inp_lora_rows      = nullptr;
     }
 
     void free() {
@@ -1547,7 +1695,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -1724,7 +1872,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -1862,7 +2010,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -1967,7 +2115,7 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2088,7 +2236,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2212,7 +2360,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2364,7 +2512,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2476,7 +2624,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2570,7 +2718,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2865,7 +3013,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -2997,13 +3145,13 @@ struct llm_build_context {
 
                     cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                             model.layers[il].wo, model.layers[il].bo,
-                            Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                            Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 } else {
                     Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
                     cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                             model.layers[il].wo, model.layers[il].bo,
-                            Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                            Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 }
             }
 
@@ -3148,7 +3296,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3267,7 +3415,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3381,7 +3529,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3499,7 +3647,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3614,7 +3762,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3773,7 +3921,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -3898,7 +4046,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4023,7 +4171,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
             struct ggml_tensor * sa_out = cur;
 
@@ -4125,7 +4273,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4236,7 +4384,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4356,7 +4504,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4474,7 +4622,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4667,7 +4815,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        k_states, v_states, q_states, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        k_states, v_states, q_states, KQ_mask, n_tokens, kv_head, kv_base, n_kv, kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4789,7 +4937,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -4908,7 +5056,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, kv_base, n_kv, 1.0f, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -5045,7 +5193,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5244,7 +5392,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5381,7 +5529,7 @@ struct llm_build_context {
                 }
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
-                                   KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f / sqrtf(float(n_embd_head)), cb, il);
+                                   KQ_mask_l, n_tokens, kv_head, kv_base, n_kv, 1.0f / sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5507,7 +5655,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, nullptr,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5626,7 +5774,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -5758,7 +5906,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5888,7 +6036,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -5997,7 +6145,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -6140,7 +6288,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -6289,7 +6437,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -6521,7 +6669,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        k_states, v_states, q_states, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        k_states, v_states, q_states, KQ_mask, n_tokens, kv_head, kv_base, n_kv, kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -6679,7 +6827,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         NULL, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
 
                 cur = llm_build_norm(ctx0, cur, hparams,
                         model.layers[il].attn_sub_norm, NULL,
@@ -6937,7 +7085,7 @@ struct llm_build_context {
                             n_embd_head_k, n_kv, n_head_kv,
                             ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
                             ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            0);
+                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa)*kv_base);
                 cb(k, "k", il);
 
                 struct ggml_tensor * v =
@@ -6945,7 +7093,7 @@ struct llm_build_context {
                             n_kv, n_embd_head_v, n_head_kv,
                             ggml_element_size(kv_self.v_l[il])*n_ctx,
                             ggml_element_size(kv_self.v_l[il])*n_ctx*n_embd_head_v,
-                            0);
+                            ggml_element_size(kv_self.v_l[il])*kv_base);
                 cb(v, "v", il);
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
@@ -7133,7 +7281,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/float(n_embd_head), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/float(n_embd_head), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -7246,7 +7394,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
 
             }
 
@@ -7365,7 +7513,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -7491,7 +7639,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -7866,7 +8014,7 @@ struct llm_build_context {
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, nullptr,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, kv_base, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
 
                 if (hparams.swin_norm) {
                     cur = llm_build_norm(ctx0, cur, hparams,
@@ -8175,6 +8323,8 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
+    lctx.n_lora_seq = llama_lora_seq_n_used(lctx, worst_case ? nullptr : &ubatch);
+
     struct llm_build_context llm(lctx, ubatch, cb, worst_case);
 
     llm.init();
@@ -8432,6 +8582,86 @@ static enum ggml_status llama_graph_compute(
     return status;
 }
 
+// a decode graph can be reused for the next ubatch if nothing but the contents of its inputs and
+// the position of the KV store depend on the ubatch
+static bool llama_graph_can_reuse(const llama_context & lctx) {
+    if (!lctx.graph_reuse) {
+        return false;
+    }
+
+    // recurrent state copies and the encoder outputs are baked into the graph
+    if (lctx.kv_self.recurrent || llama_model_has_encoder(&lctx.model)) {
+        return false;
+    }
+
+    // with pipeline parallelism, the inputs are rotated between copies after each compute
+    if (ggml_backend_sched_get_n_copies(lctx.sched.get()) > 1) {
+        return false;
+    }
+
+    return true;
+}
+
+// find the views of the KV cache that the graph writes the new cells to
+static void llama_graph_collect_kv_stores(llama_context & lctx, struct ggml_cgraph * gf) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
+
+    lctx.gf_prev_kv_stores.clear();
+    lctx.gf_prev_kv_head = kv_self.head;
+
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        struct ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->op != GGML_OP_CPY || node->view_src == nullptr) {
+            continue;
+        }
+
+        for (int il = 0; il < (int) kv_self.k_l.size(); ++il) {
+            size_t stride = 0;
+            if (node->view_src == kv_self.k_l[il]) {
+                stride = ggml_row_size(kv_self.k_l[il]->type, hparams.n_embd_k_gqa(il));
+            } else if (node->view_src == kv_self.v_l[il]) {
+                stride = kv_self.v_trans ? ggml_element_size(kv_self.v_l[il]) : ggml_row_size(kv_self.v_l[il]->type, hparams.n_embd_v_gqa(il));
+            } else {
+                continue;
+            }
+
+            // the result of ggml_cpy is a view of its destination
+            lctx.gf_prev_kv_stores.emplace_back(node,         stride);
+            lctx.gf_prev_kv_stores.emplace_back(node->src[1], stride);
+            break;
+        }
+    }
+}
+
+// move the KV store views of the reused graph to the new head of the cache
+static void llama_graph_move_kv_stores(llama_context & lctx, uint32_t kv_head) {
+    if (kv_head == lctx.gf_prev_kv_head) {
+        return;
+    }
+
+    const int64_t delta = (int64_t) kv_head - (int64_t) lctx.gf_prev_kv_head;
+
+    for (auto & it : lctx.gf_prev_kv_stores) {
+        struct ggml_tensor * t = it.first;
+
+        const int64_t offs = delta*(int64_t) it.second;
+
+        t->view_offs = (size_t) ((int64_t) t->view_offs + offs);
+        t->data      = (char *) t->data + offs;
+
+        if (t->op == GGML_OP_VIEW) {
+            // keep the op params of the view in sync with its offset
+            size_t view_offs;
+            memcpy(&view_offs, t->op_params, sizeof(view_offs));
+            view_offs = (size_t) ((int64_t) view_offs + offs);
+            memcpy(t->op_params, &view_offs, sizeof(view_offs));
+        }
+    }
+
+    lctx.gf_prev_kv_head = kv_head;
+}
+
 // decode a batch of tokens by evaluating the transformer
 // in case of unsuccessful decoding (error or warning),
 // the kv_cache state will be returned to its original state
@@ -8481,6 +8711,10 @@ static int llama_decode_impl(
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    if (!llama_lora_seq_update(lctx)) {
+        return -3;
+    }
+
     if (lctx.t_compute_start_us == 0) {
         lctx.t_compute_start_us = ggml_time_us();
     }
@@ -8579,21 +8813,52 @@ static int llama_decode_impl(
             kv_slot_restorer.save(slot);
 
             if (!kv_self.recurrent) {
-                // a heuristic, to avoid attending the full cache if it is not yet utilized
-                // after enough generations, the benefit from this heuristic disappears
-                // if we start defragmenting the cache, the benefit from this will be more important
+                // only attend the range of cells that is owned by the sequences in the ubatch
+                // this avoids attending the full cache if it is not yet utilized, and also
+                // avoids attending the cells of long-lived sequences that are not part of the ubatch
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
-                kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
-                //kv_self.n = llama_kv_cache_cell_max(kv_self);
+                const auto window = llama_kv_cache_seq_window(kv_self, ubatch, pad);
+                kv_self.base = window.first;
+                kv_self.n    = window.second - window.first;
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched.get());
+        llama_graph_params gparams;
+        gparams.n_tokens     = ubatch.n_tokens;
+        gparams.n_seq_tokens = ubatch.n_seq_tokens;
+        gparams.n_seqs       = ubatch.n_seqs;
+        gparams.n_outputs    = lctx.n_outputs;
+        gparams.n_lora_seq   = llama_lora_seq_n_used(lctx, &ubatch);
+        gparams.n_kv         = kv_self.n;
+        gparams.kv_base      = kv_self.base;
+        gparams.embd         = ubatch.embd != nullptr;
+        gparams.embeddings   = cparams.embeddings;
+        gparams.causal_attn  = cparams.causal_attn;
+
         ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+        ggml_cgraph * gf = nullptr;
+
+        if (lctx.gf_prev && lctx.gf_prev_params == gparams) {
+            // same topology as the previous ubatch - reuse the allocated graph and only move the KV store
+            gf = lctx.gf_prev;
+            llama_graph_move_kv_stores(lctx, kv_self.head);
+            lctx.n_reused++;
+        } else {
+            ggml_backend_sched_reset(lctx.sched.get());
+
+            gf = llama_build_graph(lctx, ubatch, false);
+
+            ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+            if (llama_graph_can_reuse(lctx)) {
+                lctx.gf_prev        = gf;
+                lctx.gf_prev_params = gparams;
+                llama_graph_collect_kv_stores(lctx, gf);
+            }
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
@@ -8620,12 +8885,11 @@ static int llama_decode_impl(
 
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
-
         llama_set_inputs(lctx, ubatch);
 
         const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
         if (compute_status != GGML_STATUS_SUCCESS) {
+            lctx.gf_prev = nullptr;
             kv_slot_restorer.restore(kv_self);
             switch (compute_status) {
                 case GGML_STATUS_ABORTED:
@@ -8754,7 +9018,8 @@ static int llama_decode_impl(
 
     // decide if we need to defrag the kv cache
     if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
-        const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
+        const uint32_t n_used_max = llama_kv_cache_cell_max(kv_self);
+        const float fragmentation = n_used_max >= 128 ? 1.0f - float(kv_self.used)/float(n_used_max) : 0.0f;
 
         // queue defragmentation for next llama_kv_cache_update
         if (fragmentation > cparams.defrag_thold) {
@@ -8764,6 +9029,220 @@ static int llama_decode_impl(
         }
     }
 
+    // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
+    // overlap with device computation.
+    // a graph kept for reuse must stay allocated
+    if (!lctx.gf_prev) {
+        ggml_backend_sched_reset(lctx.sched.get());
+    }
+
+    return 0;
+}
+
+// encode a batch of independent sequences with a non-causal model
+//
+// the model attends only within each sequence and never reads the KV cache, so the batch is
+// split into ubatches of whole sequences, packed longest first, with a block-diagonal mask
+//
+// return 0 on success
+// return positive int on warning
+// return negative int on error
+//
+static int llama_encode_packed_impl(
+         llama_context & lctx,
+           llama_batch   inp_batch) {
+
+    lctx.is_encoding = true;
+
+    if (inp_batch.n_tokens == 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens == 0\n", __func__);
+        return -1;
+    }
+
+    // temporary allocate memory for the input batch if needed
+    llama_batch_allocr batch_allocr(inp_batch, inp_batch.pos ? -1 : 0);
+
+    const llama_batch & batch = batch_allocr.batch;
+    const uint32_t n_tokens_all = batch.n_tokens;
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
+
+    if (batch.token) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            if (batch.token[i] < 0 || (uint32_t) batch.token[i] >= model.vocab.n_tokens()) {
+                LLAMA_LOG_ERROR("%s: invalid token[%d] = %d\n", __func__, i, batch.token[i]);
+                return -1;
+            }
+        }
+    }
+
+    GGML_ASSERT(n_tokens_all <= cparams.n_batch);
+
+    const auto n_ubatch = cparams.n_ubatch;
+    const int64_t n_embd = hparams.n_embd;
+
+    lctx.sbatch.from_batch(batch, n_embd, /* simple_split */ false, /* logits_all */ true);
+
+    // a sequence can't be split across ubatches, nor share its tokens with another one
+    for (const auto & seq : lctx.sbatch.seq) {
+        if (seq.length == 0) {
+            continue; // left over from the previous batch
+        }
+        if (seq.n_seq_id != 1) {
+            LLAMA_LOG_ERROR("%s: the tokens of a packed batch must belong to exactly one sequence\n", __func__);
+            return -1;
+        }
+        if (seq.length > n_ubatch) {
+            LLAMA_LOG_ERROR("%s: sequence %d has %zu tokens, more than n_ubatch = %u\n", __func__, seq.seq_id[0], seq.length, n_ubatch);
+            return -1;
+        }
+    }
+
+    if (!llama_lora_seq_update(lctx)) {
+        return -3;
+    }
+
+    if (lctx.t_compute_start_us == 0) {
+        lctx.t_compute_start_us = ggml_time_us();
+    }
+
+    lctx.n_queued_tokens += n_tokens_all;
+
+    // reserve output buffer
+    if (llama_output_reserve(lctx, n_tokens_all) < n_tokens_all) {
+        LLAMA_LOG_ERROR("%s: could not reserve space for batch with %u outputs\n", __func__, n_tokens_all);
+        return -2;
+    };
+
+    lctx.inp_embd_enc = NULL;
+    lctx.embd_seq.clear();
+
+    uint32_t n_outputs_prev = 0;
+
+    while (lctx.sbatch.n_tokens > 0) {
+        const llama_ubatch ubatch = lctx.sbatch.split_packed(n_ubatch);
+        const uint32_t n_tokens = ubatch.n_tokens;
+
+        // needs to happen before the graph is built
+        lctx.n_outputs = n_tokens;
+
+        int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
+        ggml_threadpool_t threadpool = n_tokens == 1 ? lctx.threadpool : lctx.threadpool_batch;
+
+        GGML_ASSERT(n_threads > 0);
+
+        ggml_backend_sched_reset(lctx.sched.get());
+        ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+
+        struct ggml_tensor * embd = nullptr;
+
+        if (cparams.embeddings) {
+            for (int i = ggml_graph_n_nodes(gf) - 1; i >= 0; --i) {
+                if (strcmp(ggml_graph_node(gf, i)->name, "result_embd_pooled") == 0) {
+                    embd = ggml_graph_node(gf, i);
+                    break;
+                }
+            }
+            GGML_ASSERT(embd != nullptr && "missing embeddings tensor");
+        }
+
+        ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+        llama_set_inputs(lctx, ubatch);
+
+        const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
+        switch (compute_status) {
+            case GGML_STATUS_SUCCESS:
+                break;
+            case GGML_STATUS_ABORTED:
+                return 2;
+            case GGML_STATUS_ALLOC_FAILED:
+                return -2;
+            case GGML_STATUS_FAILED:
+            default:
+                return -3;
+        }
+
+        // extract embeddings
+        if (embd) {
+            ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched.get(), embd);
+            GGML_ASSERT(backend_embd != nullptr);
+
+            // the rows of the pooled output are the packed sequences, in the order they were taken
+            const auto & packed_seq_id = lctx.sbatch.packed_seq_id;
+
+            switch (cparams.pooling_type) {
+                case LLAMA_POOLING_TYPE_NONE:
+                    {
+                        // extract token embeddings
+                        GGML_ASSERT(lctx.embd != nullptr);
+                        float * embd_out = lctx.embd + n_outputs_prev*n_embd;
+
+                        GGML_ASSERT((n_outputs_prev + n_tokens)*n_embd <= (int64_t) lctx.embd_size);
+                        ggml_backend_tensor_get_async(backend_embd, embd, embd_out, 0, n_tokens*n_embd*sizeof(float));
+                    } break;
+                case LLAMA_POOLING_TYPE_MEAN:
+                case LLAMA_POOLING_TYPE_CLS:
+                case LLAMA_POOLING_TYPE_LAST:
+                    {
+                        // extract sequence embeddings (cleared before processing each batch)
+                        auto & embd_seq_out = lctx.embd_seq;
+
+                        for (size_t k = 0; k < packed_seq_id.size(); ++k) {
+                            auto & out = embd_seq_out[packed_seq_id[k]];
+                            out.resize(n_embd);
+                            ggml_backend_tensor_get_async(backend_embd, embd, out.data(), (n_embd*k)*sizeof(float), n_embd*sizeof(float));
+                        }
+                    } break;
+                case LLAMA_POOLING_TYPE_RANK:
+                    {
+                        // extract the rerank score - a single float per sequence
+                        auto & embd_seq_out = lctx.embd_seq;
+
+                        for (size_t k = 0; k < packed_seq_id.size(); ++k) {
+                            auto & out = embd_seq_out[packed_seq_id[k]];
+                            out.resize(1);
+                            ggml_backend_tensor_get_async(backend_embd, embd, out.data(), k*sizeof(float), sizeof(float));
+                        }
+                    } break;
+                case LLAMA_POOLING_TYPE_UNSPECIFIED:
+                    {
+                        GGML_ABORT("unknown pooling type");
+                    }
+            }
+        }
+
+        n_outputs_prev += n_tokens;
+    }
+
+    // set output mappings
+    {
+        bool sorted_output = true;
+
+        GGML_ASSERT(lctx.sbatch.out_ids.size() == n_tokens_all);
+
+        for (size_t i = 0; i < n_tokens_all; ++i) {
+            size_t out_id = lctx.sbatch.out_ids[i];
+            lctx.output_ids[out_id] = i;
+            if (out_id != i) {
+                sorted_output = false;
+            }
+        }
+
+        if (sorted_output) {
+            lctx.sbatch.out_ids.clear();
+        }
+    }
+
+    // set to total number of outputs in the batch, for use in llama_get_embeddings_ith
+    lctx.n_outputs = n_tokens_all;
+
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
     ggml_backend_sched_reset(lctx.sched.get());
@@ -8784,6 +9263,11 @@ static int llama_encode_impl(
          llama_context & lctx,
            llama_batch   inp_batch) {
 
+    // non-causal models without a T5-style encoder (BERT and the like) pack their sequences
+    if (!lctx.model.hparams.causal_attn && !llama_model_has_encoder(&lctx.model)) {
+        return llama_encode_packed_impl(lctx, inp_batch);
+    }
+
     lctx.is_encoding = true;
 
     if (inp_batch.n_tokens == 0) {
@@ -8815,6 +9299,10 @@ static int llama_encode_impl(
     // micro-batching is not possible for non-causal encoding, so we process the batch in a single shot
     GGML_ASSERT(cparams.n_ubatch >= n_tokens && "encoder requires n_ubatch >= n_tokens");
 
+    if (!llama_lora_seq_update(lctx)) {
+        return -3;
+    }
+
     if (lctx.t_compute_start_us == 0) {
         lctx.t_compute_start_us = ggml_time_us();
     }
@@ -9248,6 +9736,7 @@ int32_t llama_set_adapter_lora(
             struct llama_adapter_lora * adapter,
             float scale) {
     ctx->lora[adapter] = scale;
+    ctx->gf_prev = nullptr;
     return 0;
 }
 
@@ -9257,6 +9746,7 @@ int32_t llama_rm_adapter_lora(
     auto pos = ctx->lora.find(adapter);
     if (pos != ctx->lora.end()) {
         ctx->lora.erase(pos);
+        ctx->gf_prev = nullptr;
         return 0;
     }
 
@@ -9265,6 +9755,51 @@ int32_t llama_rm_adapter_lora(
 
 void llama_clear_adapter_lora(struct llama_context * ctx) {
     ctx->lora.clear();
+    ctx->gf_prev = nullptr;
+}
+
+int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id,
+            struct llama_adapter_lora * adapter,
+            float scale) {
+    if (seq_id < 0) {
+        return -1;
+    }
+
+    // the adapter is stacked on the next decode, see llama_lora_seq_update
+    ctx->lora_seq[seq_id][adapter] = scale;
+    return 0;
+}
+
+int32_t llama_rm_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id,
+            struct llama_adapter_lora * adapter) {
+    auto it = ctx->lora_seq.find(seq_id);
+    if (it == ctx->lora_seq.end()) {
+        return -1;
+    }
+
+    auto pos = it->second.find(adapter);
+    if (pos == it->second.end()) {
+        return -1;
+    }
+
+    it->second.erase(pos);
+    if (it->second.empty()) {
+        ctx->lora_seq.erase(it);
+    }
+
+    return 0;
+}
+
+void llama_clear_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        ctx->lora_seq.clear();
+    } else {
+        ctx->lora_seq.erase(seq_id);
+    }
 }
 
 int32_t llama_apply_adapter_cvec(
@@ -9274,6 +9809,7 @@ int32_t llama_apply_adapter_cvec(
                      int32_t   n_embd,
                      int32_t   il_start,
                      int32_t   il_end) {
+    ctx->gf_prev = nullptr;
     return ctx->cvec.apply(ctx->model, data, len, n_embd, il_start, il_end);
 }
 
@@ -9642,6 +10178,11 @@ struct llama_context * llama_init_from_model(
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
     }
 
+    // non-causal models attend only within the batch and never read the KV cache
+    if (!hparams.causal_attn) {
+        kv_size = 0;
+    }
+
     GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
     GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
 
@@ -9786,6 +10327,9 @@ struct llama_context * llama_init_from_model(
 
             ctx->sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel));
 
+            // LLAMA_GRAPH_REUSE_DISABLE rebuilds the decode graph for every ubatch, e.g. to compare the results with and without reuse
+            ctx->graph_reuse = getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
+
             if (pipeline_parallel) {
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched.get()));
             }
@@ -10052,6 +10596,7 @@ struct llama_perf_context_data llama_perf_context(const struct llama_context * c
     data.t_eval_ms   = 1e-3 * ctx->t_eval_us;
     data.n_p_eval    = std::max(1, ctx->n_p_eval);
     data.n_eval      = std::max(1, ctx->n_eval);
+    data.n_reused    = ctx->n_reused;
 
     return data;
 }
@@ -10067,10 +10612,12 @@ void llama_perf_context_print(const struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(struct llama_context * ctx) {
     ctx->t_start_us  = ggml_time_us();
     ctx->t_eval_us   = ctx->n_eval = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->n_reused    = 0;
 }
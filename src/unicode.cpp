@@ -10,11 +10,15 @@
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <limits>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -552,6 +556,792 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// regex to DFA compiler
+//
+// supports the subset of the ECMAScript syntax that is used by the pre-tokenizers: alternations, groups, greedy and
+// lazy quantifiers, character classes, lookaheads of a single character class and $
+// the matches are the same (leftmost-first) as with std::regex, but they are found without backtracking
+//
+// the DFA replaces std::regex on the collapsed bytes or std::wregex on the codepoints (wide), so ., \s, \w and \d
+// are resolved with the same regex traits and global locale as the std regex would use
+//
+
+using unicode_cpt_ranges = std::vector<std::pair<uint32_t, uint32_t>>;
+
+// the characters up to max_cpt that belong to the class of the escape c (s, w or d) for std::regex_traits<CharT>
+template <typename CharT>
+static unicode_cpt_ranges unicode_regex_traits_ranges(uint32_t c, uint32_t max_cpt) {
+    const std::regex_traits<CharT> traits;
+    const CharT name[1] = { (CharT) c };
+    const auto cls = traits.lookup_classname(name, name + 1);
+
+    unicode_cpt_ranges ranges;
+    for (uint32_t cpt = 0; cpt <= max_cpt; ++cpt) {
+        if (!traits.isctype((CharT) cpt, cls)) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().second + 1 == cpt) {
+            ranges.back().second = cpt;
+        } else {
+            ranges.emplace_back(cpt, cpt);
+        }
+    }
+    return ranges;
+}
+
+// scanning all the codepoints is slow, so the classes are computed once per locale and shared between the regexes
+static const unicode_cpt_ranges & unicode_regex_class_ranges(uint32_t c, bool wide) {
+    static std::mutex mutex;
+    static std::map<std::tuple<uint32_t, bool, std::string>, unicode_cpt_ranges> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const auto key = std::make_tuple(c, wide, std::locale().name());
+
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        const uint32_t max_wchar = (uint32_t) std::min<uint64_t>(std::numeric_limits<wchar_t>::max(), 0x10FFFF);
+        it = cache.emplace(key, wide ? unicode_regex_traits_ranges<wchar_t>(c, max_wchar)
+                                     : unicode_regex_traits_ranges<char>(c, 0xFF)).first;
+    }
+    return it->second;
+}
+
+// the line terminators that . does not match: \n and \r, and with std::wregex also U+2028 and U+2029
+static unicode_cpt_ranges unicode_regex_dot_excluded(bool wide) {
+    unicode_cpt_ranges ranges;
+    for (uint32_t cpt : { 0x0A, 0x0D, 0x2028, 0x2029 }) {
+        bool match;
+        if (wide) {
+            match = std::regex_match(std::wstring(1, (wchar_t) cpt), std::wregex(L"."));
+        } else {
+            // the collapsed bytes have no other line terminators
+            match = cpt > 0xFF || std::regex_match(std::string(1, (char) cpt), std::regex("."));
+        }
+        if (!match) {
+            ranges.emplace_back(cpt, cpt);
+        }
+    }
+    return ranges;
+}
+
+struct unicode_regex_dfa {
+    // set of codepoints as inclusive ranges
+    struct cset {
+        unicode_cpt_ranges ranges;
+        bool negated = false;
+
+        bool contains(uint32_t cpt) const {
+            bool found = false;
+            for (const auto & range : ranges) {
+                if (range.first <= cpt && cpt <= range.second) {
+                    found = true;
+                    break;
+                }
+            }
+            return found != negated;
+        }
+    };
+
+    struct node {
+        enum type_t { EMPTY, SET, CAT, ALT, REPEAT, LOOKAHEAD, NOT_LOOKAHEAD, END } type;
+
+        node(type_t type) : type(type) {}
+
+        int set = -1;
+        int min = 0;
+        int max = 0; // -1 for unbounded
+        bool greedy = true;
+        std::vector<node> children;
+    };
+
+    struct inst {
+        enum op_t { CHAR, SPLIT, JMP, ASSERT_SET, ASSERT_NOT_SET, ASSERT_END, MATCH } op;
+        int x   = -1;
+        int y   = -1;
+        int set = -1;
+    };
+
+    static constexpr int MAX_STATES = 4096;
+    static constexpr int LA_END     = -1; // lookahead at the end of the text
+
+    std::vector<cset> sets;
+    std::vector<inst> prog;
+
+    // the codepoints are mapped to classes that are either in or out of every set
+    std::vector<uint32_t> class_bounds; // first codepoint of each interval
+    std::vector<uint16_t> class_ids;    // class of each interval
+    uint16_t ascii_class[128];
+    int n_classes = 0;
+    std::vector<std::vector<bool>> class_in_set;
+
+    // DFA over the classes: trans[state*n_classes + cls] = (next state << 1) | (match ends before cls)
+    std::vector<int32_t> trans;
+    std::vector<uint8_t> match_at_end;
+    int n_states = 0;
+
+    bool ok = false;
+
+    // the regex is matched against codepoints (std::wregex) instead of the collapsed bytes (std::regex)
+    const bool wide;
+
+    unicode_regex_dfa(const std::vector<uint32_t> & regex, bool wide) : wide(wide) {
+        try {
+            size_t pos = 0;
+            node root = parse_alt(regex, pos);
+            if (pos != regex.size()) {
+                return;
+            }
+            compile(root);
+            emit(inst::MATCH);
+            build_classes();
+            ok = build_dfa();
+        } catch (const std::exception &) {
+            ok = false;
+        }
+    }
+
+    uint16_t cpt_class(uint32_t cpt) const {
+        if (cpt < 128) {
+            return ascii_class[cpt];
+        }
+        const size_t i = std::upper_bound(class_bounds.begin(), class_bounds.end(), cpt) - class_bounds.begin() - 1;
+        return class_ids[i];
+    }
+
+    //
+    // parser
+    //
+
+    [[noreturn]] static void unsupported() {
+        throw std::invalid_argument("unsupported regex");
+    }
+
+    node parse_alt(const std::vector<uint32_t> & re, size_t & pos) {
+        node alt { node::ALT };
+        alt.children.push_back(parse_cat(re, pos));
+        while (pos < re.size() && re[pos] == '|') {
+            pos++;
+            alt.children.push_back(parse_cat(re, pos));
+        }
+        return alt.children.size() == 1 ? std::move(alt.children[0]) : std::move(alt);
+    }
+
+    node parse_cat(const std::vector<uint32_t> & re, size_t & pos) {
+        node cat { node::CAT };
+        while (pos < re.size() && re[pos] != '|' && re[pos] != ')') {
+            node atom = parse_atom(re, pos);
+            parse_quantifier(re, pos, atom);
+            cat.children.push_back(std::move(atom));
+        }
+        return cat;
+    }
+
+    static int parse_int(const std::vector<uint32_t> & re, size_t & pos) {
+        if (pos >= re.size() || re[pos] < '0' || re[pos] > '9') {
+            unsupported();
+        }
+        int value = 0;
+        while (pos < re.size() && re[pos] >= '0' && re[pos] <= '9') {
+            value = value*10 + (re[pos++] - '0');
+            if (value > 1000) {
+                unsupported();
+            }
+        }
+        return value;
+    }
+
+    void parse_quantifier(const std::vector<uint32_t> & re, size_t & pos, node & atom) {
+        while (pos < re.size()) {
+            int min;
+            int max;
+            switch (re[pos]) {
+                case '*': min = 0; max = -1; pos++; break;
+                case '+': min = 1; max = -1; pos++; break;
+                case '?': min = 0; max =  1; pos++; break;
+                case '{':
+                    {
+                        pos++;
+                        min = parse_int(re, pos);
+                        max = min;
+                        if (pos < re.size() && re[pos] == ',') {
+                            pos++;
+                            max = pos < re.size() && re[pos] == '}' ? -1 : parse_int(re, pos);
+                        }
+                        if (pos >= re.size() || re[pos] != '}' || (max >= 0 && max < min)) {
+                            unsupported();
+                        }
+                        pos++;
+                    } break;
+                default:
+                    return;
+            }
+            if (atom.type == node::LOOKAHEAD || atom.type == node::NOT_LOOKAHEAD || atom.type == node::END) {
+                unsupported();
+            }
+            node rep { node::REPEAT };
+            rep.min = min;
+            rep.max = max;
+            if (pos < re.size() && re[pos] == '?') {
+                rep.greedy = false;
+                pos++;
+            }
+            rep.children.push_back(std::move(atom));
+            atom = std::move(rep);
+        }
+    }
+
+    int add_set(cset set) {
+        sets.push_back(std::move(set));
+        return (int) sets.size() - 1;
+    }
+
+    // escapes that are valid both inside and outside of a class; returns false if it is not a class escape
+    bool parse_class_escape(uint32_t c, cset & set) const {
+        switch (c) {
+            case 's': case 'd': case 'w':
+                set.ranges = unicode_regex_class_ranges(c, wide);
+                return true;
+            case 'S': case 'D': case 'W':
+                set.ranges = unicode_regex_class_ranges(c - 'A' + 'a', wide);
+                set.negated = true;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static uint32_t parse_hex(const std::vector<uint32_t> & re, size_t & pos, int n) {
+        uint32_t value = 0;
+        for (int i = 0; i < n; ++i) {
+            if (pos >= re.size()) {
+                unsupported();
+            }
+            const uint32_t c = re[pos++];
+            if      (c >= '0' && c <= '9') value = value*16 + (c - '0');
+            else if (c >= 'a' && c <= 'f') value = value*16 + (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') value = value*16 + (c - 'A' + 10);
+            else unsupported();
+        }
+        return value;
+    }
+
+    // escaped literal character, after the backslash
+    static uint32_t parse_escaped_char(const std::vector<uint32_t> & re, size_t & pos) {
+        const uint32_t c = re[pos++];
+        switch (c) {
+            case 't': return '\t';
+            case 'n': return '\n';
+            case 'v': return '\v';
+            case 'f': return '\f';
+            case 'r': return '\r';
+            case '0': return 0;
+            case 'x': return parse_hex(re, pos, 2);
+            case 'u': return parse_hex(re, pos, 4);
+            default:
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                    unsupported();
+                }
+                return c;
+        }
+    }
+
+    cset parse_class(const std::vector<uint32_t> & re, size_t & pos) {
+        cset set;
+        if (pos < re.size() && re[pos] == '^') {
+            set.negated = true;
+            pos++;
+        }
+        bool first = true;
+        while (true) {
+            if (pos >= re.size()) {
+                unsupported();
+            }
+            if (re[pos] == ']' && !first) {
+                pos++;
+                break;
+            }
+            first = false;
+
+            uint32_t lo;
+            if (re[pos] == '\\') {
+                pos++;
+                if (pos >= re.size()) {
+                    unsupported();
+                }
+                cset esc;
+                if (parse_class_escape(re[pos], esc)) {
+                    pos++;
+                    if (esc.negated) {
+                        // negated escapes inside a class would need a set union with a complement
+                        unsupported();
+                    }
+                    set.ranges.insert(set.ranges.end(), esc.ranges.begin(), esc.ranges.end());
+                    continue;
+                }
+                if (re[pos] == 'b') {
+                    // \b is a backspace inside of a class
+                    lo = '\b';
+                    pos++;
+                } else {
+                    lo = parse_escaped_char(re, pos);
+                }
+            } else {
+                lo = re[pos++];
+            }
+
+            uint32_t hi = lo;
+            if (pos + 1 < re.size() && re[pos] == '-' && re[pos + 1] != ']') {
+                pos++;
+                if (re[pos] == '\\') {
+                    pos++;
+                    if (pos >= re.size()) {
+                        unsupported();
+                    }
+                    cset esc;
+                    if (parse_class_escape(re[pos], esc)) {
+                        unsupported();
+                    }
+                    hi = parse_escaped_char(re, pos);
+                } else {
+                    hi = re[pos++];
+                }
+                if (hi < lo) {
+                    unsupported();
+                }
+            }
+            set.ranges.emplace_back(lo, hi);
+        }
+        return set;
+    }
+
+    node parse_atom(const std::vector<uint32_t> & re, size_t & pos) {
+        const uint32_t c = re[pos++];
+        switch (c) {
+            case '(':
+                {
+                    node::type_t type = node::CAT;
+                    if (pos < re.size() && re[pos] == '?') {
+                        if (pos + 1 >= re.size()) {
+                            unsupported();
+                        }
+                        switch (re[pos + 1]) {
+                            case ':': type = node::CAT;           break;
+                            case '=': type = node::LOOKAHEAD;     break;
+                            case '!': type = node::NOT_LOOKAHEAD; break;
+                            default: unsupported();
+                        }
+                        pos += 2;
+                    }
+                    node inner = parse_alt(re, pos);
+                    if (pos >= re.size() || re[pos] != ')') {
+                        unsupported();
+                    }
+                    pos++;
+                    if (type == node::CAT) {
+                        return inner;
+                    }
+                    // only lookaheads of a single character class are supported
+                    if (inner.type == node::CAT && inner.children.size() == 1) {
+                        inner = std::move(inner.children[0]);
+                    }
+                    if (inner.type != node::SET) {
+                        unsupported();
+                    }
+                    node la { type };
+                    la.set = inner.set;
+                    return la;
+                }
+            case '[':
+                {
+                    node n { node::SET };
+                    n.set = add_set(parse_class(re, pos));
+                    return n;
+                }
+            case '.':
+                {
+                    cset set;
+                    set.ranges = unicode_regex_dot_excluded(wide);
+                    set.negated = true;
+                    node n { node::SET };
+                    n.set = add_set(std::move(set));
+                    return n;
+                }
+            case '$':
+                return node { node::END };
+            case '\\':
+                {
+                    if (pos >= re.size()) {
+                        unsupported();
+                    }
+                    cset set;
+                    if (!parse_class_escape(re[pos], set)) {
+                        const uint32_t lit = parse_escaped_char(re, pos);
+                        set.ranges = { {lit, lit} };
+                    } else {
+                        pos++;
+                    }
+                    node n { node::SET };
+                    n.set = add_set(std::move(set));
+                    return n;
+                }
+            case '^': case '*': case '+': case '?': case '{': case ')': case ']': case '}':
+                unsupported();
+            default:
+                {
+                    cset set;
+                    set.ranges = { {c, c} };
+                    node n { node::SET };
+                    n.set = add_set(std::move(set));
+                    return n;
+                }
+        }
+    }
+
+    //
+    // NFA (Thompson construction, the first branch of a split has priority)
+    //
+
+    int emit(inst::op_t op, int x = -1, int y = -1, int set = -1) {
+        prog.push_back({ op, x, y, set });
+        return (int) prog.size() - 1;
+    }
+
+    void compile(const node & n) {
+        switch (n.type) {
+            case node::EMPTY:
+                break;
+            case node::SET:
+                emit(inst::CHAR, (int) prog.size() + 1, -1, n.set);
+                break;
+            case node::CAT:
+                for (const auto & child : n.children) {
+                    compile(child);
+                }
+                break;
+            case node::ALT:
+                {
+                    std::vector<int> jumps;
+                    for (size_t i = 0; i < n.children.size(); ++i) {
+                        int split = -1;
+                        if (i + 1 < n.children.size()) {
+                            split = emit(inst::SPLIT);
+                            prog[split].x = (int) prog.size();
+                        }
+                        compile(n.children[i]);
+                        if (i + 1 < n.children.size()) {
+                            jumps.push_back(emit(inst::JMP));
+                            prog[split].y = (int) prog.size();
+                        }
+                    }
+                    for (int j : jumps) {
+                        prog[j].x = (int) prog.size();
+                    }
+                } break;
+            case node::REPEAT:
+                {
+                    const node & child = n.children[0];
+                    for (int i = 0; i < n.min; ++i) {
+                        compile(child);
+                    }
+                    if (n.max < 0) {
+                        const int split = emit(inst::SPLIT);
+                        compile(child);
+                        emit(inst::JMP, split);
+                        set_split(split, split + 1, (int) prog.size(), n.greedy);
+                    } else {
+                        std::vector<int> splits;
+                        for (int i = n.min; i < n.max; ++i) {
+                            splits.push_back(emit(inst::SPLIT));
+                            compile(child);
+                        }
+                        for (int split : splits) {
+                            set_split(split, split + 1, (int) prog.size(), n.greedy);
+                        }
+                    }
+                } break;
+            case node::LOOKAHEAD:
+                emit(inst::ASSERT_SET, (int) prog.size() + 1, -1, n.set);
+                break;
+            case node::NOT_LOOKAHEAD:
+                emit(inst::ASSERT_NOT_SET, (int) prog.size() + 1, -1, n.set);
+                break;
+            case node::END:
+                emit(inst::ASSERT_END, (int) prog.size() + 1);
+                break;
+        }
+        if (prog.size() > 65536) {
+            unsupported();
+        }
+    }
+
+    void set_split(int split, int take, int skip, bool greedy) {
+        prog[split].x = greedy ? take : skip;
+        prog[split].y = greedy ? skip : take;
+    }
+
+    //
+    // character classes
+    //
+
+    void build_classes() {
+        std::vector<uint32_t> bounds = { 0 };
+        for (const auto & set : sets) {
+            for (const auto & range : set.ranges) {
+                bounds.push_back(range.first);
+                if (range.second < UINT32_MAX) {
+                    bounds.push_back(range.second + 1);
+                }
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        std::map<std::vector<bool>, uint16_t> signatures;
+        for (uint32_t bound : bounds) {
+            std::vector<bool> signature(sets.size());
+            for (size_t s = 0; s < sets.size(); ++s) {
+                signature[s] = sets[s].contains(bound);
+            }
+            auto it = signatures.find(signature);
+            if (it == signatures.end()) {
+                if (signatures.size() >= UINT16_MAX) {
+                    unsupported();
+                }
+                it = signatures.emplace(signature, (uint16_t) class_in_set.size()).first;
+                class_in_set.push_back(signature);
+            }
+            class_bounds.push_back(bound);
+            class_ids.push_back(it->second);
+        }
+        n_classes = (int) class_in_set.size();
+
+        for (uint32_t cpt = 0; cpt < 128; ++cpt) {
+            const size_t i = std::upper_bound(class_bounds.begin(), class_bounds.end(), cpt) - class_bounds.begin() - 1;
+            ascii_class[cpt] = class_ids[i];
+        }
+    }
+
+    //
+    // DFA (subset construction over the classes, keeping the NFA threads in priority order)
+    //
+
+    // follow the epsilon transitions from the threads of a state, with the class of the next codepoint known
+    void closure(const std::vector<int> & threads, int la, std::vector<int> & out, std::vector<int> & visited, int mark) const {
+        std::vector<int> stack;
+        for (auto it = threads.rbegin(); it != threads.rend(); ++it) {
+            stack.push_back(*it);
+        }
+        while (!stack.empty()) {
+            const int pc = stack.back();
+            stack.pop_back();
+            if (visited[pc] == mark) {
+                continue;
+            }
+            visited[pc] = mark;
+            const inst & in = prog[pc];
+            switch (in.op) {
+                case inst::CHAR:
+                case inst::MATCH:
+                    out.push_back(pc);
+                    break;
+                case inst::JMP:
+                    stack.push_back(in.x);
+                    break;
+                case inst::SPLIT:
+                    stack.push_back(in.y);
+                    stack.push_back(in.x);
+                    break;
+                case inst::ASSERT_SET:
+                    if (la != LA_END && class_in_set[la][in.set]) {
+                        stack.push_back(in.x);
+                    }
+                    break;
+                case inst::ASSERT_NOT_SET:
+                    if (la == LA_END || !class_in_set[la][in.set]) {
+                        stack.push_back(in.x);
+                    }
+                    break;
+                case inst::ASSERT_END:
+                    if (la == LA_END) {
+                        stack.push_back(in.x);
+                    }
+                    break;
+            }
+        }
+    }
+
+    bool build_dfa() {
+        std::map<std::vector<int>, int> state_ids;
+        std::vector<std::vector<int>> states;
+
+        auto get_state = [&](const std::vector<int> & threads) {
+            auto it = state_ids.find(threads);
+            if (it != state_ids.end()) {
+                return it->second;
+            }
+            const int id = (int) states.size();
+            state_ids.emplace(threads, id);
+            states.push_back(threads);
+            return id;
+        };
+
+        get_state({});  // 0: dead state
+        get_state({0}); // 1: start state
+
+        std::vector<int> visited(prog.size(), -1);
+        int mark = 0;
+
+        std::vector<int> list;
+        std::vector<int> next;
+        for (size_t s = 0; s < states.size(); ++s) {
+            if (states.size() > MAX_STATES) {
+                return false;
+            }
+
+            list.clear();
+            closure(states[s], LA_END, list, visited, mark++);
+            match_at_end.push_back(std::find_if(list.begin(), list.end(), [&](int pc) { return prog[pc].op == inst::MATCH; }) != list.end());
+
+            for (int cls = 0; cls < n_classes; ++cls) {
+                list.clear();
+                closure(states[s], cls, list, visited, mark++);
+
+                bool matched = false;
+                next.clear();
+                for (int pc : list) {
+                    if (prog[pc].op == inst::MATCH) {
+                        // the threads with a lower priority are cut
+                        matched = true;
+                        break;
+                    }
+                    if (class_in_set[cls][prog[pc].set] && std::find(next.begin(), next.end(), prog[pc].x) == next.end()) {
+                        next.push_back(prog[pc].x);
+                    }
+                }
+                // the state vector may reallocate in get_state
+                const int id = get_state(next);
+                trans.push_back((id << 1) | (matched ? 1 : 0));
+            }
+        }
+        n_states = (int) states.size();
+
+        // the split does not handle empty matches like std::regex does
+        if (match_at_end[1]) {
+            return false;
+        }
+        for (int cls = 0; cls < n_classes; ++cls) {
+            if (trans[n_classes + cls] & 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //
+    // matching
+    //
+
+    // split each fragment into the matches and the text between them, like unicode_regex_split_stl
+    std::vector<size_t> split(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) const {
+        std::vector<size_t> bpe_offsets;
+        bpe_offsets.reserve(offsets.size());
+
+        std::vector<uint16_t> cls;
+        std::vector<int32_t>  failed; // failed[i] = DFA state that is known to not match from position i
+        std::vector<std::pair<size_t, int32_t>> path;
+
+        size_t start = 0;
+        for (auto offset : offsets) {
+            cls.resize(offset);
+            for (size_t i = 0; i < offset; ++i) {
+                cls[i] = cpt_class(cpts[start + i]);
+            }
+            failed.assign(offset + 1, -1);
+
+            size_t prev_end = 0;
+            size_t pos = 0;
+            while (pos < offset) {
+                int32_t state = 1;
+                int64_t match_end = -1;
+                path.clear();
+
+                for (size_t i = pos; ; ++i) {
+                    if (failed[i] == state) {
+                        break;
+                    }
+                    path.emplace_back(i, state);
+                    if (i == offset) {
+                        if (match_at_end[state]) {
+                            match_end = i;
+                        }
+                        break;
+                    }
+                    const int32_t t = trans[(size_t) state*n_classes + cls[i]];
+                    if (t & 1) {
+                        match_end = i;
+                    }
+                    state = t >> 1;
+                    if (state == 0) {
+                        break;
+                    }
+                }
+
+                if (match_end < 0) {
+                    for (const auto & p : path) {
+                        failed[p.first] = p.second;
+                    }
+                    pos++;
+                    continue;
+                }
+
+                if (pos > prev_end) {
+                    bpe_offsets.emplace_back(pos - prev_end);
+                }
+                bpe_offsets.emplace_back(match_end - pos);
+                prev_end = pos = match_end;
+            }
+
+            if (prev_end < offset) {
+                bpe_offsets.emplace_back(offset - prev_end);
+            }
+            start += offset;
+        }
+
+        return bpe_offsets;
+    }
+};
+
+// compiled regexes are cached and shared, they are immutable after construction
+static const unicode_regex_dfa * unicode_regex_dfa_get(const std::vector<uint32_t> & regex, bool wide) {
+    static std::mutex mutex;
+    static std::map<std::tuple<std::vector<uint32_t>, bool, std::string>, std::unique_ptr<unicode_regex_dfa>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // the classes depend on the global locale, as with a std regex that is constructed for each split
+    auto key = std::make_tuple(regex, wide, std::locale().name());
+
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        it = cache.emplace(std::move(key), std::make_unique<unicode_regex_dfa>(regex, wide)).first;
+    }
+
+    return it->second->ok ? it->second.get() : nullptr;
+}
+
+// use a DFA compiled from the regex to split the text, returns false if the regex is not supported
+static bool unicode_regex_split_dfa(const std::vector<uint32_t> & cpts, const std::vector<uint32_t> & regex, bool wide, std::vector<size_t> & offsets) {
+    const unicode_regex_dfa * dfa = unicode_regex_dfa_get(regex, wide);
+    if (dfa == nullptr) {
+        return false;
+    }
+
+    offsets = dfa->split(cpts, offsets);
+    return true;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -802,7 +1592,17 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                std::vector<uint32_t> cpts_collapsed(text_collapsed.size());
+                for (size_t i = 0; i < text_collapsed.size(); ++i) {
+                    cpts_collapsed[i] = (uint8_t) text_collapsed[i];
+                }
+                std::vector<uint32_t> cpts_regex_collapsed(regex_expr_collapsed.size());
+                for (size_t i = 0; i < regex_expr_collapsed.size(); ++i) {
+                    cpts_regex_collapsed[i] = (uint8_t) regex_expr_collapsed[i];
+                }
+                if (!unicode_regex_split_dfa(cpts_collapsed, cpts_regex_collapsed, false, bpe_offsets)) {
+                    bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                }
             } else {
                 // no unicode category used, we can use std::wregex directly
                 const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
@@ -817,7 +1617,10 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text: %s\n", text.c_str());
                 //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                const std::vector<uint32_t> cpts_wtext(wtext.begin(), wtext.end());
+                if (!unicode_regex_split_dfa(cpts_wtext, unicode_cpts_from_utf8(regex_expr), true, bpe_offsets)) {
+                    bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                }
             }
         } catch (std::regex_error & e) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
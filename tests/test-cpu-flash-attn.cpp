@@ -0,0 +1,151 @@
+// Checks that the CPU flash attention with a quantized V, which accumulates the V rows without dequantizing them
+// first, gives the same results as with an F16 V holding the same (dequantized) values, with one and several threads
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr int64_t D         = 128;
+constexpr int64_t N_HEAD    = 4;
+constexpr int64_t N_HEAD_KV = 2;
+
+// normalized mean squared error, as in test-backend-ops
+constexpr double MAX_NMSE = 5e-4;
+
+static void fill(std::vector<float> & data, float offset) {
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = 0.1f + 2*cosf(i*0.37f + offset);
+    }
+}
+
+static ggml_tensor * new_f16(ggml_context * ctx, const std::vector<float> & data, int64_t ne0, int64_t ne1, int64_t ne2) {
+    ggml_tensor * t = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, ne0, ne1, ne2);
+    ggml_fp32_to_fp16_row(data.data(), (ggml_fp16_t *) t->data, data.size());
+    return t;
+}
+
+// attention of n_q rows over n_kv cells with V of type type_v, V is quantized from v_data unless it is F16
+static std::vector<float> run(ggml_type type_v, const std::vector<float> & v_data, int64_t n_q, int64_t n_kv, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::vector<float> q_data(D*n_q*N_HEAD);
+    std::vector<float> k_data(D*n_kv*N_HEAD_KV);
+    fill(q_data, 1.0f);
+    fill(k_data, 2.0f);
+
+    ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_q, N_HEAD);
+    memcpy(q->data, q_data.data(), ggml_nbytes(q));
+
+    ggml_tensor * k = new_f16(ctx, k_data, D, n_kv, N_HEAD_KV);
+
+    ggml_tensor * v;
+    if (type_v == GGML_TYPE_F16) {
+        v = new_f16(ctx, v_data, D, n_kv, N_HEAD_KV);
+    } else {
+        v = ggml_new_tensor_3d(ctx, type_v, D, n_kv, N_HEAD_KV);
+        ggml_quantize_chunk(type_v, v_data.data(), v->data, 0, n_kv*N_HEAD_KV, D, NULL);
+    }
+
+    ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, NULL, 1.0f/sqrtf(D), 0.0f, 0.0f);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    std::vector<float> res(ggml_nelements(out));
+    memcpy(res.data(), out->data, ggml_nbytes(out));
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+static double nmse(const std::vector<float> & a, const std::vector<float> & b) {
+    double mse_a_b = 0.0;
+    double mse_a_0 = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        mse_a_b += (a[i] - b[i])*(a[i] - b[i]);
+        mse_a_0 += a[i]*a[i];
+    }
+    return mse_a_b/mse_a_0;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    // Initialize GGML, ensures float conversion tables are initialized before the data is quantized
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 1*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    int num_failed = 0;
+
+    for (ggml_type type_v : { GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        // a single row (split over the KV cells with several threads) and a batch of rows
+        for (int64_t n_q : { 1, 7 }) {
+            for (int64_t n_kv : { 32, 512 }) {
+                std::vector<float> v_data(D*n_kv*N_HEAD_KV);
+                fill(v_data, 3.0f);
+
+                // the reference uses the values that the quantized V holds
+                std::vector<uint8_t> v_q(ggml_row_size(type_v, D)*n_kv*N_HEAD_KV);
+                ggml_quantize_chunk(type_v, v_data.data(), v_q.data(), 0, n_kv*N_HEAD_KV, D, NULL);
+                std::vector<float> v_deq(v_data.size());
+                ggml_get_type_traits(type_v)->to_float(v_q.data(), v_deq.data(), v_deq.size());
+
+                const auto ref = run(GGML_TYPE_F16, v_deq, n_q, n_kv, 1);
+
+                for (int n_threads : { 1, 4 }) {
+                    const auto res = run(type_v, v_data, n_q, n_kv, n_threads);
+
+                    const double err = nmse(ref, res);
+                    const bool failed = !(err <= MAX_NMSE);
+                    num_failed += failed;
+                    if (failed || verbose) {
+                        printf("%5s, n_q = %lld, n_kv = %3lld, %d threads: nmse %g (%s)\n", ggml_type_name(type_v),
+                            (long long) n_q, (long long) n_kv, n_threads, err, failed ? "FAILED" : "ok");
+                    }
+                }
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
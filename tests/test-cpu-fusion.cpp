@@ -0,0 +1,223 @@
+// Checks that the chains of elementwise ops that the CPU backend computes together (norm -> mul, silu/gelu -> mul,
+// rope -> cpy) give the same results as the separate ops, with one and several threads, and that the chains are fused
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr int64_t N_EMBD = 64;
+constexpr int64_t N_ROWS = 37; // not a multiple of the number of threads
+
+static void set_fusion(bool enabled) {
+#ifdef _WIN32
+    _putenv_s("GGML_CPU_DISABLE_FUSION", enabled ? "" : "1");
+#else
+    if (enabled) {
+        unsetenv("GGML_CPU_DISABLE_FUSION");
+    } else {
+        setenv("GGML_CPU_DISABLE_FUSION", "1", 1);
+    }
+#endif
+}
+
+static ggml_tensor * new_input(ggml_context * ctx, int64_t ne0, int64_t ne1, float offset) {
+    ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ne0*ne1; i++) {
+        data[i] = 0.1f + 2*cosf(i + offset);
+    }
+    return t;
+}
+
+// builds the graph and sets its inputs, returns the nodes whose results are compared
+typedef std::function<std::vector<ggml_tensor *>(ggml_context * ctx)> build_fn;
+
+static ggml_tensor * build_norm_mul(ggml_context * ctx, ggml_tensor * x, bool rms, std::vector<ggml_tensor *> & out) {
+    ggml_tensor * w    = new_input(ctx, N_EMBD, 1, 7.0f);
+    ggml_tensor * norm = rms ? ggml_rms_norm(ctx, x, 1e-6f) : ggml_norm(ctx, x, 1e-5f);
+    ggml_tensor * mul  = ggml_mul(ctx, norm, w);
+    out.push_back(norm);
+    out.push_back(mul);
+    return norm;
+}
+
+static std::vector<ggml_tensor *> build_glu(ggml_context * ctx, ggml_unary_op op, bool swapped) {
+    ggml_tensor * g   = new_input(ctx, N_EMBD, N_ROWS, 1.0f);
+    ggml_tensor * u   = new_input(ctx, N_EMBD, N_ROWS, 2.0f);
+    ggml_tensor * act = ggml_unary(ctx, g, op);
+    ggml_tensor * mul = swapped ? ggml_mul(ctx, u, act) : ggml_mul(ctx, act, u);
+    return { act, mul };
+}
+
+static std::vector<ggml_tensor *> build_rope_cpy(ggml_context * ctx, ggml_type type) {
+    const int n_head = 4;
+
+    ggml_tensor * x = ggml_reshape_3d(ctx, new_input(ctx, N_EMBD, n_head*N_ROWS, 3.0f), N_EMBD, n_head, N_ROWS);
+    ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, N_ROWS);
+    for (int i = 0; i < N_ROWS; i++) {
+        ((int32_t *) pos->data)[i] = 5 + 3*i;
+    }
+
+    ggml_tensor * rope = ggml_rope(ctx, x, pos, N_EMBD, 0);
+    ggml_tensor * dst  = ggml_new_tensor_2d(ctx, type, N_EMBD*n_head, N_ROWS);
+    ggml_tensor * cpy  = ggml_cpy(ctx, rope, dst);
+    return { rope, cpy };
+}
+
+// add -> rms_norm -> mul with the result of the norm placed one row after (or before) the first input of the add, in
+// the same memory, as the graph allocator can do once the input is no longer used. each thread must not overwrite the
+// input rows of the others, or its own next rows
+static std::vector<ggml_tensor *> build_aliased(ggml_context * ctx, int shift) {
+    ggml_tensor * pool = new_input(ctx, N_EMBD, N_ROWS + 1, 4.0f);
+    ggml_tensor * a    = ggml_view_2d(ctx, pool, N_EMBD, N_ROWS, pool->nb[1], shift > 0 ? 0 : pool->nb[1]);
+    ggml_tensor * b    = new_input(ctx, N_EMBD, N_ROWS, 5.0f);
+    ggml_tensor * add  = ggml_add(ctx, a, b);
+
+    std::vector<ggml_tensor *> out = { add };
+    ggml_tensor * norm = build_norm_mul(ctx, add, true, out);
+    norm->data = (char *) a->data + shift*pool->nb[1];
+
+    // the norm overwrites the input rows, so only the add and the mul are compared
+    return { out[0], out[2] };
+}
+
+// n_fused: number of nodes that were computed in fused chains
+static std::vector<std::vector<float>> run(const build_fn & build, bool fusion, int n_threads, int & n_fused) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::vector<ggml_tensor *> out = build(ctx);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    for (ggml_tensor * t : out) {
+        ggml_build_forward_expand(gf, t);
+    }
+
+    // the environment is read when the threadpool is created
+    set_fusion(fusion);
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    struct ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+    set_fusion(true);
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, threadpool);
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+    ggml_graph_compute(gf, &cplan);
+    n_fused = ggml_threadpool_get_n_fused(threadpool);
+    ggml_threadpool_free(threadpool);
+
+    std::vector<std::vector<float>> res;
+    for (ggml_tensor * t : out) {
+        std::vector<float> values(ggml_nelements(t));
+        const ggml_type_traits * traits = ggml_get_type_traits(t->type);
+        if (t->type == GGML_TYPE_F32) {
+            memcpy(values.data(), t->data, ggml_nbytes(t));
+        } else {
+            traits->to_float(t->data, values.data(), values.size());
+        }
+        res.push_back(std::move(values));
+    }
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    struct test {
+        std::string name;
+        build_fn    build;
+        int         n_fused; // nodes expected in fused chains when the fusion is on
+    };
+
+    const std::vector<test> tests = {
+        { "rms_norm -> mul", [](ggml_context * ctx) {
+            std::vector<ggml_tensor *> out;
+            build_norm_mul(ctx, new_input(ctx, N_EMBD, N_ROWS, 0.0f), true, out);
+            return out;
+        }, 2 },
+        { "norm -> mul", [](ggml_context * ctx) {
+            std::vector<ggml_tensor *> out;
+            build_norm_mul(ctx, new_input(ctx, N_EMBD, N_ROWS, 0.0f), false, out);
+            return out;
+        }, 2 },
+        { "add -> rms_norm -> mul", [](ggml_context * ctx) {
+            ggml_tensor * add = ggml_add(ctx, new_input(ctx, N_EMBD, N_ROWS, 0.0f), new_input(ctx, N_EMBD, N_ROWS, 1.0f));
+            std::vector<ggml_tensor *> out = { add };
+            build_norm_mul(ctx, add, true, out);
+            return out;
+        }, 3 },
+        { "silu -> mul",           [](ggml_context * ctx) { return build_glu(ctx, GGML_UNARY_OP_SILU, false); }, 2 },
+        { "gelu -> mul (swapped)", [](ggml_context * ctx) { return build_glu(ctx, GGML_UNARY_OP_GELU, true); }, 2 },
+        { "rope -> cpy f32",       [](ggml_context * ctx) { return build_rope_cpy(ctx, GGML_TYPE_F32); }, 2 },
+        { "rope -> cpy f16",       [](ggml_context * ctx) { return build_rope_cpy(ctx, GGML_TYPE_F16); }, 2 },
+        { "rope -> cpy q8_0",      [](ggml_context * ctx) { return build_rope_cpy(ctx, GGML_TYPE_Q8_0); }, 2 },
+        // the add is not fused with the norm, which overwrites the input rows of the other threads
+        { "aliased next row",      [](ggml_context * ctx) { return build_aliased(ctx, +1); }, 2 },
+        { "aliased previous row",  [](ggml_context * ctx) { return build_aliased(ctx, -1); }, 2 },
+    };
+
+    int num_failed = 0;
+
+    for (const auto & test : tests) {
+        // the separate ops on a single thread
+        int n_fused = 0;
+        const auto ref = run(test.build, false, 1, n_fused);
+
+        for (bool fusion : { false, true }) {
+            for (int n_threads : { 1, 4 }) {
+                const auto res = run(test.build, fusion, n_threads, n_fused);
+
+                float max_err = 0.0f;
+                for (size_t k = 0; k < ref.size(); k++) {
+                    for (size_t i = 0; i < ref[k].size(); i++) {
+                        max_err = fmaxf(max_err, fabsf(res[k][i] - ref[k][i]));
+                    }
+                }
+
+                const bool failed = !(max_err <= 1e-6f) || n_fused != (fusion ? test.n_fused : 0);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%24s, fusion %-3s, %d threads: max error %g, %d fused nodes (%s)\n", test.name.c_str(),
+                        fusion ? "on" : "off", n_threads, max_err, n_fused, failed ? "FAILED" : "ok");
+                }
+            }
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
@@ -0,0 +1,239 @@
+// Checks the mul_mat of the weights that the CPU_AARCH64 buffer type repacks into interleaved rows against vec_dot on
+// the original rows, for the gemv (one src1 row) and gemm (groups of 4 src1 rows, plus the remaining rows) kernels
+// and the mul_mat_id of repacked expert weights
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr float MAX_MUL_MAT_ERROR = 0.00001f;
+
+static void generate_data(float offset, size_t n, float * dst) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = 0.1f + 2*cosf(i + offset);
+    }
+}
+
+// the repack of every tensor is logged at the debug level
+static void log_callback(ggml_log_level level, const char * text, void * user_data) {
+    if (level != GGML_LOG_LEVEL_DEBUG) {
+        fputs(text, stderr);
+    }
+    (void) user_data;
+}
+
+static ggml_backend_buffer_type_t get_repack_buffer_type(ggml_backend_dev_t dev) {
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+    auto get_extra_bufts = (ggml_backend_dev_get_extra_bufts_t)
+        ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts");
+    if (!get_extra_bufts) {
+        return nullptr;
+    }
+    for (ggml_backend_buffer_type_t * buft = get_extra_bufts(dev); buft && *buft; ++buft) {
+        if (strcmp(ggml_backend_buft_name(*buft), "CPU_AARCH64") == 0) {
+            return *buft;
+        }
+    }
+    return nullptr;
+}
+
+// number of experts used by each src1 row in the mul_mat_id tests
+constexpr int64_t N_EXPERT_USED = 2;
+
+// max error of src0 x src1 computed by the CPU backend with src0 repacked, relative to the magnitude of the
+// reference dot products
+// with n_expert > 0, src0 holds n_expert matrices and the product is a mul_mat_id, where each of the m src1 tokens
+// uses N_EXPERT_USED of them
+static float mul_mat_error(ggml_backend_t backend, ggml_backend_buffer_type_t repack_buft, ggml_type type,
+        int64_t k, int64_t n, int64_t m, int n_threads, int64_t n_expert = 0) {
+    const ggml_type_traits_cpu * qfns      = ggml_get_type_traits_cpu(type);
+    const ggml_type              vdot_type = qfns->vec_dot_type;
+
+    const int64_t n_mat  = n_expert > 0 ? n_expert : 1;
+    const int64_t n_used = n_expert > 0 ? N_EXPERT_USED : 1;
+    const int64_t n_x    = n_used*m; // rows of src1
+
+    // the experts of each src1 row, all different for a token
+    std::vector<int32_t> ids(n_x, 0);
+    for (int64_t j = 0; j < m; j++) {
+        for (int64_t s = 0; s < n_used; s++) {
+            ids[j*n_used + s] = (j + s) % n_mat;
+        }
+    }
+
+    std::vector<float> w(k*n*n_mat);
+    std::vector<float> x(k*n_x);
+    generate_data(0.0f, w.size(), w.data());
+    generate_data(1.0f, x.size(), x.data());
+
+    const size_t w_row_size = ggml_row_size(type, k);
+    const size_t x_row_size = ggml_row_size(vdot_type, k);
+
+    std::vector<uint8_t> wq(w_row_size*n*n_mat);
+    std::vector<uint8_t> xq(x_row_size*n_x);
+    ggml_quantize_chunk(type, w.data(), wq.data(), 0, n*n_mat, k, nullptr);
+    for (int64_t j = 0; j < n_x; j++) {
+        ggml_get_type_traits_cpu(vdot_type)->from_float(x.data() + j*k, xq.data() + j*x_row_size, k);
+    }
+
+    // the reference: one vec_dot per output value, on the rows as they were quantized
+    std::vector<float> ref(n*n_x);
+    float ref_max = 0.0f;
+    for (int64_t j = 0; j < n_x; j++) {
+        const uint8_t * wq_mat = wq.data() + ids[j]*n*w_row_size;
+        for (int64_t i = 0; i < n; i++) {
+            qfns->vec_dot(k, &ref[j*n + i], 0, wq_mat + i*w_row_size, 0, xq.data() + j*x_row_size, 0, 1);
+            ref_max = fmaxf(ref_max, fabsf(ref[j*n + i]));
+        }
+    }
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 8*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    ggml_context * ctx_w = ggml_init(params);
+    ggml_tensor  * src0  = n_expert > 0 ? ggml_new_tensor_3d(ctx_w, type, k, n, n_expert) : ggml_new_tensor_2d(ctx_w, type, k, n);
+    ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, repack_buft);
+    assert(src0->extra != nullptr && "the tensor is not repacked");
+    ggml_backend_tensor_set(src0, wq.data(), 0, wq.size());
+
+    ggml_context * ctx = ggml_init(params);
+    ggml_tensor  * src1;
+    ggml_tensor  * dst;
+    ggml_tensor  * ids_t = nullptr;
+    if (n_expert > 0) {
+        src1  = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, k, n_used, m);
+        ids_t = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_used, m);
+        dst   = ggml_mul_mat_id(ctx, src0, src1, ids_t);
+    } else {
+        src1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, m);
+        dst  = ggml_mul_mat(ctx, src0, src1);
+    }
+    ggml_cgraph  * gf   = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, dst);
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    ggml_backend_tensor_set(src1, x.data(), 0, ggml_nbytes(src1));
+    if (ids_t) {
+        ggml_backend_tensor_set(ids_t, ids.data(), 0, ggml_nbytes(ids_t));
+    }
+
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+    ggml_backend_graph_compute(backend, gf);
+
+    std::vector<float> res(n*n_x);
+    ggml_backend_tensor_get(dst, res.data(), 0, ggml_nbytes(dst));
+
+    float max_err = 0.0f;
+    for (size_t i = 0; i < res.size(); i++) {
+        max_err = fmaxf(max_err, fabsf(res[i] - ref[i]));
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx);
+    ggml_free(ctx_w);
+
+    return max_err/fmaxf(ref_max, 1.0f);
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    ggml_log_set(log_callback, nullptr);
+
+    ggml_backend_dev_t         dev         = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_buffer_type_t repack_buft = dev ? get_repack_buffer_type(dev) : nullptr;
+
+    // the types repacked on this CPU
+    std::vector<ggml_type> types;
+    if (!repack_buft) {
+        printf("the CPU backend has no CPU_AARCH64 buffer type, skipping\n");
+        return 0;
+    }
+    if (ggml_cpu_has_avx2()) {
+        types = { GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K };
+    } else if (ggml_cpu_has_neon() && (ggml_cpu_has_matmul_int8() || ggml_cpu_has_dotprod())) {
+        types = { GGML_TYPE_Q4_0 };
+        if (ggml_cpu_has_dotprod()) {
+            types.push_back(GGML_TYPE_IQ4_NL);
+        }
+    }
+    if (types.empty()) {
+        printf("no type is repacked on this CPU, skipping\n");
+        return 0;
+    }
+
+    ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
+
+    int num_failed = 0;
+
+    for (ggml_type type : types) {
+        // the K-quants need multiples of 256 values per row
+        for (int64_t k : { 256, 768 }) {
+            for (int64_t n : { 8, 40 }) {
+                // gemv for a single src1 row, gemm for groups of 4 and gemv for the rows after the last group
+                for (int64_t m : { 1, 2, 3, 4, 5, 7, 8, 13 }) {
+                    for (int n_threads : { 1, 3 }) {
+                        const float err = mul_mat_error(backend, repack_buft, type, k, n, m, n_threads);
+
+                        const bool failed = !(err < MAX_MUL_MAT_ERROR);
+                        num_failed += failed;
+                        if (failed || verbose) {
+                            printf("%6s: k = %3d, n = %2d, m = %2d, %d threads: error %g (%s)\n", ggml_type_name(type),
+                                (int) k, (int) n, (int) m, n_threads, err, failed ? "FAILED" : "ok");
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // the experts of a mul_mat_id, repacked as one tensor
+    for (ggml_type type : types) {
+        for (int64_t m : { 1, 4, 7 }) {
+            for (int n_threads : { 1, 3 }) {
+                const float err = mul_mat_error(backend, repack_buft, type, 256, 16, m, n_threads, 4);
+
+                const bool failed = !(err < MAX_MUL_MAT_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%6s mul_mat_id: k = 256, n = 16, 4 experts, m = %d, %d threads: error %g (%s)\n",
+                        ggml_type_name(type), (int) m, n_threads, err, failed ? "FAILED" : "ok");
+                }
+            }
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    ggml_backend_free(backend);
+
+    return num_failed > 0;
+}
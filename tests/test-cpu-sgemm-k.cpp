@@ -0,0 +1,146 @@
+// Checks the mul_mat of the Q4_K, Q5_K and Q6_K weights in a plain CPU buffer against vec_dot on the weight rows:
+// the llamafile sgemm computes them from 8 src1 rows, and with fewer rows it declines them, so that the mul_mat falls
+// back to vec_dot
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr float MAX_MUL_MAT_ERROR = 0.00001f;
+
+static void generate_data(float offset, size_t n, float * dst) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = 0.1f + 2*cosf(i + offset);
+    }
+}
+
+// max error of src0 x src1 computed by the CPU backend, relative to the magnitude of the reference dot products
+static float mul_mat_error(ggml_backend_t backend, ggml_type type, int64_t k, int64_t n, int64_t m, int n_threads) {
+    const ggml_type_traits_cpu * qfns      = ggml_get_type_traits_cpu(type);
+    const ggml_type              vdot_type = qfns->vec_dot_type;
+
+    std::vector<float> w(k*n);
+    std::vector<float> x(k*m);
+    generate_data(0.0f, w.size(), w.data());
+    generate_data(1.0f, x.size(), x.data());
+
+    const size_t w_row_size = ggml_row_size(type, k);
+    const size_t x_row_size = ggml_row_size(vdot_type, k);
+
+    std::vector<uint8_t> wq(w_row_size*n);
+    std::vector<uint8_t> xq(x_row_size*m);
+    ggml_quantize_chunk(type, w.data(), wq.data(), 0, n, k, nullptr);
+    for (int64_t j = 0; j < m; j++) {
+        ggml_get_type_traits_cpu(vdot_type)->from_float(x.data() + j*k, xq.data() + j*x_row_size, k);
+    }
+
+    // the reference: one vec_dot per output value, as the fallback computes them
+    std::vector<float> ref(n*m);
+    float ref_max = 0.0f;
+    for (int64_t j = 0; j < m; j++) {
+        for (int64_t i = 0; i < n; i++) {
+            qfns->vec_dot(k, &ref[j*n + i], 0, wq.data() + i*w_row_size, 0, xq.data() + j*x_row_size, 0, 1);
+            ref_max = fmaxf(ref_max, fabsf(ref[j*n + i]));
+        }
+    }
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    ggml_context * ctx  = ggml_init(params);
+    ggml_tensor  * src0 = ggml_new_tensor_2d(ctx, type, k, n);
+    ggml_tensor  * src1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, m);
+    ggml_tensor  * dst  = ggml_mul_mat(ctx, src0, src1);
+    ggml_cgraph  * gf   = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, dst);
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    ggml_backend_tensor_set(src0, wq.data(), 0, wq.size());
+    ggml_backend_tensor_set(src1, x.data(), 0, ggml_nbytes(src1));
+
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+    ggml_backend_graph_compute(backend, gf);
+
+    std::vector<float> res(n*m);
+    ggml_backend_tensor_get(dst, res.data(), 0, ggml_nbytes(dst));
+
+    float max_err = 0.0f;
+    for (size_t i = 0; i < res.size(); i++) {
+        max_err = fmaxf(max_err, fabsf(res[i] - ref[i]));
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return max_err/fmaxf(ref_max, 1.0f);
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (!ggml_cpu_has_llamafile() || !ggml_cpu_has_avx2()) {
+        printf("the llamafile sgemm does not compute the K-quants on this CPU, skipping\n");
+        return 0;
+    }
+
+    ggml_backend_t backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
+    assert(backend != nullptr);
+
+    int num_failed = 0;
+
+    for (ggml_type type : { GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K }) {
+        // the K-quants need multiples of 256 values per row
+        for (int64_t k : { 256, 768 }) {
+            // a number of weight rows that is not a multiple of the tiles
+            for (int64_t n : { 8, 37 }) {
+                for (int64_t m : { 1, 2, 7, 8, 9, 13, 16, 33 }) {
+                    for (int n_threads : { 1, 3 }) {
+                        const float err = mul_mat_error(backend, type, k, n, m, n_threads);
+
+                        // below 8 src1 rows the sgemm is not used, and the fallback gives the reference exactly
+                        const bool fallback = m < 8;
+                        const bool failed   = fallback ? err != 0.0f : !(err < MAX_MUL_MAT_ERROR);
+                        num_failed += failed;
+                        if (failed || verbose) {
+                            printf("%6s %s: k = %3d, n = %2d, m = %2d, %d threads: error %g (%s)\n", ggml_type_name(type),
+                                fallback ? "fallback" : "sgemm", (int) k, (int) n, (int) m, n_threads, err,
+                                failed ? "FAILED" : "ok");
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    ggml_backend_free(backend);
+
+    return num_failed > 0;
+}
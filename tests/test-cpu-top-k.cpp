@@ -0,0 +1,143 @@
+// Checks the CPU argsort and top_k against std::sort and std::partial_sort on the same rows, with one and several
+// threads. the values at the returned indices are compared, so that rows with ties have a single valid result
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr int64_t N_ROWS = 5;
+
+// n rows of ne0 values, with ties if n_distinct < ne0
+static std::vector<float> generate_rows(int64_t ne0, int64_t n_distinct, std::mt19937 & rng) {
+    std::uniform_int_distribution<int64_t> dist(0, n_distinct - 1);
+    std::vector<float> data(ne0*N_ROWS);
+    for (float & v : data) {
+        v = (float) dist(rng) - n_distinct/2;
+    }
+    return data;
+}
+
+// op: argsort (k == 0) or top_k (k > 0), returns the indices of each row
+static std::vector<int32_t> run(const std::vector<float> & data, int64_t ne0, enum ggml_sort_order order, int k, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 4*ne0*N_ROWS*sizeof(float) + 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, N_ROWS);
+    memcpy(a->data, data.data(), ggml_nbytes(a));
+
+    ggml_tensor * out = k > 0 ? ggml_top_k(ctx, a, k) : ggml_argsort(ctx, a, order);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    std::vector<int32_t> res(ggml_nelements(out));
+    memcpy(res.data(), out->data, ggml_nbytes(out));
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+// checks that the n_out indices of each row are distinct and select the same values as the reference sort
+static bool check(const std::vector<float> & data, int64_t ne0, enum ggml_sort_order order, int64_t n_out, const std::vector<int32_t> & res) {
+    for (int64_t r = 0; r < N_ROWS; r++) {
+        const float   * row = data.data() + r*ne0;
+        const int32_t * idx = res.data() + r*n_out;
+
+        std::vector<float> ref(row, row + ne0);
+        if (order == GGML_SORT_ORDER_ASC) {
+            std::partial_sort(ref.begin(), ref.begin() + n_out, ref.end());
+        } else {
+            std::partial_sort(ref.begin(), ref.begin() + n_out, ref.end(), std::greater<float>());
+        }
+
+        std::vector<bool> seen(ne0, false);
+        for (int64_t i = 0; i < n_out; i++) {
+            if (idx[i] < 0 || idx[i] >= ne0 || seen[idx[i]]) {
+                return false;
+            }
+            seen[idx[i]] = true;
+            if (row[idx[i]] != ref[i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(42);
+
+    int num_failed = 0;
+
+    // a single value, rows that fit in a cache line, and vocab-sized rows
+    for (int64_t ne0 : { 1, 7, 100, 1000, 32000 }) {
+        // distinct values, and many ties
+        for (int64_t n_distinct : { 4*ne0, std::max<int64_t>(ne0/8, 1) }) {
+            const std::vector<float> data = generate_rows(ne0, n_distinct, rng);
+
+            for (int n_threads : { 1, 4 }) {
+                for (enum ggml_sort_order order : { GGML_SORT_ORDER_ASC, GGML_SORT_ORDER_DESC }) {
+                    const bool failed = !check(data, ne0, order, ne0, run(data, ne0, order, 0, n_threads));
+                    num_failed += failed;
+                    if (failed || verbose) {
+                        printf("argsort %4s: ne0 = %5lld, %5lld distinct values, %d threads: %s\n",
+                            order == GGML_SORT_ORDER_ASC ? "asc" : "desc", (long long) ne0, (long long) n_distinct,
+                            n_threads, failed ? "FAILED" : "ok");
+                    }
+                }
+
+                for (int64_t k : { 1, 5, 40, 1000 }) {
+                    if (k > ne0) {
+                        continue;
+                    }
+                    const bool failed = !check(data, ne0, GGML_SORT_ORDER_DESC, k, run(data, ne0, GGML_SORT_ORDER_DESC, k, n_threads));
+                    num_failed += failed;
+                    if (failed || verbose) {
+                        printf("top_k k = %4lld: ne0 = %5lld, %5lld distinct values, %d threads: %s\n",
+                            (long long) k, (long long) ne0, (long long) n_distinct, n_threads, failed ? "FAILED" : "ok");
+                    }
+                }
+            }
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
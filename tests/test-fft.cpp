@@ -0,0 +1,109 @@
+#include "fft.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// naive DFT of a real sequence, X[n/2 + 1] interleaved
+static std::vector<double> dft(const std::vector<float> & x) {
+    const int n = x.size();
+
+    std::vector<double> X(2*(n/2 + 1));
+    for (int k = 0; k <= n/2; ++k) {
+        double re = 0.0;
+        double im = 0.0;
+        for (int j = 0; j < n; ++j) {
+            const double a = -2.0*M_PI*(double)((int64_t) j*k % n)/(double) n;
+            re += x[j]*cos(a);
+            im += x[j]*sin(a);
+        }
+        X[2*k + 0] = re;
+        X[2*k + 1] = im;
+    }
+
+    return X;
+}
+
+static void test_size(int n, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> x(n);
+    for (auto & v : x) {
+        v = dist(rng);
+    }
+
+    common_fft fft(n);
+    assert(fft.size() == n);
+
+    // forward
+    const std::vector<double> ref = dft(x);
+
+    std::vector<float> X(2*(n/2 + 1));
+    fft.forward(x.data(), X.data());
+
+    double err = 0.0;
+    for (size_t i = 0; i < X.size(); ++i) {
+        err = std::max(err, std::fabs(X[i] - ref[i]));
+    }
+    const double tol_fwd = 1e-6*n;
+
+    // inverse of the reference spectrum, with garbage in the ignored imaginary parts
+    std::vector<float> Y(ref.begin(), ref.end());
+    Y[1]            = 123.0f;
+    Y[Y.size() - 1]  = -45.0f;
+
+    std::vector<float> y(n);
+    fft.inverse(Y.data(), y.data());
+
+    double err_inv = 0.0;
+    for (int j = 0; j < n; ++j) {
+        err_inv = std::max(err_inv, (double) std::fabs(y[j] - x[j]));
+    }
+
+    // round trip
+    fft.inverse(X.data(), y.data());
+
+    double err_rt = 0.0;
+    for (int j = 0; j < n; ++j) {
+        err_rt = std::max(err_rt, (double) std::fabs(y[j] - x[j]));
+    }
+
+    printf("n = %5d: forward err = %.3e, inverse err = %.3e, round trip err = %.3e\n", n, err, err_inv, err_rt);
+
+    assert(err     < tol_fwd);
+    assert(err_inv < 1e-5);
+    assert(err_rt  < 1e-5);
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    // radix 2, 3, 4, 5, generic primes and mixes of them - 1280 is the size used by the TTS vocoder
+    for (int n : { 2, 4, 6, 8, 10, 14, 16, 22, 30, 32, 42, 60, 96, 210, 250, 286, 1000, 1024, 1280, 2048 }) {
+        test_size(n, rng);
+    }
+
+    // bad sizes
+    for (int n : { 0, 1, 7 }) {
+        bool threw = false;
+        try {
+            common_fft fft(n);
+        } catch (const std::invalid_argument &) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    return 0;
+}
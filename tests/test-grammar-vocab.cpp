@@ -0,0 +1,177 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-grammar.h"
+#include "llama-vocab.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// checks that the tokens allowed by a grammar compiled against a real vocab are the same as those found by
+// matching the piece of each candidate against the stacks
+
+static std::vector<bool> get_allowed(const llama_grammar & grammar, const std::vector<llama_token> & ids) {
+    std::vector<llama_token_data> data;
+    data.reserve(ids.size());
+    for (const llama_token id : ids) {
+        data.push_back({ id, 0.0f, 0.0f });
+    }
+
+    llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    std::vector<bool> allowed(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        allowed[i] = std::isfinite(cur_p.data[i].logit);
+    }
+    return allowed;
+}
+
+static bool check_allowed(const llama_vocab * vocab, const llama_grammar & compiled, const llama_grammar & reference,
+        const std::vector<llama_token> & ids, size_t step) {
+    const auto allowed_compiled  = get_allowed(compiled,  ids);
+    const auto allowed_reference = get_allowed(reference, ids);
+
+    size_t n_mismatch = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (allowed_compiled[i] != allowed_reference[i]) {
+            if (n_mismatch++ < 5) {
+                fprintf(stderr, "    step %zu: token %d '%s' is %s by the compiled grammar only\n", step, ids[i],
+                    vocab->token_to_piece(ids[i]).c_str(), allowed_compiled[i] ? "allowed" : "rejected");
+            }
+        }
+    }
+    return n_mismatch == 0;
+}
+
+// the longest allowed token whose piece is a prefix of the remaining text, or the token of the first byte
+static llama_token next_token(const llama_vocab * vocab, const llama_grammar & grammar, const std::string & text, bool bytes) {
+    const llama_token byte = vocab->byte_to_token(text[0]);
+    if (bytes) {
+        return byte;
+    }
+
+    std::vector<llama_token> ids(vocab->n_tokens());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i] = i;
+    }
+    const auto allowed = get_allowed(grammar, ids);
+
+    llama_token best = byte;
+    size_t best_len = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const std::string & piece = vocab->token_to_piece(ids[i]);
+        if (allowed[i] && !vocab->is_eog(ids[i]) && piece.size() > best_len && text.compare(0, piece.size(), piece) == 0) {
+            best     = ids[i];
+            best_len = piece.size();
+        }
+    }
+    return best;
+}
+
+// feeds the text to the grammar and compares the allowed tokens before each token, for the full vocab and for a
+// small set of candidates, which only uses the allowed tokens of the compiled grammar when they are cached
+static bool test_grammar(const llama_vocab * vocab, const std::string & name, const std::string & grammar_str, const std::string & text, bool bytes) {
+    fprintf(stderr, "⚫ Testing %s%s\n", name.c_str(), bytes ? " (byte tokens)" : "");
+
+    llama_grammar * compiled  = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root");
+    llama_grammar * reference = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root");
+    assert(compiled != nullptr && compiled->compiled != nullptr);
+    reference->compiled = nullptr;
+
+    const int n_vocab = vocab->n_tokens();
+
+    std::vector<llama_token> all(n_vocab);
+    std::vector<llama_token> few;
+    for (int i = 0; i < n_vocab; ++i) {
+        all[i] = i;
+        if (i % 97 == 0) {
+            few.push_back(i);
+        }
+    }
+
+    bool ok = true;
+    size_t step = 0;
+    for (size_t pos = 0; ok; ++step) {
+        ok = check_allowed(vocab, *compiled, *reference, few, step) &&
+             check_allowed(vocab, *compiled, *reference, all, step) &&
+             check_allowed(vocab, *compiled, *reference, few, step);
+
+        if (pos == text.size()) {
+            break;
+        }
+
+        const llama_token token = next_token(vocab, *reference, text.substr(pos), bytes);
+        if (!get_allowed(*reference, { token })[0]) {
+            fprintf(stderr, "    step %zu: token %d '%s' does not match the grammar\n", step, token, vocab->token_to_piece(token).c_str());
+            ok = false;
+            break;
+        }
+
+        llama_grammar_accept_impl(*compiled,  token);
+        llama_grammar_accept_impl(*reference, token);
+
+        pos += vocab->token_to_piece(token).size();
+    }
+
+    fprintf(stderr, "  %s after %zu tokens\n", ok ? "✅︎" : "❌", step);
+
+    llama_grammar_free_impl(compiled);
+    llama_grammar_free_impl(reference);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const std::string object_grammar = R"""(
+        root  ::= "{" ws pair ("," ws pair)* ws "}"
+        pair  ::= "\"" [a-z]+ "\"" ws ":" ws [0-9]+
+        ws    ::= [ \t\n]*)""";
+
+    const std::string string_grammar = R"""(
+        root  ::= "\"" ( [^"\\] | "\\" ["\\/bfnrt] )* "\"")""";
+
+    const std::string repeat_grammar = R"""(
+        root  ::= word{2,3} (" " word{2,3})*
+        word  ::= [a-z])""";
+
+    const std::string utf8_grammar = R"""(
+        root  ::= "日本" [ぁ-ゟ]+ "。" | [А-я]+)""";
+
+    bool ok = true;
+    for (bool bytes : { false, true }) {
+        ok = test_grammar(vocab, "object", object_grammar, "{\"ab\": 12, \"cd\": 345}",  bytes) && ok;
+        ok = test_grammar(vocab, "string", string_grammar, "\"he said \\\"hi\\\" ok\"", bytes) && ok;
+        ok = test_grammar(vocab, "repeat", repeat_grammar, "ab cde fg",                  bytes) && ok;
+        ok = test_grammar(vocab, "utf8",   utf8_grammar,   "日本のことは。",              bytes) && ok;
+        ok = test_grammar(vocab, "utf8",   utf8_grammar,   "Привет",                     bytes) && ok;
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+// Checks that a decode graph that is reused for the next ubatch gives the same logits as a graph that is built again,
+// and that a change of the batch shape, of the adapters or of the KV cache layout builds a new graph
+
+#include "llama.h"
+#include "get-model.h"
+
+#include "ggml.h"
+#include "gguf.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+static const char * FNAME_ADAPTER = "test-graph-reuse-lora.gguf";
+
+static void set_graph_reuse(bool enabled) {
+#ifdef _WIN32
+    _putenv_s("LLAMA_GRAPH_REUSE_DISABLE", enabled ? "" : "1");
+#else
+    if (enabled) {
+        unsetenv("LLAMA_GRAPH_REUSE_DISABLE");
+    } else {
+        setenv("LLAMA_GRAPH_REUSE_DISABLE", "1", 1);
+    }
+#endif
+}
+
+// a LoRA adapter with random weights for the query projection of the first layer
+static bool write_adapter(const char * fname_model) {
+    ggml_context * meta = nullptr;
+
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    gguf_context * gguf_model = gguf_init_from_file(fname_model, params);
+    if (gguf_model == nullptr) {
+        return false;
+    }
+
+    const int64_t key_arch = gguf_find_key(gguf_model, "general.architecture");
+    const ggml_tensor * w  = ggml_get_tensor(meta, "blk.0.attn_q.weight");
+
+    bool ok = false;
+
+    if (key_arch >= 0 && w != nullptr) {
+        const int64_t rank = 4;
+
+        struct ggml_init_params ip = {
+            /*.mem_size   = */ ggml_tensor_overhead()*2 + (w->ne[0] + w->ne[1])*rank*sizeof(float),
+            /*.mem_buffer = */ NULL,
+            /*.no_alloc   = */ false,
+        };
+        ggml_context * ctx = ggml_init(ip);
+
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[0], rank);
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, w->ne[1]);
+        ggml_set_name(a, "blk.0.attn_q.weight.lora_a");
+        ggml_set_name(b, "blk.0.attn_q.weight.lora_b");
+
+        std::mt19937 rng(42);
+        std::normal_distribution<float> dist(0.0f, 0.1f);
+        for (ggml_tensor * t : { a, b }) {
+            for (int64_t i = 0; i < ggml_nelements(t); i++) {
+                ((float *) t->data)[i] = dist(rng);
+            }
+        }
+
+        gguf_context * gguf = gguf_init_empty();
+        gguf_set_val_str(gguf, "general.type", "adapter");
+        gguf_set_val_str(gguf, "general.architecture", gguf_get_val_str(gguf_model, key_arch));
+        gguf_set_val_str(gguf, "adapter.type", "lora");
+        gguf_set_val_f32(gguf, "adapter.lora.alpha", (float) rank);
+        gguf_add_tensor(gguf, a);
+        gguf_add_tensor(gguf, b);
+
+        ok = gguf_write_to_file(gguf, FNAME_ADAPTER, false);
+
+        gguf_free(gguf);
+        ggml_free(ctx);
+    }
+
+    gguf_free(gguf_model);
+    ggml_free(meta);
+
+    return ok;
+}
+
+struct step {
+    std::string name;
+    int         n_tokens;
+    bool        reuse; // the graph of the previous step is expected to be reused
+
+    // changes the context before the tokens are decoded, and returns the number of positions removed from the end
+    std::function<llama_pos(llama_context *)> prepare;
+};
+
+// decodes the steps in a single sequence, returns the logits of the last token of each step and whether its graph
+// was reused
+static void run(llama_model * model, const std::vector<step> & steps,
+        std::vector<std::vector<float>> & logits, std::vector<bool> & reused) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx      = 256;
+    cparams.n_batch    = 64;
+    cparams.n_ubatch   = 64;
+    cparams.n_seq_max  = 1;
+    cparams.flash_attn = false;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    llama_pos pos = 0;
+
+    for (const auto & s : steps) {
+        if (s.prepare) {
+            pos -= s.prepare(ctx);
+        }
+
+        batch.n_tokens = 0;
+        for (int i = 0; i < s.n_tokens; i++) {
+            const int k = batch.n_tokens++;
+            batch.token   [k]    = (100 + 37*pos) % n_vocab;
+            batch.pos     [k]    = pos++;
+            batch.n_seq_id[k]    = 1;
+            batch.seq_id  [k][0] = 0;
+            batch.logits  [k]    = i == s.n_tokens - 1;
+        }
+
+        const int32_t n_reused = llama_perf_context(ctx).n_reused;
+
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+
+        reused.push_back(llama_perf_context(ctx).n_reused > n_reused);
+
+        const float * l = llama_get_logits_ith(ctx, -1);
+        logits.emplace_back(l, l + n_vocab);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    char * model_path = get_model_or_exit(argc, argv);
+
+    bool verbose = false;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "error: failed to load the model '%s'\n", model_path);
+        return 1;
+    }
+
+    llama_adapter_lora * adapter = nullptr;
+    if (write_adapter(model_path)) {
+        adapter = llama_adapter_lora_init(model, FNAME_ADAPTER);
+        remove(FNAME_ADAPTER);
+    }
+    if (adapter == nullptr) {
+        printf("the model has no blk.0.attn_q.weight, the adapters are not tested\n");
+    }
+
+    // sets the adapters of the context or of the sequence, when there is one
+    auto set_adapter = [adapter](bool seq) {
+        return [adapter, seq](llama_context * ctx) -> llama_pos {
+            if (adapter) {
+                llama_clear_adapter_lora(ctx);
+                llama_clear_adapter_lora_seq(ctx, -1);
+                if (seq) {
+                    llama_set_adapter_lora_seq(ctx, 0, adapter, 0.5f);
+                } else {
+                    llama_set_adapter_lora(ctx, adapter, 1.0f);
+                }
+            }
+            return 0;
+        };
+    };
+
+    auto clear_adapters = [](llama_context * ctx) -> llama_pos {
+        llama_clear_adapter_lora(ctx);
+        llama_clear_adapter_lora_seq(ctx, -1);
+        return 0;
+    };
+
+    // the KV cache is padded to 32 cells without flash attention, the comments give the cells that each step uses
+    const std::vector<step> steps = {
+        { "prompt",                  16, false, nullptr }, //  0 .. 15
+        { "first token",              1, false, nullptr }, // 16
+        { "token",                    1, true,  nullptr }, // 17
+        { "two tokens",               2, false, nullptr }, // 18 .. 19
+        { "two tokens",               2, true,  nullptr }, // 20 .. 21
+        { "token",                    1, false, nullptr }, // 22
+        // the graph is reused with the KV store moved back to the removed cells
+        { "token after seq_rm",       1, true,  [](llama_context * ctx) -> llama_pos {
+            const llama_pos p = llama_kv_cache_seq_pos_max(ctx, 0) + 1;
+            llama_kv_cache_seq_rm(ctx, 0, p - 3, -1);
+            return 3;
+        } },                                               // 20
+        { "token",                    1, true,  nullptr }, // 21
+        { "context adapter",          1, adapter == nullptr, set_adapter(false) }, // 22
+        { "token",                    1, true,  nullptr }, // 23
+        { "sequence adapter",         1, adapter == nullptr, set_adapter(true) },  // 24
+        { "token",                    1, true,  nullptr }, // 25
+        { "no adapters",              1, adapter == nullptr, clear_adapters },     // 26
+        { "token",                    1, true,  nullptr }, // 27
+        { "token",                    1, true,  nullptr }, // 28
+        { "token",                    1, true,  nullptr }, // 29
+        { "token",                    1, true,  nullptr }, // 30
+        { "token",                    1, true,  nullptr }, // 31
+        { "token, larger KV window",  1, false, nullptr }, // 32
+        { "token",                    1, true,  nullptr }, // 33
+        // the K-shift graph replaces the decode graph
+        { "token after K-shift",      1, false, [](llama_context * ctx) -> llama_pos {
+            llama_kv_cache_seq_rm (ctx, 0, 1, 5);
+            llama_kv_cache_seq_add(ctx, 0, 5, -1, -4);
+            return 4;
+        } },                                               //  1
+        { "token",                    1, true,  nullptr }, //  2
+    };
+
+    std::vector<std::vector<float>> logits_ref;
+    std::vector<bool>               reused_ref;
+
+    set_graph_reuse(false);
+    run(model, steps, logits_ref, reused_ref);
+
+    std::vector<std::vector<float>> logits;
+    std::vector<bool>               reused;
+
+    set_graph_reuse(true);
+    run(model, steps, logits, reused);
+
+    int num_failed = 0;
+
+    for (size_t i = 0; i < steps.size(); i++) {
+        float max_err = 0.0f;
+        for (size_t j = 0; j < logits[i].size(); j++) {
+            max_err = std::max(max_err, fabsf(logits[i][j] - logits_ref[i][j]));
+        }
+
+        const bool failed = !(max_err <= 1e-5f) || reused[i] != steps[i].reuse || reused_ref[i];
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("%2zu %-24s: %s, max error %g (%s)\n", i, steps[i].name.c_str(), reused[i] ? "reused " : "rebuilt",
+                max_err, failed ? "FAILED" : "ok");
+        }
+    }
+
+    if (adapter) {
+        llama_adapter_lora_free(adapter);
+    }
+    llama_model_free(model);
+    llama_backend_free();
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
@@ -256,6 +256,44 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static void test_chain_candidates(const size_t n_vocab, const int top_k, const float penalty_repeat) {
+    std::vector<float> logits(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        logits[i] = 2.0f*((double)(rand())/RAND_MAX - 0.5);
+    }
+
+    auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, 0, nullptr));
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(64, penalty_repeat, 0.0f, 0.0f));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.9f, 1));
+
+    for (llama_token id = 0; id < 64; id++) {
+        llama_sampler_accept(chain, id);
+    }
+
+    // reference: full candidates array
+    std::vector<llama_token_data> cur;
+    for (llama_token id = 0; id < (llama_token) n_vocab; id++) {
+        cur.emplace_back(llama_token_data{id, logits[id], 0.0f});
+    }
+    llama_token_data_array cur_ref = { cur.data(), cur.size(), -1, false };
+    llama_sampler_apply(chain, &cur_ref);
+
+    llama_token_data_array cur_p = llama_sampler_chain_candidates(chain, logits.data(), n_vocab);
+    llama_sampler_apply(chain, &cur_p);
+
+    GGML_ASSERT(cur_p.size == cur_ref.size);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        GGML_ASSERT(cur_p.data[i].logit == cur_ref.data[i].logit);
+        GGML_ASSERT(fabs(cur_p.data[i].p - cur_ref.data[i].p) < 1e-5);
+    }
+
+    llama_sampler_free(chain);
+
+    printf("Chain candidates OK with n_vocab=%05zu top_k=%05d penalty_repeat=%f\n", n_vocab, top_k, penalty_repeat);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -292,6 +330,26 @@ static void test_perf() {
     BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
     BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+
+    {
+        std::vector<float> logits(n_vocab);
+        for (int i = 0; i < n_vocab; i++) {
+            logits[i] = data[i].logit;
+        }
+
+        auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+
+        const int n_iter = 32;
+        const int64_t t_start = ggml_time_us();
+        for (int i = 0; i < n_iter; i++) {
+            llama_token_data_array cur_p = llama_sampler_chain_candidates(chain, logits.data(), n_vocab);
+            llama_sampler_apply(chain, &cur_p);
+        }
+        const int64_t t_end = ggml_time_us();
+        llama_sampler_free(chain);
+        printf("%-43s: %8.3f us/iter\n", "llama_sampler_chain_candidates (top_k 40)", (t_end - t_start) / (float)n_iter);
+    }
 }
 
 int main(void) {
@@ -376,6 +434,13 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_chain_candidates(10000,  40, 1.0f);
+    test_chain_candidates(10000,   1, 1.0f);
+    test_chain_candidates(10000, 128, 1.0f);
+    test_chain_candidates(10000,  40, 1.5f);
+    test_chain_candidates(10000, 500, 1.0f);
+    test_chain_candidates(10000,   0, 1.0f);
+
     printf("OK\n");
 
     test_perf();
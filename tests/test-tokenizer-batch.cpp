@@ -0,0 +1,182 @@
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// checks that llama_tokenize_batch gives the same tokens as llama_tokenize on each text, and that it reports the
+// texts whose output buffer is too small the same way
+
+static std::vector<llama_token> tokenize(const llama_vocab * vocab, const std::string & text, bool add_special, bool parse_special) {
+    int32_t n = -llama_tokenize(vocab, text.data(), text.size(), nullptr, 0, add_special, parse_special);
+    if (n < 0) {
+        n = 0; // empty result
+    }
+    std::vector<llama_token> res(n);
+    const int32_t n_res = llama_tokenize(vocab, text.data(), text.size(), res.data(), res.size(), add_special, parse_special);
+    res.resize(std::max(0, n_res));
+    return res;
+}
+
+// shrink: number of tokens removed from the buffer of every third text, 0 for buffers that fit
+static bool test_batch(const llama_vocab * vocab, const std::vector<std::string> & texts, int32_t n_threads, int32_t shrink,
+        bool add_special, bool parse_special) {
+    const int32_t n_texts = texts.size();
+
+    std::vector<std::vector<llama_token>> expected(n_texts);
+    for (int32_t i = 0; i < n_texts; ++i) {
+        expected[i] = tokenize(vocab, texts[i], add_special, parse_special);
+    }
+
+    std::vector<const char *>             ptrs(n_texts);
+    std::vector<int32_t>                  lens(n_texts);
+    std::vector<std::vector<llama_token>> bufs(n_texts);
+    std::vector<llama_token *>            outs(n_texts);
+    std::vector<int32_t>                  n_max(n_texts);
+    std::vector<int32_t>                  n_tokens(n_texts, 0);
+
+    int32_t n_small = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        const int32_t n = expected[i].size();
+        const bool small = shrink > 0 && i % 3 == 0 && n > 0;
+
+        ptrs[i]  = texts[i].data();
+        lens[i]  = texts[i].size();
+        n_max[i] = small ? std::max(0, n - shrink) : n;
+        bufs[i].resize(n_max[i] + 1, LLAMA_TOKEN_NULL);
+        outs[i]  = bufs[i].data();
+
+        n_small += small;
+    }
+
+    const int32_t n_failed = llama_tokenize_batch(vocab, ptrs.data(), lens.data(), n_texts, outs.data(), n_max.data(),
+        n_tokens.data(), add_special, parse_special, n_threads);
+
+    bool ok = true;
+    if (n_failed != n_small) {
+        fprintf(stderr, "    %d texts failed, expected %d\n", n_failed, n_small);
+        ok = false;
+    }
+
+    for (int32_t i = 0; i < n_texts && ok; ++i) {
+        const int32_t n = expected[i].size();
+
+        if (n_max[i] < n) {
+            // same as llama_tokenize: the negated number of tokens the text needs
+            if (n_tokens[i] != -n) {
+                fprintf(stderr, "    text %d: n_tokens = %d, expected %d\n", i, n_tokens[i], -n);
+                ok = false;
+            }
+            continue;
+        }
+
+        if (n_tokens[i] != n) {
+            fprintf(stderr, "    text %d: n_tokens = %d, expected %d\n", i, n_tokens[i], n);
+            ok = false;
+            continue;
+        }
+        for (int32_t j = 0; j < n; ++j) {
+            if (bufs[i][j] != expected[i][j]) {
+                fprintf(stderr, "    text %d: token %d is %d, expected %d\n", i, j, bufs[i][j], expected[i][j]);
+                ok = false;
+                break;
+            }
+        }
+        if (bufs[i][n_max[i]] != LLAMA_TOKEN_NULL) {
+            fprintf(stderr, "    text %d: write past the end of the buffer\n", i);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const std::vector<std::string> samples = {
+        "",
+        " ",
+        "\n\n",
+        "Hello world",
+        " Hello, world!",
+        " this is 🦙.cpp",
+        "w048 7tuijk dsdfhu",
+        "нещо на Български",
+        "កាន់តែពិសេសអាចខលចេញ",
+        "🚀 (normal) 😶‍🌫️ (multiple emojis concatenated) ✅ (only emoji that has its own token)",
+        "3333333 33333333 ' '' ''' ''''",
+        "<s> [INST] special tokens are </s> parsed <|endoftext|>",
+    };
+
+    // enough text for tokenize_batch to use several threads
+    std::vector<std::string> texts;
+    for (int i = 0; i < 240; ++i) {
+        std::string text;
+        for (int j = 0; j <= i % 23; ++j) {
+            text += samples[(i + j) % samples.size()];
+            text += j % 2 ? " " : "\n";
+        }
+        texts.push_back(i % 17 == 0 ? samples[i % samples.size()] : text);
+    }
+
+    bool ok = true;
+    for (bool parse_special : { false, true }) {
+        for (bool add_special : { false, true }) {
+            // the same thread counts twice to run on reused workers
+            for (int32_t n_threads : { 1, 4, 2, 4, 0 }) {
+                for (int32_t shrink : { 0, 1, 100000 }) {
+                    fprintf(stderr, "⚫ Testing add_special = %d, parse_special = %d, n_threads = %d, shrink = %d\n",
+                        add_special, parse_special, n_threads, shrink);
+                    const bool res = test_batch(vocab, texts, n_threads, shrink, add_special, parse_special);
+                    fprintf(stderr, "  %s\n", res ? "✅︎" : "❌");
+                    ok = ok && res;
+                }
+            }
+        }
+    }
+
+    // concurrent calls share the workers of the vocab
+    {
+        fprintf(stderr, "⚫ Testing concurrent calls\n");
+        bool res[4] = {};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t]() {
+                res[t] = true;
+                for (int k = 0; k < 5; ++k) {
+                    res[t] = test_batch(vocab, texts, 3, t % 2, t < 2, true) && res[t];
+                }
+            });
+        }
+        for (auto & t : threads) {
+            t.join();
+        }
+        const bool res_all = res[0] && res[1] && res[2] && res[3];
+        fprintf(stderr, "  %s\n", res_all ? "✅︎" : "❌");
+        ok = ok && res_all;
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ok ? 0 : 1;
+}